@@ -25,6 +25,17 @@
  * const char *sprinkler_host(void):
  *
  *    Return the name of the machine running this application.
+ *
+ * The /sprinkler/activate URI starts a list of programs and zones at once,
+ * with only one status returned. The POST data is a JSON array where each
+ * item is either {"program":NAME} or {"zone":NAME,"pulse":SECONDS}.
+ *
+ * The time spent in each phase of the background loop, and in each HTTP
+ * request, is measured and reported at the /sprinkler/metrics URI in the
+ * Prometheus text format.
+ *
+ * The /sprinkler/stream URI pushes the status changes as server-sent
+ * events, so that the web clients do not need to poll the status.
  */
 
 #include <sys/types.h>
@@ -35,17 +46,28 @@
 #include "housesprinkler.h"
 
 #include "echttp_cors.h"
+#include "echttp_json.h"
 #include "echttp_static.h"
 #include "houseportalclient.h"
 #include "houselog.h"
 #include "housediscover.h"
 #include "housedepositor.h"
 
+#include "housesprinkler_hash.h"
+#include "housesprinkler_buffer.h"
+#include "housesprinkler_metrics.h"
+#include "housesprinkler_file.h"
+#include "housesprinkler_timer.h"
 #include "housesprinkler_state.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_stream.h"
+#include "housesprinkler_history.h"
+#include "housesprinkler_flow.h"
 #include "housesprinkler_config.h"
 #include "housesprinkler_index.h"
 #include "housesprinkler_feed.h"
 #include "housesprinkler_zone.h"
+#include "housesprinkler_partition.h"
 #include "housesprinkler_control.h"
 #include "housesprinkler_season.h"
 #include "housesprinkler_program.h"
@@ -59,6 +81,43 @@ static char hostname[128];
 
 static int SprinklerDebug = 0;
 
+// The phases of the background loop, as measured.
+//
+#define SPRINKLER_PHASE_CONTROL   0
+#define SPRINKLER_PHASE_INDEX     1
+#define SPRINKLER_PHASE_ZONE      2
+#define SPRINKLER_PHASE_PROGRAM   3
+#define SPRINKLER_PHASE_SCHEDULE  4
+#define SPRINKLER_PHASE_FLUSH     5
+#define SPRINKLER_PHASE_HOUSELOG  6
+#define SPRINKLER_PHASE_DISCOVER  7
+#define SPRINKLER_PHASE_STATE     8
+#define SPRINKLER_PHASE_CONFIG    9
+#define SPRINKLER_PHASE_FILE      10
+#define SPRINKLER_PHASE_DEPOSITOR 11
+#define SPRINKLER_PHASE_FLOW      12
+
+#define SPRINKLER_PHASES          13
+
+static const char *SprinklerPhaseLabel[SPRINKLER_PHASES] = {
+    "phase=\"control\"",
+    "phase=\"index\"",
+    "phase=\"zone\"",
+    "phase=\"program\"",
+    "phase=\"schedule\"",
+    "phase=\"flush\"",
+    "phase=\"houselog\"",
+    "phase=\"discover\"",
+    "phase=\"state\"",
+    "phase=\"config\"",
+    "phase=\"file\"",
+    "phase=\"depositor\"",
+    "phase=\"flow\""
+};
+
+static int SprinklerPhaseMetric[SPRINKLER_PHASES];
+static int SprinklerTickMetric = -1;
+
 static int SprinklerSimSpeed = 0;
 static int SprinklerSimDelta = 0;
 static time_t SprinklerSimStart = 0;
@@ -81,12 +140,26 @@ static void sprinkler_reset (void) {
 
 void sprinkler_refresh (void) {
     housesprinkler_control_reset ();
+    housesprinkler_partition_refresh ();
     housesprinkler_zone_refresh ();
     housesprinkler_index_refresh ();
     housesprinkler_feed_refresh ();
     housesprinkler_season_refresh ();
     housesprinkler_program_refresh ();
     housesprinkler_schedule_refresh ();
+    housesprinkler_flow_refresh ();
+
+    // Only the new controls need to be discovered: the controls that
+    // were already known keep their route.
+    //
+    if (housesprinkler_control_prune () > 0)
+        housesprinkler_control_periodic (0);
+
+    // Now that the control table is final, resolve the references to
+    // the controls and feeds, so that no name lookup is needed later.
+    //
+    housesprinkler_feed_resolve ();
+    housesprinkler_zone_resolve ();
 }
 
 static const char *sprinkler_config (const char *method, const char *uri,
@@ -99,7 +172,6 @@ static const char *sprinkler_config (const char *method, const char *uri,
            return "";
        }
        sprinkler_refresh ();
-       sprinkler_reset();
     } else if (strcmp(method, "GET") == 0) {
        echttp_content_type_json ();
        return housesprinkler_config_latest ();
@@ -107,35 +179,202 @@ static const char *sprinkler_config (const char *method, const char *uri,
     return "";
 }
 
+// The status sections, in the order of the status generation numbers.
+// The JSON text of each section is kept until that section changes.
+//
+typedef void SprinklerStatusWorker (SprinklerBuffer *buffer);
+
+static struct {
+    const char *name;
+    SprinklerStatusWorker *worker;
+    long generation;
+    SprinklerBuffer cache;
+} SprinklerStatusSection[SPRINKLER_STATUS_SECTIONS] = {
+    {"zone",     housesprinkler_zone_status},
+    {"program",  housesprinkler_program_status},
+    {"schedule", housesprinkler_schedule_status},
+    {"control",  housesprinkler_control_status},
+    {"index",    housesprinkler_index_status},
+    {"partition", housesprinkler_partition_status},
+    {"flow",     housesprinkler_flow_status}
+};
+
+static const SprinklerBuffer *sprinkler_status_section (int section) {
+
+    long generation = housesprinkler_status_generation (section);
+
+    if (SprinklerStatusSection[section].cache.data &&
+        SprinklerStatusSection[section].generation == generation)
+        return &(SprinklerStatusSection[section].cache);
+
+    housesprinkler_buffer_reset (&(SprinklerStatusSection[section].cache));
+    SprinklerStatusSection[section].worker
+        (&(SprinklerStatusSection[section].cache));
+    SprinklerStatusSection[section].generation = generation;
+    return &(SprinklerStatusSection[section].cache);
+}
+
+// Format the status, or only the sections that changed after the specified
+// generation. A generation that is unknown (e.g. from before a restart, see
+// housesprinkler_status_since()) causes a complete status. Return the
+// generation of the status.
+//
+static long sprinkler_status_format (SprinklerBuffer *buffer, long since) {
+
+    int i;
+
+    long latest = housesprinkler_status_generation (-1);
+    if (since > latest) since = -1;
+
+    housesprinkler_buffer_reset (buffer);
+    housesprinkler_buffer_printf (buffer,
+                       "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%ld,\"generation\":\"%s\",\"sprinkler\":{",
+              hostname, houseportal_server(), (long)time(0),
+              housesprinkler_status_token (latest));
+
+    const char *prefix = "";
+    for (i = 0; i < SPRINKLER_STATUS_SECTIONS; ++i) {
+        if (since >= 0 && housesprinkler_status_generation (i) <= since)
+            continue;
+        const SprinklerBuffer *section = sprinkler_status_section (i);
+        housesprinkler_buffer_printf (buffer, "%s\"%s\":{",
+                                      prefix, SprinklerStatusSection[i].name);
+        housesprinkler_buffer_append (buffer,
+                                      housesprinkler_buffer_text (section),
+                                      housesprinkler_buffer_length (section));
+        housesprinkler_buffer_printf (buffer, "}");
+        prefix = ",";
+    }
+    housesprinkler_buffer_printf (buffer, "}}");
+    return latest;
+}
+
 static const char *sprinkler_status (const char *method, const char *uri,
                                      const char *data, int length) {
-    static char buffer[65537];
-    int cursor;
-
-    cursor = snprintf (buffer, sizeof(buffer),
-                       "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%ld,\"sprinkler\":{\"zone\":{",
-              hostname, houseportal_server(), time(0));
-    cursor += housesprinkler_zone_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor,sizeof(buffer)-cursor, "},\"program\":{");
-    cursor += housesprinkler_program_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor,sizeof(buffer)-cursor, "},\"schedule\":{");
-    cursor += housesprinkler_schedule_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor,sizeof(buffer)-cursor, "},\"control\":{");
-    cursor += housesprinkler_control_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor,sizeof(buffer)-cursor, "},\"index\":{");
-    cursor += housesprinkler_index_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor,sizeof(buffer)-cursor, "}}}");
-
-    if (cursor > sizeof(buffer))
-        houselog_trace (HOUSE_FAILURE, "STATUS",
-                        "BUFFER TOO SMALL (NEED %d bytes)", cursor);
+    static SprinklerBuffer buffer;
+
+    // Nothing to format if the client already has the latest status.
+    // (The timestamp is not considered part of the status.)
+    //
+    const char *etag = housesprinkler_status_etag ();
+    const char *match = echttp_attribute_get ("If-None-Match");
+    echttp_attribute_set ("ETag", etag);
+    echttp_attribute_set ("Cache-Control", "no-cache");
+    if (match && strstr (match, etag)) {
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+
+    // With the since parameter, only report the sections that changed
+    // after the specified generation.
+    //
+    long since =
+        housesprinkler_status_since (echttp_parameter_get ("since"));
+
+    sprinkler_status_format (&buffer, since);
+
+    echttp_content_type_json ();
+    return housesprinkler_buffer_text (&buffer);
+}
+
+// The /sprinkler/stream URI starts a stream of server-sent events. The
+// first event is the complete status, or the sections that changed after
+// the Last-Event-ID when the browser reconnects. Each following event
+// contains only the status sections that changed, in the same format as
+// /sprinkler/status?since=N.
+//
+static long SprinklerStreamGeneration = 0;
+
+static const char *sprinkler_stream (const char *method, const char *uri,
+                                     const char *data, int length) {
+    static SprinklerBuffer buffer;
+
+    long since =
+        housesprinkler_status_since (echttp_attribute_get ("Last-Event-ID"));
+
+    long latest = sprinkler_status_format (&buffer, since);
+    int fd = housesprinkler_stream_open
+                 (housesprinkler_status_token (latest),
+                  "status", housesprinkler_buffer_text (&buffer));
+    if (fd < 0) {
+        echttp_error (503, "Service Unavailable");
+        return "";
+    }
+    if (housesprinkler_stream_active () == 1)
+        SprinklerStreamGeneration = latest;
+
+    echttp_attribute_set ("Cache-Control", "no-cache");
+    echttp_content_type_set ("text/event-stream");
+    echttp_transfer (fd, SPRINKLER_STREAM_SIZE);
+    return "";
+}
+
+// Push the status sections that changed to all the open streams.
+//
+static void sprinkler_stream_push (void) {
+
+    static SprinklerBuffer buffer;
+
+    if (!housesprinkler_stream_active ()) return;
+    if (housesprinkler_status_generation (-1) == SprinklerStreamGeneration)
+        return;
+
+    SprinklerStreamGeneration =
+        sprinkler_status_format (&buffer, SprinklerStreamGeneration);
+    housesprinkler_stream_send
+        (housesprinkler_status_token (SprinklerStreamGeneration),
+         "status", housesprinkler_buffer_text (&buffer));
+}
+
+// The /sprinkler/history URI returns the recent zone pulses, one page at
+// a time: the since parameter is the ID of the latest record already
+// received, and count is the maximum number of records to return.
+//
+#define SPRINKLER_HISTORY_PAGE    100
+#define SPRINKLER_HISTORY_MAXPAGE 1000
+
+static const char *sprinkler_history (const char *method, const char *uri,
+                                      const char *data, int length) {
+    static SprinklerBuffer buffer;
+
+    long since = 0;
+    int count = SPRINKLER_HISTORY_PAGE;
+    const char *param = echttp_parameter_get ("since");
+    if (param) since = atol (param);
+    param = echttp_parameter_get ("count");
+    if (param) count = atoi (param);
+    if (count <= 0) count = SPRINKLER_HISTORY_PAGE;
+    if (count > SPRINKLER_HISTORY_MAXPAGE) count = SPRINKLER_HISTORY_MAXPAGE;
+
+    time_t now = time(0);
+    housesprinkler_buffer_reset (&buffer);
+    housesprinkler_buffer_printf (&buffer,
+            "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%ld,\"sprinkler\":{\"history\":{",
+            hostname, houseportal_server(), (long)now);
+    housesprinkler_history_status (&buffer, since, count, now);
+    housesprinkler_buffer_printf (&buffer, "}}}");
+
     echttp_content_type_json ();
-    return buffer;
+    return housesprinkler_buffer_text (&buffer);
+}
+
+static const char *sprinkler_season_preview (const char *method, const char *uri,
+                                             const char *data, int length) {
+    static SprinklerBuffer buffer;
+
+    housesprinkler_buffer_reset (&buffer);
+    housesprinkler_buffer_printf (&buffer,
+            "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":%ld,\"sprinkler\":{\"season\":{",
+            hostname, houseportal_server(), (long)time(0));
+    housesprinkler_season_preview (&buffer);
+    housesprinkler_buffer_printf (&buffer, "}}}");
+
+    echttp_content_type_json ();
+    return housesprinkler_buffer_text (&buffer);
 }
 
 static const char *sprinkler_raindelay (const char *method, const char *uri,
                                         const char *data, int length) {
-    static char buffer[65537];
     int duration;
 
     const char *amount = echttp_parameter_get ("amount");
@@ -148,8 +387,6 @@ static const char *sprinkler_raindelay (const char *method, const char *uri,
 
 static const char *sprinkler_rain (const char *method, const char *uri,
                                    const char *data, int length) {
-    static char buffer[65537];
-
     const char *active = echttp_parameter_get ("active");
     if (!active) active = "true";
 
@@ -159,8 +396,6 @@ static const char *sprinkler_rain (const char *method, const char *uri,
 
 static const char *sprinkler_index (const char *method, const char *uri,
                                     const char *data, int length) {
-    static char buffer[65537];
-
     const char *active = echttp_parameter_get ("active");
     if (!active) active = "true";
 
@@ -198,19 +433,134 @@ static const char *sprinkler_zone_on (const char *method, const char *uri,
     const char *zone = echttp_parameter_get ("name");
     const char *runtime = echttp_parameter_get ("pulse");
     if (zone) {
-        housesprinkler_zone_activate (zone, runtime?atoi(runtime):30, 0);
+        housesprinkler_zone_activate (housesprinkler_zone_find (zone),
+                                      runtime?atoi(runtime):30, 0, 100);
     }
     return sprinkler_status (method, uri, data, length);
 }
 
+static const char *sprinkler_activate (const char *method, const char *uri,
+                                       const char *data, int length) {
+
+    static ParserToken *tokens = 0;
+    static int tokensize = 0;
+    static int *list = 0;
+    static int listsize = 0;
+    static const char **programs = 0;
+
+    int i;
+
+    if (strcmp (method, "POST")) {
+        echttp_error (405, "Method Not Allowed");
+        return "";
+    }
+    if (!data || length <= 0) {
+        echttp_error (400, "No data");
+        return "";
+    }
+    char *text = echttp_parser_string (data);
+    int count = echttp_json_estimate (text);
+    if (count > tokensize) {
+        ParserToken *grown =
+            realloc (tokens, (count + 16) * sizeof(ParserToken));
+        if (!grown) {
+            echttp_parser_free (text);
+            echttp_error (500, "No more memory");
+            return "";
+        }
+        tokens = grown;
+        tokensize = count + 16;
+    }
+    const char *error = echttp_json_parse (text, tokens, &count);
+    if (!error && (count <= 0 || tokens[0].type != PARSER_ARRAY))
+        error = "not a JSON array";
+    int n = error ? 0 : tokens[0].length;
+    if (n > listsize) {
+        int *grownlist = realloc (list, (n + 16) * sizeof(int));
+        if (grownlist) list = grownlist;
+        const char **grownprograms =
+            realloc (programs, (n + 16) * sizeof(const char *));
+        if (grownprograms) programs = grownprograms;
+        if (!grownlist || !grownprograms) {
+            echttp_parser_free (text);
+            echttp_error (500, "No more memory");
+            return "";
+        }
+        listsize = n + 16;
+    }
+    if (!error && n > 0) error = echttp_json_enumerate (tokens, list);
+
+    // Check the whole request before activating anything.
+    //
+    for (i = 0; i < n && !error; ++i) {
+        ParserToken *item = tokens + list[i];
+        int program = echttp_json_search (item, ".program");
+        if (program > 0 && item[program].type == PARSER_STRING) continue;
+        int zone = echttp_json_search (item, ".zone");
+        if (zone <= 0 || item[zone].type != PARSER_STRING) {
+            error = "no program or zone name";
+            break;
+        }
+        if (housesprinkler_zone_find (item[zone].value.string) < 0) {
+            error = "unknown zone";
+            break;
+        }
+        int pulse = echttp_json_search (item, ".pulse");
+        if (pulse > 0 && (item[pulse].type != PARSER_INTEGER ||
+                          item[pulse].value.integer <= 0)) {
+            error = "invalid pulse";
+            break;
+        }
+    }
+    if (error) {
+        echttp_parser_free (text);
+        echttp_error (400, error);
+        return "";
+    }
+
+    // The zones are queued first, in the order listed, and then all the
+    // programs are started together.
+    //
+    int programcount = 0;
+    for (i = 0; i < n; ++i) {
+        ParserToken *item = tokens + list[i];
+        int program = echttp_json_search (item, ".program");
+        if (program > 0 && item[program].type == PARSER_STRING) {
+            programs[programcount++] = item[program].value.string;
+            continue;
+        }
+        int zone = echttp_json_search (item, ".zone");
+        int pulse = echttp_json_search (item, ".pulse");
+        int runtime = 30;
+        if (pulse > 0) runtime = (int)(item[pulse].value.integer);
+        housesprinkler_zone_activate
+            (housesprinkler_zone_find (item[zone].value.string),
+             runtime, 0, 100);
+    }
+    housesprinkler_program_start_batch (programs, programcount);
+    echttp_parser_free (text);
+
+    return sprinkler_status (method, uri, data, length);
+}
+
 static const char *sprinkler_zone_off (const char *method, const char *uri,
                                        const char *data, int length) {
 
     housesprinkler_zone_stop ();
-    housesprinkler_control_cancel (0);
+    housesprinkler_control_cancel_all ();
     return sprinkler_status (method, uri, data, length);
 }
 
+static const char *sprinkler_metrics (const char *method, const char *uri,
+                                      const char *data, int length) {
+    static SprinklerBuffer buffer;
+
+    housesprinkler_buffer_reset (&buffer);
+    housesprinkler_metrics_format (&buffer);
+    echttp_content_type_set ("text/plain; version=0.0.4");
+    return housesprinkler_buffer_text (&buffer);
+}
+
 static const char *sprinkler_weather (const char *method, const char *uri,
                                      const char *data, int length) {
     echttp_content_type_json ();
@@ -219,20 +569,99 @@ static const char *sprinkler_weather (const char *method, const char *uri,
 
 static const char *sprinkler_weatheron (const char *method, const char *uri,
                                         const char *data, int length) {
-    static char buffer[65537];
-
     echttp_content_type_json ();
     return "";
 }
 
 static const char *sprinkler_weatheroff (const char *method, const char *uri,
                                          const char *data, int length) {
-    static char buffer[65537];
-
     echttp_content_type_json ();
     return "";
 }
 
+// All the HTTP requests go through sprinkler_timed(), which measures
+// the time spent in each route.
+//
+typedef const char *SprinklerRoute (const char *method, const char *uri,
+                                    const char *data, int length);
+
+static struct {
+    const char *uri;
+    SprinklerRoute *route;
+    int metric;
+} SprinklerRoutes[] = {
+    {"/sprinkler/config",      sprinkler_config},
+    {"/sprinkler/status",      sprinkler_status},
+    {"/sprinkler/stream",      sprinkler_stream},
+    {"/sprinkler/history",     sprinkler_history},
+    {"/sprinkler/season/preview", sprinkler_season_preview},
+    {"/sprinkler/raindelay",   sprinkler_raindelay},
+    {"/sprinkler/rain",        sprinkler_rain},
+    {"/sprinkler/index",       sprinkler_index},
+    {"/sprinkler/refresh",     sprinkler_rescan},
+    {"/sprinkler/metrics",     sprinkler_metrics},
+
+    {"/sprinkler/program/on",  sprinkler_program_on},
+    {"/sprinkler/zone/on",     sprinkler_zone_on},
+    {"/sprinkler/zone/off",    sprinkler_zone_off},
+    {"/sprinkler/activate",    sprinkler_activate},
+    {"/sprinkler/onoff",       sprinkler_onoff},
+
+    {"/sprinkler/weather/on",  sprinkler_weatheron},
+    {"/sprinkler/weather/off", sprinkler_weatheroff},
+    {"/sprinkler/weather",     sprinkler_weather},
+    {0, 0}
+};
+
+static SprinklerHash SprinklerRoutesByUri;
+
+static const char *sprinkler_timed (const char *method, const char *uri,
+                                    const char *data, int length) {
+
+    int i = housesprinkler_hash_find (&SprinklerRoutesByUri, uri);
+    if (i < 0) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    long long started = housesprinkler_metrics_clock ();
+    const char *result = SprinklerRoutes[i].route (method, uri, data, length);
+    housesprinkler_metrics_record (SprinklerRoutes[i].metric, started);
+    return result;
+}
+
+static void sprinkler_metrics_initialize (void) {
+
+    int i;
+    char label[256];
+
+    SprinklerTickMetric =
+        housesprinkler_metrics_declare ("sprinkler_loop_tick_seconds",
+                                        "Duration of the background loop.", "");
+    for (i = 0; i < SPRINKLER_PHASES; ++i) {
+        SprinklerPhaseMetric[i] =
+            housesprinkler_metrics_declare ("sprinkler_loop_phase_seconds",
+                                            "Duration of each background phase.",
+                                            SprinklerPhaseLabel[i]);
+    }
+
+    for (i = 0; SprinklerRoutes[i].uri; ++i) ;
+    housesprinkler_hash_reset (&SprinklerRoutesByUri, i);
+    for (i = 0; SprinklerRoutes[i].uri; ++i) {
+        snprintf (label, sizeof(label), "route=\"%s\"", SprinklerRoutes[i].uri);
+        SprinklerRoutes[i].metric =
+            housesprinkler_metrics_declare ("sprinkler_http_request_seconds",
+                                            "Duration of each HTTP request.",
+                                            strdup(label));
+        housesprinkler_hash_add (&SprinklerRoutesByUri, SprinklerRoutes[i].uri, i);
+        echttp_route_uri (SprinklerRoutes[i].uri, sprinkler_timed);
+    }
+}
+
+static long long sprinkler_phase (int phase, long long started) {
+    housesprinkler_metrics_record (SprinklerPhaseMetric[phase], started);
+    return housesprinkler_metrics_clock ();
+}
+
 static void hs_background (int fd, int mode) {
 
     static time_t DelayConfigDiscovery = 0;
@@ -240,9 +669,16 @@ static void hs_background (int fd, int mode) {
     static time_t LastRenewal = 0;
     time_t now = time(0);
 
+    // Send the control commands issued by the latest HTTP requests,
+    // and report the resulting changes right away.
+    housesprinkler_control_flush ();
+    sprinkler_stream_push ();
+
     if (now == LastCall) return;
     LastCall = now;
 
+    long long tick = housesprinkler_metrics_clock ();
+
     if (use_houseportal) {
         static const char *path[] = {"sprinkler:/sprinkler"};
         if (now >= LastRenewal + 60) {
@@ -253,22 +689,58 @@ static void hs_background (int fd, int mode) {
             LastRenewal = now;
         }
     }
+    long long mark = housesprinkler_metrics_clock ();
+
+    // The sprinkler modules have nothing to do until one of their
+    // deadlines has been reached: this is most of the time.
+    //
+    time_t scheduling = sprinkler_schedulingtime(now);
+    int pending = housesprinkler_timer_pending (now, scheduling);
+
     // Do not try to discover other service immediately: wait for two seconds
-    // after the first request to the portal. No need to schedule any watering
-    // until then, either.
+    // after the first request to the portal. The watering does not need
+    // to wait: the controls start with the routes saved before restart.
     if (!DelayConfigDiscovery) DelayConfigDiscovery = now + 2;
-    if (now >= DelayConfigDiscovery) {
-        housesprinkler_control_periodic(now);
-        housesprinkler_index_periodic (now);
-        housesprinkler_zone_periodic(sprinkler_schedulingtime(now));
-        housesprinkler_program_periodic(sprinkler_schedulingtime(now));
-        housesprinkler_schedule_periodic(sprinkler_schedulingtime(now));
+    if (pending) {
+        if (now >= DelayConfigDiscovery) {
+            housesprinkler_control_periodic(now);
+            mark = sprinkler_phase (SPRINKLER_PHASE_CONTROL, mark);
+            housesprinkler_index_periodic (now);
+            mark = sprinkler_phase (SPRINKLER_PHASE_INDEX, mark);
+            housesprinkler_flow_periodic (now);
+            mark = sprinkler_phase (SPRINKLER_PHASE_FLOW, mark);
+        }
+        housesprinkler_zone_periodic(scheduling);
+        mark = sprinkler_phase (SPRINKLER_PHASE_ZONE, mark);
+        housesprinkler_program_periodic(scheduling);
+        mark = sprinkler_phase (SPRINKLER_PHASE_PROGRAM, mark);
+        housesprinkler_schedule_periodic(scheduling);
+        mark = sprinkler_phase (SPRINKLER_PHASE_SCHEDULE, mark);
+
+        // All the zone and feed commands for this second go out together.
+        housesprinkler_control_flush ();
+        mark = sprinkler_phase (SPRINKLER_PHASE_FLUSH, mark);
     }
     houselog_background (now);
+    mark = sprinkler_phase (SPRINKLER_PHASE_HOUSELOG, mark);
     housediscover (now);
-    housesprinkler_state_periodic(now);
-    housesprinkler_config_periodic();
+    mark = sprinkler_phase (SPRINKLER_PHASE_DISCOVER, mark);
+    if (pending) {
+        housesprinkler_partition_periodic(now);
+        housesprinkler_state_periodic(now);
+        mark = sprinkler_phase (SPRINKLER_PHASE_STATE, mark);
+        housesprinkler_config_periodic();
+        mark = sprinkler_phase (SPRINKLER_PHASE_CONFIG, mark);
+        housesprinkler_file_periodic(now);
+        mark = sprinkler_phase (SPRINKLER_PHASE_FILE, mark);
+    }
     housedepositor_periodic (now);
+    sprinkler_phase (SPRINKLER_PHASE_DEPOSITOR, mark);
+
+    sprinkler_stream_push ();
+    housesprinkler_stream_periodic (now);
+
+    housesprinkler_metrics_record (SprinklerTickMetric, tick);
 }
 
 static void sprinkler_protect (const char *method, const char *uri) {
@@ -338,6 +810,7 @@ int main (int argc, const char **argv) {
     houselog_initialize ("sprinkler", argc, argv);
     housedepositor_initialize (argc, argv);
 
+    housesprinkler_partition_initialize (argc, argv);
     housesprinkler_state_load (argc, argv);
     const char *error = housesprinkler_config_load (argc, argv);
     if (error) {
@@ -350,21 +823,7 @@ int main (int argc, const char **argv) {
     echttp_cors_allow_method("GET");
     echttp_protect (0, sprinkler_protect);
 
-    echttp_route_uri ("/sprinkler/config", sprinkler_config);
-    echttp_route_uri ("/sprinkler/status", sprinkler_status);
-    echttp_route_uri ("/sprinkler/raindelay", sprinkler_raindelay);
-    echttp_route_uri ("/sprinkler/rain", sprinkler_rain);
-    echttp_route_uri ("/sprinkler/index", sprinkler_index);
-    echttp_route_uri ("/sprinkler/refresh", sprinkler_rescan);
-
-    echttp_route_uri ("/sprinkler/program/on", sprinkler_program_on);
-    echttp_route_uri ("/sprinkler/zone/on",    sprinkler_zone_on);
-    echttp_route_uri ("/sprinkler/zone/off",   sprinkler_zone_off);
-    echttp_route_uri ("/sprinkler/onoff",      sprinkler_onoff);
-
-    echttp_route_uri ("/sprinkler/weather/on",  sprinkler_weatheron);
-    echttp_route_uri ("/sprinkler/weather/off", sprinkler_weatheroff);
-    echttp_route_uri ("/sprinkler/weather",     sprinkler_weather);
+    sprinkler_metrics_initialize ();
 
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&hs_background);
@@ -0,0 +1,133 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_arena.c - A memory pool released in one step.
+ *
+ * SYNOPSYS:
+ *
+ * This module provides a simple memory pool for the tables that have the
+ * same lifetime, typically all the data derived from one configuration.
+ * Allocating is only moving a pointer forward, and all the memory is
+ * released at once when the arena is reset.
+ *
+ * The arena does not return its memory to the heap when reset: the same
+ * block is reused for the next set of tables. If the block was too small,
+ * the allocations that did not fit were given their own memory, and the
+ * block is resized on the next reset to fit all of them. Once the arena
+ * has reached its working size, reusing it does not call malloc at all.
+ *
+ * void housesprinkler_arena_reset (SprinklerArena *arena);
+ *
+ *    Release all the memory allocated from the arena. All pointers
+ *    previously returned for this arena become invalid.
+ *
+ * void *housesprinkler_arena_alloc (SprinklerArena *arena, int size);
+ *
+ *    Return a zeroed memory area of the specified size, or 0 if there
+ *    is no more memory.
+ *
+ * char *housesprinkler_arena_strdup (SprinklerArena *arena, const char *text);
+ *
+ *    Return a copy of the string, allocated from the arena.
+ *
+ * int housesprinkler_arena_used (const SprinklerArena *arena);
+ *
+ *    Return the amount of memory currently allocated from the arena.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "housesprinkler.h"
+#include "housesprinkler_arena.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(s) (((s) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// An allocation that did not fit in the arena's block. There should be
+// none once the arena has reached its working size.
+//
+typedef struct SprinklerArenaExtra {
+    struct SprinklerArenaExtra *next;
+} SprinklerArenaExtra;
+
+#define ARENA_EXTRA ARENA_ROUND(sizeof(SprinklerArenaExtra))
+
+void housesprinkler_arena_reset (SprinklerArena *arena) {
+
+    SprinklerArenaExtra *extra = (SprinklerArenaExtra *)(arena->extra);
+
+    if (extra) {
+        while (extra) {
+            SprinklerArenaExtra *next = extra->next;
+            free (extra);
+            extra = next;
+        }
+        arena->extra = 0;
+
+        // Grow the block to fit everything that was allocated, plus some
+        // margin, so that the next cycle does not spill again.
+        size_t size = arena->used + arena->overflow;
+        size += size / 4;
+        DEBUG ("Resizing arena from %d to %d bytes\n",
+               (int)(arena->size), (int)size);
+        if (arena->data) free (arena->data);
+        arena->data = malloc (size);
+        arena->size = arena->data ? size : 0;
+    }
+    arena->used = 0;
+    arena->overflow = 0;
+}
+
+void *housesprinkler_arena_alloc (SprinklerArena *arena, int size) {
+
+    if (size <= 0) return 0;
+    size_t rounded = ARENA_ROUND((size_t)size);
+
+    if (arena->data && arena->used + rounded <= arena->size) {
+        char *p = arena->data + arena->used;
+        arena->used += rounded;
+        memset (p, 0, size);
+        return p;
+    }
+    SprinklerArenaExtra *extra = calloc (1, ARENA_EXTRA + rounded);
+    if (!extra) return 0;
+    extra->next = (SprinklerArenaExtra *)(arena->extra);
+    arena->extra = extra;
+    arena->overflow += rounded;
+    return ((char *)extra) + ARENA_EXTRA;
+}
+
+char *housesprinkler_arena_strdup (SprinklerArena *arena, const char *text) {
+
+    if (!text) return 0;
+    int length = strlen (text) + 1;
+    char *copy = housesprinkler_arena_alloc (arena, length);
+    if (copy) memcpy (copy, text, length);
+    return copy;
+}
+
+int housesprinkler_arena_used (const SprinklerArena *arena) {
+    return (int)(arena->used + arena->overflow);
+}
+
@@ -0,0 +1,36 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_arena.h - A memory pool released in one step.
+ */
+
+typedef struct {
+    char  *data;     // The main block, reused after each reset.
+    size_t size;
+    size_t used;
+    size_t overflow; // Total of the allocations that did not fit.
+    void  *extra;    // The list of these allocations.
+} SprinklerArena;
+
+void  housesprinkler_arena_reset  (SprinklerArena *arena);
+void *housesprinkler_arena_alloc  (SprinklerArena *arena, int size);
+char *housesprinkler_arena_strdup (SprinklerArena *arena, const char *text);
+int   housesprinkler_arena_used   (const SprinklerArena *arena);
+
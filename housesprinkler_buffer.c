@@ -0,0 +1,134 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_buffer.c - A growable text buffer.
+ *
+ * SYNOPSYS:
+ *
+ * This module is used to build JSON text (status and backup) without
+ * any fixed size limit. When the buffer is too small, it grows and only
+ * the item that did not fit is formatted again.
+ *
+ * Buffers are meant to be static and are reused: the memory is never
+ * released, so that the buffer quickly reaches its nominal size and then
+ * stops allocating.
+ *
+ * void housesprinkler_buffer_reset (SprinklerBuffer *buffer);
+ *
+ *    Erase the content of the buffer, keeping the memory allocated.
+ *
+ * void housesprinkler_buffer_printf (SprinklerBuffer *buffer,
+ *                                    const char *format, ...);
+ *
+ *    Append formatted text at the end of the buffer.
+ *
+ * void housesprinkler_buffer_append (SprinklerBuffer *buffer,
+ *                                    const char *text, int length);
+ *
+ *    Append the specified text at the end of the buffer. If length is
+ *    negative, the text is assumed to be null terminated.
+ *
+ * const char *housesprinkler_buffer_text (const SprinklerBuffer *buffer);
+ * int housesprinkler_buffer_length (const SprinklerBuffer *buffer);
+ *
+ *    Access the content of the buffer. The text is always null terminated
+ *    (an empty buffer returns an empty string, never a null pointer).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "houselog.h"
+
+#include "housesprinkler.h"
+#include "housesprinkler_buffer.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define BUFFER_MINIMUM_SIZE 1024
+
+static int housesprinkler_buffer_grow (SprinklerBuffer *buffer, int needed) {
+
+    int size = buffer->size ? buffer->size : BUFFER_MINIMUM_SIZE;
+    while (size < needed) size *= 2;
+    if (size <= buffer->size) return 1;
+
+    char *data = realloc (buffer->data, size);
+    if (!data) {
+        houselog_trace (HOUSE_FAILURE, "BUFFER",
+                        "no more memory (NEED %d bytes)", size);
+        return 0;
+    }
+    DEBUG ("Buffer resized from %d to %d bytes\n", buffer->size, size);
+    buffer->data = data;
+    buffer->size = size;
+    return 1;
+}
+
+void housesprinkler_buffer_reset (SprinklerBuffer *buffer) {
+    buffer->length = 0;
+    if (buffer->data) buffer->data[0] = 0;
+}
+
+void housesprinkler_buffer_printf (SprinklerBuffer *buffer,
+                                   const char *format, ...) {
+    va_list args;
+    int available = buffer->size - buffer->length;
+
+    va_start (args, format);
+    int needed = vsnprintf (buffer->data ? buffer->data + buffer->length : 0,
+                            available > 0 ? available : 0, format, args);
+    va_end (args);
+    if (needed < 0) return;
+
+    if (needed >= available) {
+        // Format this item again, now that there is enough room.
+        if (!housesprinkler_buffer_grow (buffer, buffer->length + needed + 1)) {
+            if (buffer->data) buffer->data[buffer->length] = 0;
+            return;
+        }
+        va_start (args, format);
+        vsnprintf (buffer->data + buffer->length,
+                   buffer->size - buffer->length, format, args);
+        va_end (args);
+    }
+    buffer->length += needed;
+}
+
+void housesprinkler_buffer_append (SprinklerBuffer *buffer,
+                                   const char *text, int length) {
+
+    if (length < 0) length = strlen(text);
+    if (!housesprinkler_buffer_grow (buffer, buffer->length + length + 1))
+        return;
+    memcpy (buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = 0;
+}
+
+const char *housesprinkler_buffer_text (const SprinklerBuffer *buffer) {
+    return buffer->data ? buffer->data : "";
+}
+
+int housesprinkler_buffer_length (const SprinklerBuffer *buffer) {
+    return buffer->length;
+}
+
@@ -0,0 +1,44 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_buffer.h - A growable text buffer.
+ */
+
+#ifndef HOUSESPRINKLER_BUFFER_H
+#define HOUSESPRINKLER_BUFFER_H
+
+typedef struct {
+    char *data;
+    int   size;
+    int   length;
+} SprinklerBuffer;
+
+void housesprinkler_buffer_reset  (SprinklerBuffer *buffer);
+void housesprinkler_buffer_printf (SprinklerBuffer *buffer,
+                                   const char *format, ...)
+                                   __attribute__((format(printf, 2, 3)));
+void housesprinkler_buffer_append (SprinklerBuffer *buffer,
+                                   const char *text, int length);
+
+const char *housesprinkler_buffer_text   (const SprinklerBuffer *buffer);
+int         housesprinkler_buffer_length (const SprinklerBuffer *buffer);
+
+#endif
+
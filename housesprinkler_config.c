@@ -37,13 +37,38 @@
  *    Update both the live configuration and the configuration file with
  *    the provided text.
  *
+ * const SprinklerConfig *housesprinkler_config_compiled (void);
+ *
+ *    Return the tables of zones, feeds, programs, schedules and seasons
+ *    that were compiled from the current configuration. The compilation
+ *    walks the JSON tokens once, when the configuration is loaded, so that
+ *    the modules do not need to search for each individual item. The
+ *    strings point to the configuration data: they remain valid until
+ *    the configuration changes twice. This way the strings of the previous
+ *    configuration can still be used while the modules compare it with
+ *    the new one.
+ *
+ * void *housesprinkler_config_allocate (int count, int size);
+ *
+ *    Allocate a zeroed table for the current configuration. The table
+ *    is released with the configuration data: it remains valid until the
+ *    configuration changes twice, and it must not be freed.
+ *
+ *    The configuration text, its JSON tokens, the compiled tables and the
+ *    modules' tables are all allocated from one arena per configuration.
+ *    Two arenas are used in turn: a configuration change reuses the arena
+ *    of the configuration before the previous one, so that loading a new
+ *    configuration does not allocate or free any memory once the arenas
+ *    have grown to their working size.
+ *
  * int         housesprinkler_config_exists  (int parent, const char *path);
  * const char *housesprinkler_config_string  (int parent, const char *path);
  * int         housesprinkler_config_integer (int parent, const char *path);
  * int         housesprinkler_config_boolean (int parent, const char *path);
  *
  *    Access individual items starting from the specified parent
- *    (the config root is index 0).
+ *    (the config root is index 0). These functions search the JSON tokens
+ *    on every call: use the compiled tables when possible.
  *
  * int housesprinkler_config_array (int parent, const char *path);
  * int housesprinkler_config_array_length (int array);
@@ -82,16 +107,24 @@
 #include "housedepositor.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_file.h"
+#include "housesprinkler_arena.h"
 #include "housesprinkler_config.h"
 
 #define DEBUG if (sprinkler_isdebug()) printf
 
 static ParserToken *ConfigParsed = 0;
-static int   ConfigTokenAllocated = 0;
 static int   ConfigTokenCount = 0;
 static char *ConfigText = 0;
 static char *ConfigTextLatest = 0;
 
+// The current configuration is allocated from ConfigArena[ConfigArenaCurrent],
+// the previous one is still in the other arena.
+//
+static SprinklerArena ConfigArena[2];
+static int ConfigArenaCurrent = 0;
+static int ConfigArenaInUse = 0; // The modules have used the current one.
+
 static int ConfigFileEnabled = 1;
 
 static const char *ConfigFile = "/etc/house/sprinkler.json";
@@ -100,33 +133,383 @@ static const char FactoryDefaultsConfigFile[] =
                       "/usr/local/share/house/public/sprinkler/defaults.json";
 static int UseFactoryDefaults = 0;
 
+static SprinklerConfig ConfigCompiled;
+
+static SprinklerArena *housesprinkler_config_arena (void) {
+    return ConfigArena + ConfigArenaCurrent;
+}
+
+void *housesprinkler_config_allocate (int count, int size) {
+    if (count <= 0) return 0;
+    return housesprinkler_arena_alloc (housesprinkler_config_arena(),
+                                       count * size);
+}
+
+static void housesprinkler_config_uncompile (void) {
+    // The tables are in the arena: released with the configuration.
+    memset (&ConfigCompiled, 0, sizeof(ConfigCompiled));
+}
+
 static void housesprinkler_config_clear (const char *reason) {
 
-    if (ConfigText) {
-        echttp_parser_free (ConfigText);
-        ConfigText = 0;
+    housesprinkler_config_uncompile ();
+
+    // The modules' tables still point to the previous configuration
+    // until they have been refreshed: keep it until the next change.
+    // A configuration that was never used by the modules (e.g. it failed
+    // to parse) does not need to be kept: its arena is simply reused.
+    //
+    if (ConfigArenaInUse) {
+        ConfigArenaCurrent = 1 - ConfigArenaCurrent;
+        ConfigArenaInUse = 0;
     }
+    DEBUG ("Config arena %d released %d bytes\n", ConfigArenaCurrent,
+           housesprinkler_arena_used (housesprinkler_config_arena()));
+    housesprinkler_arena_reset (housesprinkler_config_arena());
+
+    ConfigText = 0;
+    ConfigTextLatest = 0;
+    ConfigParsed = 0;
     ConfigTokenCount = 0;
     DEBUG ("Config cleared (%s).\n", reason);
 }
 
+// The JSON tokens are organized as a tree: each array or object token
+// is immediately followed by its elements. Return the index of the token
+// that follows the specified token and all of its elements.
+//
+static int housesprinkler_config_skip (int token) {
+
+    int i;
+    int next = token + 1;
+
+    switch (ConfigParsed[token].type) {
+        case PARSER_ARRAY:
+        case PARSER_OBJECT:
+            for (i = 0; i < ConfigParsed[token].length; ++i) {
+                if (next >= ConfigTokenCount) break;
+                next = housesprinkler_config_skip (next);
+            }
+    }
+    return next;
+}
+
+static const char *housesprinkler_config_tostring (int token) {
+    if (ConfigParsed[token].type != PARSER_STRING) return 0;
+    return ConfigParsed[token].value.string;
+}
+
+static int housesprinkler_config_tointeger (int token) {
+    if (ConfigParsed[token].type != PARSER_INTEGER) return 0;
+    return (int)(ConfigParsed[token].value.integer);
+}
+
+static int housesprinkler_config_toboolean (int token) {
+    if (ConfigParsed[token].type != PARSER_BOOL) return 0;
+    return ConfigParsed[token].value.bool;
+}
+
+static int housesprinkler_config_iskey (int token, const char *key) {
+    return ConfigParsed[token].key && !strcmp (ConfigParsed[token].key, key);
+}
+
+// Allocate a table that matches the size of an array token.
+// The elements of the array are then compiled one by one by the caller.
+//
+static void *housesprinkler_config_table (int token, int size, int *count) {
+
+    *count = 0;
+    if (ConfigParsed[token].type != PARSER_ARRAY) return 0;
+    if (ConfigParsed[token].length <= 0) return 0;
+    void *table = housesprinkler_config_allocate (ConfigParsed[token].length, size);
+    if (table) *count = ConfigParsed[token].length;
+    return table;
+}
+
+static void housesprinkler_config_compile_zone (int token,
+                                                SprinklerConfigZone *zone) {
+    int i;
+    int item = token + 1;
+
+    if (ConfigParsed[token].type != PARSER_OBJECT) return;
+
+    for (i = 0; i < ConfigParsed[token].length; ++i) {
+        if (housesprinkler_config_iskey (item, "name"))
+            zone->name = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "feed"))
+            zone->feed = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "hydrate"))
+            zone->hydrate = housesprinkler_config_tointeger (item);
+        else if (housesprinkler_config_iskey (item, "pulse"))
+            zone->pulse = housesprinkler_config_tointeger (item);
+        else if (housesprinkler_config_iskey (item, "pause"))
+            zone->pause = housesprinkler_config_tointeger (item);
+        else if (housesprinkler_config_iskey (item, "flow"))
+            zone->flow = housesprinkler_config_tointeger (item);
+        else if (housesprinkler_config_iskey (item, "partition"))
+            zone->partition = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "manual"))
+            zone->manual = housesprinkler_config_toboolean (item);
+        item = housesprinkler_config_skip (item);
+    }
+}
+
+static void housesprinkler_config_compile_feed (int token,
+                                                SprinklerConfigFeed *feed) {
+    int i;
+    int item = token + 1;
+
+    if (ConfigParsed[token].type != PARSER_OBJECT) return;
+
+    for (i = 0; i < ConfigParsed[token].length; ++i) {
+        if (housesprinkler_config_iskey (item, "name"))
+            feed->name = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "next"))
+            feed->next = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "linger"))
+            feed->linger = housesprinkler_config_tointeger (item);
+        else if (housesprinkler_config_iskey (item, "concurrent"))
+            feed->concurrent = housesprinkler_config_tointeger (item);
+        else if (housesprinkler_config_iskey (item, "flowsensor"))
+            feed->flowsensor = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "manual"))
+            feed->manual = housesprinkler_config_toboolean (item);
+        item = housesprinkler_config_skip (item);
+    }
+}
+
+static void housesprinkler_config_compile_program
+                (int token, SprinklerConfigProgram *program) {
+    int i, j;
+    int item = token + 1;
+
+    if (ConfigParsed[token].type != PARSER_OBJECT) return;
+
+    for (i = 0; i < ConfigParsed[token].length; ++i) {
+        if (housesprinkler_config_iskey (item, "name"))
+            program->name = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "season"))
+            program->season = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "zones")) {
+            program->zones =
+                housesprinkler_config_table
+                    (item, sizeof(SprinklerConfigProgramZone), &(program->count));
+            int zone = item + 1;
+            for (j = 0; j < program->count; ++j) {
+                if (ConfigParsed[zone].type == PARSER_OBJECT) {
+                    int k;
+                    int field = zone + 1;
+                    for (k = 0; k < ConfigParsed[zone].length; ++k) {
+                        if (housesprinkler_config_iskey (field, "name"))
+                            program->zones[j].name =
+                                housesprinkler_config_tostring (field);
+                        else if (housesprinkler_config_iskey (field, "time"))
+                            program->zones[j].time =
+                                housesprinkler_config_tointeger (field);
+                        field = housesprinkler_config_skip (field);
+                    }
+                }
+                zone = housesprinkler_config_skip (zone);
+            }
+        }
+        item = housesprinkler_config_skip (item);
+    }
+}
+
+// Older configurations had no schedules: the schedule items were part
+// of each program, and the program was identified by its name.
+//
+static void housesprinkler_config_compile_schedule
+                (int token, const char *program,
+                 SprinklerConfigSchedule *schedule) {
+    int i, j;
+    int item = token + 1;
+
+    if (ConfigParsed[token].type != PARSER_OBJECT) return;
+
+    for (i = 0; i < ConfigParsed[token].length; ++i) {
+        if (housesprinkler_config_iskey (item, program))
+            schedule->program = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "id"))
+            schedule->id = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "start"))
+            schedule->start = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "begin"))
+            schedule->begin = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "until"))
+            schedule->until = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "interval"))
+            schedule->interval = housesprinkler_config_tointeger (item);
+        else if (housesprinkler_config_iskey (item, "disabled"))
+            schedule->disabled = housesprinkler_config_toboolean (item);
+        else if (housesprinkler_config_iskey (item, "days")) {
+            if (ConfigParsed[item].type == PARSER_ARRAY) {
+                int day = item + 1;
+                for (j = 0; j < ConfigParsed[item].length; ++j) {
+                    if (j < 7)
+                        schedule->days[j] = housesprinkler_config_toboolean (day);
+                    day = housesprinkler_config_skip (day);
+                }
+            }
+        }
+        item = housesprinkler_config_skip (item);
+    }
+}
+
+static void housesprinkler_config_compile_season
+                (int token, SprinklerConfigSeason *season) {
+    int i, j;
+    int item = token + 1;
+
+    if (ConfigParsed[token].type != PARSER_OBJECT) return;
+
+    season->weekly = season->monthly = -1;
+    for (i = 0; i < ConfigParsed[token].length; ++i) {
+        if (housesprinkler_config_iskey (item, "name"))
+            season->name = housesprinkler_config_tostring (item);
+        else if (housesprinkler_config_iskey (item, "priority"))
+            season->priority = housesprinkler_config_tointeger (item);
+        else if (ConfigParsed[item].type == PARSER_ARRAY) {
+            int weekly = housesprinkler_config_iskey (item, "weekly");
+            if (weekly || housesprinkler_config_iskey (item, "monthly")) {
+                int length = ConfigParsed[item].length;
+                if (weekly) {
+                    season->weekly = length;
+                } else {
+                    season->monthly = length;
+                }
+                // The weekly index has precedence over the monthly one.
+                if (weekly || season->weekly < 0) {
+                    int value = item + 1;
+                    for (j = 0; j < length; ++j) {
+                        if (j < 52)
+                            season->index[j] =
+                                housesprinkler_config_tointeger (value);
+                        value = housesprinkler_config_skip (value);
+                    }
+                }
+            }
+        }
+        item = housesprinkler_config_skip (item);
+    }
+}
+
+static void housesprinkler_config_compile (void) {
+
+    int i, j;
+    int legacy = -1;
+
+    housesprinkler_config_uncompile ();
+    if (ConfigTokenCount <= 0) return;
+    if (ConfigParsed[0].type != PARSER_OBJECT) return;
+
+    int item = 1;
+    int schedules = 0;
+    SprinklerConfig *c = &ConfigCompiled;
+
+    for (i = 0; i < ConfigParsed[0].length; ++i) {
+        if (item >= ConfigTokenCount) break;
+        int element = item + 1;
+        if (housesprinkler_config_iskey (item, "zones")) {
+            c->zones = housesprinkler_config_table
+                           (item, sizeof(SprinklerConfigZone), &(c->zonescount));
+            for (j = 0; j < c->zonescount; ++j) {
+                housesprinkler_config_compile_zone (element, c->zones+j);
+                element = housesprinkler_config_skip (element);
+            }
+        } else if (housesprinkler_config_iskey (item, "feeds")) {
+            c->feeds = housesprinkler_config_table
+                           (item, sizeof(SprinklerConfigFeed), &(c->feedscount));
+            for (j = 0; j < c->feedscount; ++j) {
+                housesprinkler_config_compile_feed (element, c->feeds+j);
+                element = housesprinkler_config_skip (element);
+            }
+        } else if (housesprinkler_config_iskey (item, "programs")) {
+            c->programs = housesprinkler_config_table
+                        (item, sizeof(SprinklerConfigProgram), &(c->programscount));
+            for (j = 0; j < c->programscount; ++j) {
+                housesprinkler_config_compile_program (element, c->programs+j);
+                element = housesprinkler_config_skip (element);
+            }
+            if (ConfigParsed[item].type == PARSER_ARRAY) legacy = item;
+        } else if (housesprinkler_config_iskey (item, "schedules") &&
+                   ConfigParsed[item].type == PARSER_ARRAY) {
+            schedules = 1;
+            c->schedules = housesprinkler_config_table
+                      (item, sizeof(SprinklerConfigSchedule), &(c->schedulescount));
+            for (j = 0; j < c->schedulescount; ++j) {
+                housesprinkler_config_compile_schedule
+                    (element, "program", c->schedules+j);
+                element = housesprinkler_config_skip (element);
+            }
+        } else if (housesprinkler_config_iskey (item, "concurrent")) {
+            c->concurrent = housesprinkler_config_tointeger (item);
+        } else if (housesprinkler_config_iskey (item, "flow")) {
+            c->flow = housesprinkler_config_tointeger (item);
+        } else if (housesprinkler_config_iskey (item, "indexmode")) {
+            c->indexmode = housesprinkler_config_tostring (item);
+        } else if (housesprinkler_config_iskey (item, "planner")) {
+            c->planner = housesprinkler_config_tostring (item);
+        } else if (housesprinkler_config_iskey (item, "flowsensor")) {
+            c->flowsensor = housesprinkler_config_tostring (item);
+        } else if (housesprinkler_config_iskey (item, "seasons")) {
+            c->seasons = housesprinkler_config_table
+                           (item, sizeof(SprinklerConfigSeason), &(c->seasonscount));
+            for (j = 0; j < c->seasonscount; ++j) {
+                housesprinkler_config_compile_season (element, c->seasons+j);
+                element = housesprinkler_config_skip (element);
+            }
+        }
+        item = housesprinkler_config_skip (item);
+    }
+
+    if ((!schedules) && (legacy > 0)) {
+        // Compatibility with previous generation of HouseSprinkler configs.
+        DEBUG ("No schedules, loading from programs\n");
+        c->schedules = housesprinkler_config_table
+                  (legacy, sizeof(SprinklerConfigSchedule), &(c->schedulescount));
+        int element = legacy + 1;
+        for (j = 0; j < c->schedulescount; ++j) {
+            housesprinkler_config_compile_schedule
+                (element, "name", c->schedules+j);
+            element = housesprinkler_config_skip (element);
+        }
+    }
+    DEBUG ("Compiled %d zones, %d feeds, %d programs, %d schedules, %d seasons\n",
+           c->zonescount, c->feedscount, c->programscount,
+           c->schedulescount, c->seasonscount);
+}
+
+const SprinklerConfig *housesprinkler_config_compiled (void) {
+    ConfigArenaInUse = 1; // The modules' tables now refer to it.
+    return &ConfigCompiled;
+}
+
+// The text must have been allocated from the current arena.
+//
 static const char *housesprinkler_config_parse (char *text) {
     int count = echttp_json_estimate(text);
-    if (count > ConfigTokenAllocated) {
-        if (ConfigParsed) free (ConfigParsed);
-        ConfigTokenAllocated = count;
-        ConfigParsed = calloc (ConfigTokenAllocated, sizeof(ParserToken));
-    }
-    if (ConfigTextLatest) free (ConfigTextLatest);
-    ConfigTextLatest = strdup (text);
+    ConfigParsed = housesprinkler_config_allocate (count, sizeof(ParserToken));
+    ConfigTextLatest =
+        housesprinkler_arena_strdup (housesprinkler_config_arena(), text);
     DEBUG ("New configuration: %s\n", ConfigTextLatest);
 
-    ConfigTokenCount = ConfigTokenAllocated;
+    if (!ConfigParsed || !ConfigTextLatest) {
+        houselog_trace (HOUSE_FAILURE, "CONFIG", "no more memory");
+        ConfigTokenCount = 0;
+        housesprinkler_config_uncompile ();
+        return "no more memory";
+    }
+    ConfigTokenCount = count;
     const char *error = echttp_json_parse (text, ConfigParsed, &ConfigTokenCount);
-    DEBUG ("Planned config for %d JSON tokens, got %d\n", ConfigTokenAllocated, ConfigTokenCount);
+    DEBUG ("Planned config for %d JSON tokens, got %d\n", count, ConfigTokenCount);
     if (error) {
         houselog_event ("SYSTEM", "CONFIG", "FAILED", "%s", error);
         DEBUG ("Config error: %s\n", error);
+        ConfigTokenCount = 0;
+        housesprinkler_config_uncompile ();
+    } else {
+        housesprinkler_config_compile ();
     }
     return error;
 }
@@ -136,16 +519,12 @@ static const char *housesprinkler_config_write (const char *text, int length) {
     if (!ConfigFileEnabled) return 0; // No error.
 
     DEBUG("Saving to %s: %s\n", ConfigFile, text);
-    int fd = open (ConfigFile, O_WRONLY|O_TRUNC|O_CREAT, 0777);
-    if (fd < 0) {
-        char *desc = strdup(strerror(errno));
-        houselog_trace (HOUSE_FAILURE, "CONFIG",
-                        "Cannot save to %s: %s", ConfigFile, desc);
-        free (desc);
+
+    // The file is written in the background: the disk may be slow.
+    // Write errors are reported later (see housesprinkler_file.c).
+    //
+    if (!housesprinkler_file_write (ConfigFile, text, length))
         return "cannot save to file";
-    }
-    write (fd, text, length);
-    close (fd);
     return 0;
 }
 
@@ -155,7 +534,11 @@ static void housesprinkler_config_listener (const char *name, time_t timestamp,
     houselog_event ("SYSTEM", "CONFIG", "LOAD", "FROM DEPOT %s", name);
 
     housesprinkler_config_clear ("new depot config detected");
-    ConfigText = echttp_parser_string (data);
+    ConfigText = housesprinkler_arena_strdup (housesprinkler_config_arena(), data);
+    if (!ConfigText) {
+        houselog_trace (HOUSE_FAILURE, "CONFIG", "no more memory");
+        return;
+    }
 
     housesprinkler_config_write (data, length);
     housesprinkler_config_parse (ConfigText);
@@ -199,7 +582,10 @@ const char *housesprinkler_config_load (int argc, const char **argv) {
         houselog_event ("SYSTEM", "CONFIG", "LOAD", "FILE %s", ConfigFile);
     }
 
-    ConfigText = newconfig;
+    ConfigText =
+        housesprinkler_arena_strdup (housesprinkler_config_arena(), newconfig);
+    echttp_parser_free (newconfig);
+    if (!ConfigText) return "no more memory";
 
     return housesprinkler_config_parse (ConfigText);
 }
@@ -220,13 +606,13 @@ const char *housesprinkler_config_save (const char *text) {
     }
 
     housesprinkler_config_clear ("new configuration");
-    newconfig = echttp_parser_string(text);
+    newconfig = housesprinkler_arena_strdup (housesprinkler_config_arena(), text);
+    if (!newconfig) return "no more memory";
 
     error = housesprinkler_config_parse (newconfig);
     if (error) {
         houselog_trace (HOUSE_FAILURE, "CONFIG",
                         "JSON error %s on %-0.60s", error, text);
-        free (newconfig);
         return error;
     }
     ConfigText = newconfig;
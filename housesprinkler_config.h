@@ -25,6 +25,79 @@ const char *housesprinkler_config_latest (void);
 
 const char *housesprinkler_config_save (const char *text);
 
+typedef struct {
+    const char *name;
+    const char *feed;
+    int hydrate;
+    int pulse;
+    int pause;
+    int flow;       // Water flow used by this zone, 0 if unknown.
+    const char *partition; // The instance group that controls it, 0: default.
+    char manual;
+} SprinklerConfigZone;
+
+typedef struct {
+    const char *name;
+    const char *next;
+    int linger;
+    int concurrent; // Max number of zones active on this feed, 0: no limit.
+    const char *flowsensor; // Measures the zones of this feed, 0: default.
+    char manual;
+} SprinklerConfigFeed;
+
+typedef struct {
+    const char *name;
+    int time;
+} SprinklerConfigProgramZone;
+
+typedef struct {
+    const char *name;
+    const char *season;
+    int count;
+    SprinklerConfigProgramZone *zones;
+} SprinklerConfigProgram;
+
+typedef struct {
+    const char *id;
+    const char *program;
+    const char *start;
+    const char *begin;
+    const char *until;
+    char disabled;
+    char days[7];
+    int interval;
+} SprinklerConfigSchedule;
+
+typedef struct {
+    const char *name;
+    int priority;
+    int weekly;  // Count of weekly values, -1 if none.
+    int monthly; // Count of monthly values, -1 if none.
+    int index[52];
+} SprinklerConfigSeason;
+
+typedef struct {
+    int                      concurrent; // Max number of active zones.
+    int                      flow;       // Max total flow, 0: no limit.
+    const char              *indexmode;  // How to combine the indexes.
+    const char              *planner;    // How to order the program zones.
+    const char              *flowsensor; // Measures all zones, 0: none.
+    SprinklerConfigZone     *zones;
+    int                      zonescount;
+    SprinklerConfigFeed     *feeds;
+    int                      feedscount;
+    SprinklerConfigProgram  *programs;
+    int                      programscount;
+    SprinklerConfigSchedule *schedules;
+    int                      schedulescount;
+    SprinklerConfigSeason   *seasons;
+    int                      seasonscount;
+} SprinklerConfig;
+
+const SprinklerConfig *housesprinkler_config_compiled (void);
+
+void *housesprinkler_config_allocate (int count, int size);
+
 int         housesprinkler_config_exists  (int parent, const char *path);
 const char *housesprinkler_config_string  (int parent, const char *path);
 int         housesprinkler_config_integer (int parent, const char *path);
@@ -37,12 +110,5 @@ int housesprinkler_config_object       (int parent, const char *path);
 
 const char *housesprinkler_config_name (void);
 
-typedef int BackupWorker (char *buffer, int size);
-void housesprinkler_config_backup_register (BackupWorker *worker);
-
-long housesprinkler_config_backup_get (const char *path);
-const char *housesprinkler_config_backup_get_string (const char *path);
-void housesprinkler_config_backup_changed (void);
-
 void housesprinkler_config_periodic (void);
 
@@ -30,19 +30,67 @@
  * Each control is independent of each other: see the zone and feed
  * modules for the application logic that applies to controls.
  *
+ * The discovery keeps track of each control server: a server is queried
+ * when it first appears, when it did not answer its latest query, or when
+ * its latest answer is getting old. All servers are queried only when
+ * some controls have no known route. A control that is no longer listed
+ * by the server it was routed to loses its route.
+ *
+ * The routes are saved in the backup state. On restart, a control starts
+ * with the route saved for it, so that the commands can be sent before
+ * the first discovery has completed. Such a route is only provisional:
+ * it is dropped if discovery has not confirmed it within a short time.
+ * A command to a control with no route at all is held while waiting for
+ * the first discovery, and sent when the route becomes known.
+ *
  * This module remembers which controls are active, so that it does not
  * have to stop every known control on cancel.
  *
+ * The commands to the control servers are not sent immediately: they are
+ * posted to each control and then all sent together by the flush function.
+ * This way the zone and feed commands for the same pulse all go out at
+ * once, and only the latest command is sent if the same control received
+ * several commands in a row (for example a feed that appears twice in
+ * a chain, or a start immediately followed by a stop).
+ *
+ * The commands are idempotent: a start sets the control on until its
+ * deadline (the pulse is the time remaining), and a stop sets it off.
+ * This makes it safe to send the latest command again when it failed,
+ * whichever request actually failed. A failed command is retried with
+ * an exponential backoff, for a limited number of attempts and only while
+ * it is still useful: a start is not retried after its deadline, or when
+ * a new command replaced it. A start that failed for good leaves the
+ * control in error, and changes the failure generation, so that the zone
+ * module can return the pulse to its queue.
+ *
  * void housesprinkler_control_reset (void);
  *
- *    Erases the list of known control points.
+ *    Mark all known control points as obsolete.
  *    This function must be called before applying a new configuration.
  *
  * void housesprinkler_control_declare (const char *name, const char *type);
  *
- *    Declare a new control point to be discovered.
+ *    Declare a control point. A control point that was already known
+ *    keeps its route, state and activation deadline, and is no longer
+ *    obsolete. A new control point will need to be discovered: it starts
+ *    with the route saved in the backup state, if any.
+ *
+ * int housesprinkler_control_prune (void);
+ *
+ *    Forget all control points that remain obsolete, i.e. that were not
+ *    declared again since the last reset. This function must be called
+ *    after a new configuration was applied. It returns the number of new
+ *    control points that were declared since the last reset, and thus
+ *    need to be discovered.
+ *
+ * int housesprinkler_control_find (const char *name);
+ *
+ *    Return the ID of the specified control, or -1 if not known. The IDs
+ *    change when the controls are pruned: the other modules must resolve
+ *    their controls after the configuration was applied, and then use
+ *    only the IDs.
  *
- * void housesprinkler_control_event (const char *name, int enable, int once);
+ * void housesprinkler_control_event (int control, int enable, int once);
  *
  *    Enable or disable activation events for the specified control:
  *    - If enable and once are both true, events are automatically disabled
@@ -54,27 +102,56 @@
  *
  *    This has no impact on "unusual" events like discovery or stop.
  *
- * void housesprinkler_control_start (const char *name,
- *                                    int pulse, const char *context);
+ * int housesprinkler_control_start (int control,
+ *                                   int pulse, const char *context);
  *
  *    Activate one control for the duration set by pulse. The context is
  *    typically the name of the schedule, or 0 for manual activation.
+ *    A control that is already active is never shortened: the longest
+ *    of the two activations applies. Return 1 if the control was
+ *    activated (or the command is held until the route is known), 0
+ *    otherwise.
  *
- * void housesprinkler_control_cancel (const char *name);
+ * void housesprinkler_control_cancel (int control);
+ * void housesprinkler_control_cancel_all (void);
  *
- *    Immediately stop a control, or all active controls if name is null.
+ *    Immediately stop a control, or all active controls.
  *
- * char housesprinkler_control_state (const char *name);
+ * char housesprinkler_control_state (int control);
  *
  *    Return the current state of the control.
  *
+ * int housesprinkler_control_ready (int control);
+ *
+ *    Return 1 if the control can be started, i.e. it has a route, even
+ *    if not confirmed yet, 0 otherwise.
+ *
+ * int housesprinkler_control_latency (int control);
+ *
+ *    Return the typical delay, in milliseconds, between sending a command
+ *    to the control's server and its response. This is a moving average
+ *    of the actual response times, or 0 if not known yet.
+ *
+ * long housesprinkler_control_failures (void);
+ *
+ *    Return a number that changes each time a start command was given
+ *    up, after all retries failed. The state of the control that failed
+ *    is then 'e'.
+ *
+ * void housesprinkler_control_flush (void);
+ *
+ *    Send all the pending commands. This function must be called after
+ *    any activity that may have started or stopped controls. It does
+ *    nothing if no command is pending.
+ *
  * void housesprinkler_control_periodic (time_t now);
  *
  *    The periodic function that detects the control servers.
  *
- * int housesprinkler_control_status (char *buffer, int size);
+ * void housesprinkler_control_status (SprinklerBuffer *buffer);
  *
- *    Return the status of control points in JSON format.
+ *    Return the status of control points in JSON format. An active control
+ *    lists its deadline, so that the status does not change every second.
  */
 
 #include <string.h>
@@ -87,14 +164,48 @@
 #include "housediscover.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+#include "housesprinkler_buffer.h"
 #include "housesprinkler_time.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_metrics.h"
+#include "housesprinkler_timer.h"
+#include "housesprinkler_state.h"
 #include "housesprinkler_control.h"
 
 #define DEBUG if (sprinkler_isdebug()) printf
 
-static char **Providers = 0;
-static int   ProvidersCount = 0;
-static int   ProvidersAllocated = 0;
+typedef struct {
+    char *url;
+    time_t seen;     // Latest time this server was listed by discovery.
+    time_t queried;  // Latest status request sent.
+    time_t answered; // Time of the latest query that got a valid response.
+    int points;      // Number of our controls that this server handles.
+} SprinklerProvider;
+
+static SprinklerProvider *Providers = 0;
+static int ProvidersCount = 0;
+static int ProvidersAllocated = 0;
+
+// A server that has answered is queried again only after this period,
+// unless some controls are still not routed.
+#define PROVIDER_STALE 600
+
+// How long a new control waits for discovery to confirm its saved route,
+// or to find one. The commands are held meanwhile if there is no route.
+#define CONTROL_PROVISIONAL 120
+
+// How a failed command is retried: the delay doubles after each attempt,
+// starting from CONTROL_RETRY_DELAY seconds. A start is not retried if
+// less than CONTROL_RETRY_MIN seconds would remain of its pulse.
+#define CONTROL_RETRY_MAX   5
+#define CONTROL_RETRY_DELAY 1
+#define CONTROL_RETRY_MIN   2
+
+static ParserToken *DiscoveryTokens = 0;
+static int          DiscoveryTokensSize = 0;
+static int         *DiscoveryList = 0;
+static int          DiscoveryListSize = 0;
 
 typedef struct {
     const char *name;
@@ -102,37 +213,110 @@ typedef struct {
     char status;
     char event;
     char once;
+    char obsolete;
+    char learned;
+    char pending; // The command to send: 'a' (start), 'i' (stop) or none.
+    char held;    // A start is waiting for the route to be known.
+    char sent;    // The latest command sent, for retries.
+    char attempts; // Failed attempts of the latest command.
+    int  inflight; // Requests waiting for a response.
+    int  pulse;
+    time_t retry;       // When to send the latest command again (0: never).
     time_t deadline;
+    time_t provisional; // Until when the route may be unconfirmed (0: never).
+    long long submitted; // When the latest command was sent (metrics clock).
+    int latency;         // Average response time, milliseconds (0: unknown).
+    char cause[128];
     char url[256];
 } SprinklerControl;
 
 static SprinklerControl *Controls = 0;
 static int               ControlsCount = 0;
 static int               ControlsSize = 0;
+static SprinklerHash     ControlsByName;
 
 static int ControlsActive = 0;
+static int ControlsLatency = -1; // Round trip of the /set commands.
+static int ControlsTimer = -1;
+static int ControlsAdded = 0;
+static long ControlsFailures = 0;
+
+static int *ControlsPending = 0; // Order in which the commands were posted.
+static int  ControlsPendingCount = 0;
+static int  ControlsPendingSize = 0;
+
+static void housesprinkler_control_changed (void) {
+    // The zone status reflects the state of the zone's control.
+    housesprinkler_status_changed (SPRINKLER_STATUS_CONTROL);
+    housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
+}
 
 static SprinklerControl *housesprinkler_control_search (const char *name) {
-    int i;
     if (!Controls) return 0;
+    int i = housesprinkler_hash_find (&ControlsByName, name);
+    return (i >= 0) ? Controls+i : 0;
+}
+
+int housesprinkler_control_find (const char *name) {
+    if (!Controls || !name) return -1;
+    return housesprinkler_hash_find (&ControlsByName, name);
+}
+
+static SprinklerControl *housesprinkler_control_get (int control) {
+    if (control < 0 || control >= ControlsCount) return 0;
+    return Controls + control;
+}
+
+// Save the known routes, so that they are available on restart.
+//
+static void housesprinkler_control_backup (SprinklerBuffer *buffer) {
+
+    int i;
+    const char *prefix = "";
+
+    housesprinkler_buffer_printf (buffer, "\"routes\":{");
     for (i = 0; i < ControlsCount; ++i) {
-        if (!strcmp (name, Controls[i].name)) return Controls+i;
+        if (!Controls[i].url[0]) continue;
+        housesprinkler_buffer_printf (buffer, "%s\"%s\":\"%s\"",
+                                      prefix, Controls[i].name, Controls[i].url);
+        prefix = ",";
     }
-    return 0;
+    housesprinkler_buffer_printf (buffer, "}");
+}
+
+static void housesprinkler_control_route (SprinklerControl *control,
+                                          const char *url) {
+    snprintf (control->url, sizeof(control->url), "%s", url);
+    housesprinkler_state_changed ();
+    housesprinkler_control_changed ();
 }
 
 void housesprinkler_control_reset (void) {
-    ControlsCount = 0;
+    int i;
+    housesprinkler_state_register (housesprinkler_control_backup);
+    ControlsTimer = housesprinkler_timer_declare ("control", SPRINKLER_TIMER_REAL);
+    housesprinkler_timer_wakeup (ControlsTimer);
+    for (i = 0; i < ControlsCount; ++i) Controls[i].obsolete = 1;
+    ControlsAdded = 0;
 }
 
 void housesprinkler_control_declare (const char *name, const char *type) {
-    if (!housesprinkler_control_search(name)) {
+    SprinklerControl *control = housesprinkler_control_search(name);
+    if (control) {
+        // Already known: keep the route and state. The name and type are
+        // updated because they point to the old configuration data.
+        control->name = name;
+        control->type = type;
+        control->obsolete = 0;
+    } else {
         if (ControlsCount >= ControlsSize) {
-            ControlsSize += 16;
+            // Grow by doubling, so that the table soon stops moving.
+            ControlsSize = ControlsSize ? 2 * ControlsSize : 16;
             Controls = realloc (Controls, ControlsSize*sizeof(SprinklerControl));
             if (!Controls) {
                 houselog_trace (HOUSE_FAILURE, name, "no more memory");
                 ControlsSize = ControlsCount = 0;
+                housesprinkler_hash_reset (&ControlsByName, 0);
                 return;
             }
         }
@@ -141,25 +325,85 @@ void housesprinkler_control_declare (const char *name, const char *type) {
         Controls[ControlsCount].status = 'u';
         Controls[ControlsCount].event = 1; // enabled.
         Controls[ControlsCount].once = 0; // .. until explicitly disabled.
+        Controls[ControlsCount].obsolete = 0;
+        Controls[ControlsCount].learned = 0;
+        Controls[ControlsCount].pending = 0;
         Controls[ControlsCount].deadline = 0;
+        Controls[ControlsCount].latency = 0;
+        Controls[ControlsCount].held = 0;
+        Controls[ControlsCount].sent = 0;
+        Controls[ControlsCount].attempts = 0;
+        Controls[ControlsCount].inflight = 0;
+        Controls[ControlsCount].retry = 0;
         Controls[ControlsCount].url[0] = 0; // Need to (re)learn.
+
+        // Start with the route used before restart, until confirmed.
+        char path[256];
+        snprintf (path, sizeof(path), ".routes.%s", name);
+        const char *url = housesprinkler_state_get_string (path);
+        if (url && url[0]) {
+            snprintf (Controls[ControlsCount].url,
+                      sizeof(Controls[ControlsCount].url), "%s", url);
+            Controls[ControlsCount].status = 'i';
+            DEBUG ("Control %s restored route to %s\n", name, url);
+        }
+        Controls[ControlsCount].provisional = time(0) + CONTROL_PROVISIONAL;
+        housesprinkler_hash_add (&ControlsByName, name, ControlsCount);
         ControlsCount += 1;
+        ControlsAdded += 1;
+        housesprinkler_control_changed ();
     }
 }
 
-void housesprinkler_control_event (const char *name, int enable, int once) {
+void housesprinkler_control_event (int id, int enable, int once) {
 
-    SprinklerControl *control = housesprinkler_control_search(name);
+    SprinklerControl *control = housesprinkler_control_get (id);
     if (control) {
         control->event = enable;
         control->once = once;
     }
 }
 
+// The latest command failed: retry it later, unless there is no point.
+//
+static void housesprinkler_control_failed (SprinklerControl *control,
+                                           const char *reason) {
+
+    time_t now = time(0);
+
+    if (control->retry) return; // Already waiting to retry.
+
+    control->attempts += 1;
+    if (control->attempts < CONTROL_RETRY_MAX) {
+        int delay = CONTROL_RETRY_DELAY << (control->attempts - 1);
+        if (control->sent != 'a' ||
+            control->deadline >= now + delay + CONTROL_RETRY_MIN) {
+            houselog_trace (HOUSE_WARNING, control->name,
+                            "%s, retry in %d seconds", reason, delay);
+            control->retry = now + delay;
+            housesprinkler_timer_wakeup (ControlsTimer);
+            return;
+        }
+    }
+    houselog_trace (HOUSE_FAILURE, control->name,
+                    "%s, %s command failed after %d attempts",
+                    reason, (control->sent == 'a') ? "start" : "stop",
+                    control->attempts);
+    if (control->sent == 'a') {
+        houselog_event (control->type, control->name, "FAILED",
+                        "AFTER %d ATTEMPTS", control->attempts);
+        ControlsFailures += 1;
+    }
+    control->attempts = 0;
+    control->status  = 'e';
+    control->deadline  = 0;
+    housesprinkler_control_changed ();
+}
+
 static void housesprinkler_control_result
                (void *origin, int status, char *data, int length) {
 
-   SprinklerControl *control = (SprinklerControl *)origin;
+   char *name = (char *) origin;
 
    status = echttp_redirected("GET");
    if (!status) {
@@ -167,53 +411,150 @@ static void housesprinkler_control_result
        return;
    }
 
+   // The control table might have been reallocated, or the control
+   // forgotten, while the request was pending.
+   SprinklerControl *control = housesprinkler_control_search (name);
+   free (name);
+   if (!control) return;
+
+   housesprinkler_metrics_record (ControlsLatency, control->submitted);
+
+   // A moving average, so that one slow response does not matter much.
+   int latency =
+       (int)((housesprinkler_metrics_clock() - control->submitted) / 1000);
+   if (control->latency > 0)
+       control->latency = ((control->latency * 7) + latency) / 8;
+   else
+       control->latency = latency > 0 ? latency : 1;
+
+   if (control->inflight > 0) control->inflight -= 1;
    if (status != 200) {
-       if (control->status != 'e')
-           houselog_trace (HOUSE_FAILURE, control->name, "HTTP code %d", status);
-       control->status  = 'e';
-       control->deadline  = 0;
+       // A newer command replaces the one that failed.
+       if (!control->pending) {
+           char reason[64];
+           snprintf (reason, sizeof(reason), "HTTP code %d", status);
+           housesprinkler_control_failed (control, reason);
+       }
+   } else if (control->inflight <= 0) {
+       control->attempts = 0; // The latest command went through.
    }
 }
 
-int housesprinkler_control_start (const char *name,
-                                  int pulse, const char *context) {
-    time_t now = time(0);
+static void housesprinkler_control_post (SprinklerControl *control,
+                                         char command) {
 
-    SprinklerControl *control = housesprinkler_control_search (name);
-    if (!control) {
-        houselog_event ("CONTROL", name, "UNKNOWN", "");
-        return 0;
+    if (!control->pending) {
+        if (ControlsPendingCount >= ControlsPendingSize) {
+            ControlsPendingSize = ControlsSize;
+            ControlsPending =
+                realloc (ControlsPending, ControlsPendingSize * sizeof(int));
+            if (!ControlsPending) {
+                houselog_trace (HOUSE_FAILURE, control->name, "no more memory");
+                ControlsPendingSize = ControlsPendingCount = 0;
+                return;
+            }
+        }
+        ControlsPending[ControlsPendingCount++] = control - Controls;
+    }
+    control->pending = command; // The latest command wins.
+    control->retry = 0;
+    control->attempts = 0;
+}
+
+static void housesprinkler_control_send (SprinklerControl *control) {
+
+    static char url[512];
+
+    if (control->pending == 'a') {
+        snprintf (url, sizeof(url),
+                  "%s/set?point=%s&state=on&pulse=%d&cause=%s",
+                  control->url, control->name, control->pulse, control->cause);
+    } else {
+        snprintf (url, sizeof(url),
+                  "%s/set?point=%s&state=off", control->url, control->name);
+    }
+    control->sent = control->pending;
+    control->pending = 0;
+
+    const char *error = echttp_client ("GET", url);
+    if (error) {
+        char reason[300];
+        snprintf (reason, sizeof(reason),
+                  "cannot create socket for %s, %s", control->url, error);
+        housesprinkler_control_failed (control, reason);
+        return;
+    }
+    DEBUG ("GET %s\n", url);
+    if (ControlsLatency < 0)
+        ControlsLatency =
+            housesprinkler_metrics_declare ("sprinkler_control_latency_seconds",
+                                            "Round trip of the control commands.", "");
+    control->submitted = housesprinkler_metrics_clock ();
+    control->inflight += 1;
+    // The origin is a copy of the name, as in the discovery requests.
+    echttp_submit (0, 0, housesprinkler_control_result,
+                   (void *)strdup(control->name));
+}
+
+int housesprinkler_control_latency (int id) {
+    SprinklerControl *control = housesprinkler_control_get (id);
+    return control ? control->latency : 0;
+}
+
+long housesprinkler_control_failures (void) {
+    return ControlsFailures;
+}
+
+void housesprinkler_control_flush (void) {
+
+    int i;
+    for (i = 0; i < ControlsPendingCount; ++i) {
+        int index = ControlsPending[i];
+        if (index >= ControlsCount) continue;
+        if (Controls[index].pending) housesprinkler_control_send (Controls+index);
     }
+    ControlsPendingCount = 0;
+}
+
+int housesprinkler_control_start (int id, int pulse, const char *context) {
+    time_t now = time(0);
+
+    SprinklerControl *control = housesprinkler_control_get (id);
+    if (!control) return 0; // Reported when the configuration was loaded.
+
+    const char *name = control->name;
     DEBUG ("%ld: Start %s %s for %d seconds\n", now, control->type, name, pulse);
-    if (control->url[0]) {
+    if (control->url[0] || control->provisional) {
         if (!context || context[0] == 0) context = "MANUAL";
+        if (control->deadline > now + pulse) {
+            // Already active for longer: this happens to feeds shared
+            // by zones running concurrently. Do not cut the other zones.
+            pulse = (int)(control->deadline - now);
+        }
         if (control->event) {
             houselog_event (control->type, name, "ACTIVATED",
                             "FOR %s USING %s (%s)",
                             housesprinkler_time_period_printable(pulse),
-                            control->url, context);
+                            control->url[0] ? control->url : "PENDING ROUTE",
+                            context);
             if (control->once) {
                 control->event = 0;
                 control->once = 0;
             }
         }
-        static char url[256];
-        static char cause[256];
-        int l = snprintf (cause, sizeof(cause), "%s", "SPRINKLER%20");
-        echttp_escape (context, cause+l, sizeof(cause)-l);
-        snprintf (url, sizeof(url),
-                  "%s/set?point=%s&state=on&pulse=%d&cause=%s",
-                  control->url, name, pulse, cause);
-        const char *error = echttp_client ("GET", url);
-        if (error) {
-            houselog_trace (HOUSE_FAILURE, name, "cannot create socket for %s, %s", url, error);
-            return 0;
-        }
-        DEBUG ("GET %s\n", url);
-        echttp_submit (0, 0, housesprinkler_control_result, (void *)control);
+        int l = snprintf (control->cause, sizeof(control->cause),
+                          "%s", "SPRINKLER%20");
+        echttp_escape (context, control->cause+l, sizeof(control->cause)-l);
+        control->pulse = pulse;
+        if (control->url[0])
+            housesprinkler_control_post (control, 'a');
+        else
+            control->held = 1; // Sent when the route is known.
         control->deadline = now + pulse;
         control->status = 'a';
         ControlsActive = 1;
+        housesprinkler_timer_wakeup (ControlsTimer);
+        housesprinkler_control_changed ();
         return 1;
     }
     return 0;
@@ -221,34 +562,31 @@ int housesprinkler_control_start (const char *name,
 
 static void housesprinkler_control_stop (SprinklerControl *control) {
     if (control->url[0]) {
-        static char url[256];
-        snprintf (url, sizeof(url),
-                  "%s/set?point=%s&state=off", control->url, control->name);
-        const char *error = echttp_client ("GET", url);
-        if (error) {
-            houselog_trace (HOUSE_FAILURE, control->name, "cannot create socket for %s, %s", url, error);
-            return;
-        }
-        DEBUG ("GET %s\n", url);
-        echttp_submit (0, 0, housesprinkler_control_result, (void *)control);
+        housesprinkler_control_post (control, 'i');
         control->status  = 'i';
+        housesprinkler_control_changed ();
+    } else if (control->held) {
+        control->held = 0;
+        control->status  = 'u';
+        housesprinkler_control_changed ();
     }
 }
 
-void housesprinkler_control_cancel (const char *name) {
+void housesprinkler_control_cancel (int id) {
+
+    SprinklerControl *control = housesprinkler_control_get (id);
+    if (control) {
+        houselog_event (control->type, control->name, "CANCEL", "MANUAL");
+        housesprinkler_control_stop (control);
+        control->deadline = 0;
+    }
+}
+
+void housesprinkler_control_cancel_all (void) {
 
     int i;
     time_t now = time(0);
 
-    if (name) {
-        SprinklerControl *control = housesprinkler_control_search (name);
-        if (control) {
-            houselog_event (control->type, name, "CANCEL", "MANUAL");
-            housesprinkler_control_stop (control);
-            control->deadline = 0;
-        }
-        return;
-    }
     DEBUG ("%ld: Cancel all zones and feeds\n", now);
     for (i = 0; i < ControlsCount; ++i) {
         if (Controls[i].deadline) {
@@ -259,132 +597,314 @@ void housesprinkler_control_cancel (const char *name) {
     ControlsActive = 0;
 }
 
-char housesprinkler_control_state (const char *name) {
-    SprinklerControl *control = housesprinkler_control_search (name);
+int housesprinkler_control_prune (void) {
+
+    int i;
+    int kept = 0;
+    int pruned = 0;
+
+    for (i = 0; i < ControlsCount; ++i) {
+        if (Controls[i].obsolete && Controls[i].deadline) {
+            // Do not leave a control running if it was removed.
+            housesprinkler_control_stop (Controls+i);
+        }
+    }
+    // The pending commands refer to the controls by index: send them
+    // before the table is compacted.
+    housesprinkler_control_flush ();
+
+    for (i = 0; i < ControlsCount; ++i) {
+        if (Controls[i].obsolete) {
+            DEBUG ("Forget control %s\n", Controls[i].name);
+            pruned += 1;
+            continue;
+        }
+        if (kept != i) Controls[kept] = Controls[i];
+        kept += 1;
+    }
+    ControlsCount = kept;
+
+    // Always rebuild the hash table: the names now point to the new
+    // configuration data.
+    //
+    housesprinkler_hash_reset (&ControlsByName, ControlsSize);
+    for (i = 0; i < ControlsCount; ++i) {
+        housesprinkler_hash_add (&ControlsByName, Controls[i].name, i);
+    }
+    if (pruned) housesprinkler_control_changed ();
+
+    DEBUG ("Controls: %d kept, %d new, %d pruned\n",
+           ControlsCount - ControlsAdded, ControlsAdded, pruned);
+    return ControlsAdded;
+}
+
+char housesprinkler_control_state (int id) {
+    SprinklerControl *control = housesprinkler_control_get (id);
     if (!control) return 'e';
     return control->status;
 }
 
-static void housesprinkler_control_discovered
-               (void *origin, int status, char *data, int length) {
+int housesprinkler_control_ready (int id) {
+    SprinklerControl *control = housesprinkler_control_get (id);
+    if (!control) return 0;
+    return control->url[0] || control->provisional;
+}
 
-   const char *provider = (const char *) origin;
-   ParserToken tokens[100];
-   int  innerlist[100];
-   char path[256];
-   int  count = 100;
-   int  i;
+static SprinklerProvider *housesprinkler_control_provider (const char *url) {
+    int i;
+    for (i = 0; i < ProvidersCount; ++i) {
+        if (!strcmp (Providers[i].url, url)) return Providers + i;
+    }
+    return 0;
+}
 
-   status = echttp_redirected("GET");
-   if (!status) {
-       echttp_submit (0, 0, housesprinkler_control_discovered, origin);
-       return;
-   }
+// Make sure that the discovery buffers can hold the specified counts.
+//
+static int housesprinkler_control_room (int tokens, int list) {
 
-   if (status != 200) {
-       houselog_trace (HOUSE_FAILURE, provider, "HTTP error %d", status);
+    if (tokens > DiscoveryTokensSize) {
+        ParserToken *t =
+            realloc (DiscoveryTokens, tokens * sizeof(ParserToken));
+        if (!t) return 0;
+        DiscoveryTokens = t;
+        DiscoveryTokensSize = tokens;
+    }
+    if (list > DiscoveryListSize) {
+        int *l = realloc (DiscoveryList, list * sizeof(int));
+        if (!l) return 0;
+        DiscoveryList = l;
+        DiscoveryListSize = list;
+    }
+    return 1;
+}
+
+static void housesprinkler_control_learn (SprinklerProvider *provider,
+                                          char *data) {
+   int  i;
+   int  count = echttp_json_estimate (data);
+
+   if (!housesprinkler_control_room (count, 0)) {
+       houselog_trace (HOUSE_FAILURE, provider->url, "no more memory");
        return;
    }
 
    // Analyze the answer and retrieve the control points matching ours.
-   const char *error = echttp_json_parse (data, tokens, &count);
+   const char *error = echttp_json_parse (data, DiscoveryTokens, &count);
    if (error) {
        houselog_trace
-           (HOUSE_FAILURE, provider, "JSON syntax error, %s", error);
+           (HOUSE_FAILURE, provider->url, "JSON syntax error, %s", error);
        return;
    }
    if (count <= 0) {
-       houselog_trace (HOUSE_FAILURE, provider, "no data");
+       houselog_trace (HOUSE_FAILURE, provider->url, "no data");
        return;
    }
+   ParserToken *tokens = DiscoveryTokens;
 
    int controls = echttp_json_search (tokens, ".control.status");
    if (controls <= 0) {
-       houselog_trace (HOUSE_FAILURE, provider, "no control data");
+       houselog_trace (HOUSE_FAILURE, provider->url, "no control data");
        return;
    }
 
+   // A server with no control point is a valid answer: it handles none
+   // of our controls.
+   //
    int n = tokens[controls].length;
-   if (n <= 0) {
-       houselog_trace (HOUSE_FAILURE, provider, "empty control data");
-       return;
+   if (n > 0) {
+       if (!housesprinkler_control_room (0, n)) {
+           houselog_trace (HOUSE_FAILURE, provider->url, "no more memory");
+           return;
+       }
+       error = echttp_json_enumerate (tokens+controls, DiscoveryList);
+       if (error) {
+           houselog_trace (HOUSE_FAILURE, provider->url, "%s", error);
+           return;
+       }
+   } else {
+       n = 0;
    }
 
-   error = echttp_json_enumerate (tokens+controls, innerlist);
-   if (error) {
-       houselog_trace (HOUSE_FAILURE, path, "%s", error);
-       return;
+   // Mark the controls routed to this server, to detect those that
+   // are no longer handled by this server.
+   //
+   for (i = 0; i < ControlsCount; ++i) {
+       Controls[i].learned = !strcmp (Controls[i].url, provider->url);
    }
 
+   provider->points = 0;
    for (i = 0; i < n; ++i) {
-       ParserToken *inner = tokens + controls + innerlist[i];
+       ParserToken *inner = tokens + controls + DiscoveryList[i];
        SprinklerControl *control = housesprinkler_control_search (inner->key);
        if (!control) continue;
-       if (strcmp (control->url, provider)) {
-           snprintf (control->url, sizeof(control->url), provider);
+       provider->points += 1;
+       control->learned = 0;
+       control->provisional = 0; // Confirmed.
+       if (strcmp (control->url, provider->url)) {
+           housesprinkler_control_route (control, provider->url);
            control->status = 'i';
            houselog_event_local
                (control->type, control->name, "ROUTE", "TO %s", control->url);
        }
+       if (control->held) {
+           // A start was issued before the route was known: send it now,
+           // for the remaining time.
+           time_t now = time(0);
+           control->held = 0;
+           if (control->deadline > now) {
+               control->pulse = (int)(control->deadline - now);
+               control->status = 'a';
+               housesprinkler_control_post (control, 'a');
+           }
+       }
+   }
+
+   for (i = 0; i < ControlsCount; ++i) {
+       if (!Controls[i].learned) continue;
+       // This server used to handle this control, but not anymore.
+       houselog_event_local
+           (Controls[i].type, Controls[i].name, "ROUTE", "LOST");
+       housesprinkler_control_route (Controls + i, "");
+       Controls[i].status = 'u';
+       Controls[i].learned = 0;
    }
+   provider->answered = provider->queried;
+   housesprinkler_status_changed (SPRINKLER_STATUS_CONTROL);
 }
 
-static void housesprinkler_control_scan_server
-                (const char *service, void *context, const char *provider) {
+static void housesprinkler_control_discovered
+               (void *origin, int status, char *data, int length) {
 
-    char url[256];
+   char *url = (char *) origin;
 
-    if (ProvidersCount >= ProvidersAllocated) {
-        ProvidersAllocated += 64;
-        Providers = realloc (Providers, ProvidersAllocated*(sizeof(char *)));
-    }
-    Providers[ProvidersCount++] = strdup(provider); // Keep the string.
+   status = echttp_redirected("GET");
+   if (!status) {
+       echttp_submit (0, 0, housesprinkler_control_discovered, origin);
+       return;
+   }
+
+   // The server might have been forgotten while the request was pending.
+   SprinklerProvider *provider = housesprinkler_control_provider (url);
+   if (provider) {
+       if (status != 200) {
+           houselog_trace (HOUSE_FAILURE, url, "HTTP error %d", status);
+       } else {
+           housesprinkler_control_learn (provider, data);
+       }
+   }
+   free (url);
+}
 
-    snprintf (url, sizeof(url), "%s/status", provider);
+static void housesprinkler_control_query (SprinklerProvider *provider,
+                                          time_t now) {
+
+    char url[256];
+
+    snprintf (url, sizeof(url), "%s/status", provider->url);
+    provider->queried = now;
 
     DEBUG ("Attempting discovery at %s\n", url);
     const char *error = echttp_client ("GET", url);
     if (error) {
-        houselog_trace (HOUSE_FAILURE, provider, "%s", error);
+        houselog_trace (HOUSE_FAILURE, provider->url, "%s", error);
         return;
     }
-    echttp_submit (0, 0, housesprinkler_control_discovered, (void *)provider);
+    // The origin is a copy, since the server might be forgotten
+    // before the response comes back.
+    echttp_submit (0, 0, housesprinkler_control_discovered,
+                   (void *)strdup(provider->url));
 }
 
-static void housesprinkler_control_discover (time_t now) {
+static void housesprinkler_control_scan_server
+                (const char *service, void *context, const char *provider) {
+
+    time_t now = *((time_t *)context);
+
+    SprinklerProvider *known = housesprinkler_control_provider (provider);
+    if (known) {
+        known->seen = now;
+        return;
+    }
+
+    if (ProvidersCount >= ProvidersAllocated) {
+        ProvidersAllocated += 64;
+        Providers = realloc (Providers,
+                             ProvidersAllocated*(sizeof(SprinklerProvider)));
+        if (!Providers) {
+            houselog_trace (HOUSE_FAILURE, provider, "no more memory");
+            ProvidersCount = ProvidersAllocated = 0;
+            return;
+        }
+    }
+    DEBUG ("New control server %s\n", provider);
+    known = Providers + ProvidersCount++;
+    known->url = strdup(provider); // Keep the string.
+    known->seen = now;
+    known->queried = 0;
+    known->answered = 0;
+    known->points = 0;
+    housesprinkler_status_changed (SPRINKLER_STATUS_CONTROL);
+}
+
+// Return the time of the latest discovery.
+//
+static time_t housesprinkler_control_discover (time_t now) {
 
     static time_t latestdiscovery = 0;
+    static int    forced = 1;
+    int i;
 
     if (!now) { // This is a manual reset (force a discovery refresh)
         latestdiscovery = 0;
-        return;
+        forced = 1;
+        return 0;
     }
 
-    // If any new service was detected, force a scan now.
+    // If any new service was detected, check the list of servers now.
+    // Even if nothing new was detected, still check every minute, in case
+    // a server went stale.
     //
     if ((latestdiscovery > 0) &&
-        housediscover_changed ("control", latestdiscovery)) {
-        latestdiscovery = 0;
-    }
+        (!housediscover_changed ("control", latestdiscovery)) &&
+        (now <= latestdiscovery + 60)) return latestdiscovery;
+    latestdiscovery = now;
 
-    // Even if nothing new was detected, still scan every minute, in case
-    // the configuration of a service was changed.
+    // Update the list of control servers. The servers that are no longer
+    // listed are forgotten.
     //
-    if (now <= latestdiscovery + 60) return;
-    latestdiscovery = now;
+    housediscovered ("control", &now, housesprinkler_control_scan_server);
 
-    // Rebuild the list of control servers, and then launch a discovery
-    // refresh. This way we don't walk a stale cache while doing discovery.
+    int kept = 0;
+    for (i = 0; i < ProvidersCount; ++i) {
+        if (Providers[i].seen < now) {
+            DEBUG ("Forget control server %s\n", Providers[i].url);
+            free (Providers[i].url);
+            housesprinkler_status_changed (SPRINKLER_STATUS_CONTROL);
+            continue;
+        }
+        if (kept != i) Providers[kept] = Providers[i];
+        kept += 1;
+    }
+    ProvidersCount = kept;
+
+    // Query only the servers that are new, did not answer, or have gone
+    // stale. All servers are queried if some controls are not routed yet,
+    // since there is no way to tell which server handles them.
     //
-    DEBUG ("Reset providers cache\n");
-    int i;
+    int unrouted = forced;
+    for (i = 0; i < ControlsCount && !unrouted; ++i) {
+        if (!Controls[i].url[0] || Controls[i].provisional) unrouted = 1;
+    }
     for (i = 0; i < ProvidersCount; ++i) {
-        if (Providers[i]) free(Providers[i]);
-        Providers[i] = 0;
+        SprinklerProvider *provider = Providers + i;
+        if (unrouted ||
+            (provider->answered < provider->queried) ||
+            (provider->answered + PROVIDER_STALE < now)) {
+            housesprinkler_control_query (provider, now);
+        }
     }
-    ProvidersCount = 0;
-    DEBUG ("Proceeding with discovery\n");
-    housediscovered ("control", 0, housesprinkler_control_scan_server);
+    forced = 0;
+    return latestdiscovery;
 }
 
 void housesprinkler_control_periodic (time_t now) {
@@ -392,64 +912,129 @@ void housesprinkler_control_periodic (time_t now) {
     int i;
     if (ControlsCount <= 0) return;
 
+    if (!now) {
+        housesprinkler_control_discover (0);
+        housesprinkler_timer_wakeup (ControlsTimer);
+        return;
+    }
+    if (!housesprinkler_timer_due (ControlsTimer, now)) return;
+
+    // Send the failed commands again, for the time remaining. A start
+    // that can no longer be useful is given up.
+    //
+    int retrying = 0;
+    for (i = 0; i < ControlsCount; ++i) {
+        SprinklerControl *control = Controls + i;
+        if (!control->retry) continue;
+        if (control->retry > now) {
+            retrying = 1;
+            continue;
+        }
+        control->retry = 0;
+        if (!control->url[0]) continue; // Lost the route: held or dropped.
+        if (control->sent == 'a') {
+            if (control->deadline < now + CONTROL_RETRY_MIN) {
+                housesprinkler_control_failed (control, "too late");
+                continue;
+            }
+            control->pulse = (int)(control->deadline - now);
+        }
+        char attempts = control->attempts;
+        housesprinkler_control_post (control, control->sent);
+        control->attempts = attempts; // Still the same command.
+    }
+
     if (ControlsActive) {
         ControlsActive = 0;
         for (i = 0; i < ControlsCount; ++i) {
             if (Controls[i].deadline) {
                 if (Controls[i].deadline < now) {
+                    housesprinkler_control_changed ();
                     // No request: it automatically stops on end of pulse.
                     Controls[i].deadline = 0;
-                    Controls[i].status  = 'i';
+                    Controls[i].status  = Controls[i].url[0] ? 'i' : 'u';
+                    if (Controls[i].held) {
+                        // The route never came: the start was not sent.
+                        houselog_trace (HOUSE_FAILURE, Controls[i].name,
+                                        "no route, start command expired");
+                        Controls[i].status = 'e';
+                        ControlsFailures += 1;
+                    }
+                    Controls[i].held = 0;
                 } else {
                     ControlsActive = 1;
                 }
             }
         }
     }
-    housesprinkler_control_discover (now);
+    time_t latest = housesprinkler_control_discover (now);
+
+    // Give up on the routes that discovery did not confirm in time, and
+    // on the commands that were waiting for a route.
+    //
+    int provisional = 0;
+    for (i = 0; i < ControlsCount; ++i) {
+        SprinklerControl *control = Controls + i;
+        if (!control->provisional) continue;
+        if (control->provisional >= now) {
+            provisional = 1;
+            continue;
+        }
+        control->provisional = 0;
+        if (control->held) {
+            // The start never went out: this is a failed command.
+            houselog_trace (HOUSE_FAILURE, control->name,
+                            "no route, start command dropped");
+            houselog_event (control->type, control->name,
+                            "FAILED", "NO ROUTE");
+            control->held = 0;
+            control->deadline = 0;
+            control->status = 'e';
+            ControlsFailures += 1;
+            housesprinkler_control_changed ();
+        } else if (control->url[0]) {
+            houselog_event_local
+                (control->type, control->name, "ROUTE", "NOT CONFIRMED");
+            housesprinkler_control_route (control, "");
+            control->status = 'u';
+        }
+    }
+
+    // Check every second while some controls are active, or while some
+    // are not routed yet (a new server may show up at any time).
+    // Otherwise the discovery is refreshed every minute.
+    //
+    int pending = ControlsActive || provisional || retrying;
+    for (i = 0; i < ControlsCount && !pending; ++i) {
+        if (!Controls[i].url[0]) pending = 1;
+    }
+    housesprinkler_timer_set (ControlsTimer, pending ? now + 1 : latest + 61);
 }
 
-int housesprinkler_control_status (char *buffer, int size) {
+void housesprinkler_control_status (SprinklerBuffer *buffer) {
 
     int i;
-    int cursor = 0;
     const char *prefix = "";
 
-    cursor = snprintf (buffer, size, "\"servers\":[");
-    if (cursor >= size) goto overflow;
+    housesprinkler_buffer_printf (buffer, "\"servers\":[");
 
     for (i = 0; i < ProvidersCount; ++i) {
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s\"%s\"", prefix, Providers[i]);
-        if (cursor >= size) goto overflow;
+        housesprinkler_buffer_printf (buffer, "%s\"%s\"", prefix, Providers[i].url);
         prefix = ",";
     }
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
-
-    cursor += snprintf (buffer+cursor, size-cursor, ",\"controls\":[");
-    if (cursor >= size) goto overflow;
+    housesprinkler_buffer_printf (buffer, "],\"controls\":[");
     prefix = "";
 
-    time_t now = time(0);
-
+    // The deadline, not the remaining time, so that the status only changes
+    // when a control starts or stops. The clients show the countdown.
+    //
     for (i = 0; i < ControlsCount; ++i) {
-        int remaining =
-            (Controls[i].status == 'a')?(int)(Controls[i].deadline - now):0;
-        cursor += snprintf (buffer+cursor, size-cursor, "%s[\"%s\",\"%s\",\"%c\",\"%s\",%d]",
-                            prefix, Controls[i].name, Controls[i].type, Controls[i].status, Controls[i].url, remaining);
-        if (cursor >= size) goto overflow;
+        long deadline =
+            (Controls[i].status == 'a')?(long)(Controls[i].deadline):0;
+        housesprinkler_buffer_printf (buffer, "%s[\"%s\",\"%s\",\"%c\",\"%s\",%ld,%d]",
+                            prefix, Controls[i].name, Controls[i].type, Controls[i].status, Controls[i].url, deadline, Controls[i].latency);
         prefix = ",";
     }
 
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
-
-    return cursor;
-
-overflow:
-    houselog_trace (HOUSE_FAILURE, "STATUS",
-                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
-    buffer[0] = 0;
-    return 0;
+    housesprinkler_buffer_printf (buffer, "]");
 }
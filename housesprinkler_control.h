@@ -20,12 +20,22 @@
  *
  * housesprinkler_control.h - Interface with the control servers.
  */
+
+#include "housesprinkler_buffer.h"
+
 void housesprinkler_control_reset (void);
 void housesprinkler_control_declare (const char *name, const char *type);
-void housesprinkler_control_event (const char *name, int enable, int once);
-int  housesprinkler_control_start (const char *name,
+int  housesprinkler_control_prune (void);
+int  housesprinkler_control_find (const char *name);
+void housesprinkler_control_event (int control, int enable, int once);
+int  housesprinkler_control_start (int control,
                                    int pulse, const char *context);
-void housesprinkler_control_cancel (const char *name);
-char housesprinkler_control_state (const char *name);
+void housesprinkler_control_cancel (int control);
+void housesprinkler_control_cancel_all (void);
+char housesprinkler_control_state (int control);
+int  housesprinkler_control_ready (int control);
+int  housesprinkler_control_latency (int control);
+long housesprinkler_control_failures (void);
+void housesprinkler_control_flush (void);
 void housesprinkler_control_periodic (time_t now);
-int housesprinkler_control_status (char *buffer, int size);
+void housesprinkler_control_status (SprinklerBuffer *buffer);
@@ -32,7 +32,27 @@
  *
  *    This function must be called each time the configuration changes.
  *
- * void housesprinkler_feed_activate (const char *name,
+ * void housesprinkler_feed_resolve (void);
+ *
+ *    Resolve the references to the next feeds and to the controls. This
+ *    function must be called after the controls have been pruned, i.e.
+ *    once the new configuration has been fully applied.
+ *
+ * int housesprinkler_feed_find (const char *name);
+ *
+ *    Return the ID of the specified feed, or -1 if not known.
+ *
+ * int housesprinkler_feed_concurrent (int feed);
+ *
+ *    Return the maximum number of zones that may be active at the same
+ *    time on this feed, 0 if no limit.
+ *
+ * int housesprinkler_feed_latency (int feed);
+ *
+ *    Return the typical response time of the feed's control, in
+ *    milliseconds (see housesprinkler_control_latency()).
+ *
+ * void housesprinkler_feed_activate (int feed,
  *                                    int pulse, const char *context);
  *
  *    Turn the feed on for the specified time. This activates the specified
@@ -52,6 +72,7 @@
 #include "housediscover.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_hash.h"
 #include "housesprinkler_time.h"
 #include "housesprinkler_feed.h"
 #include "housesprinkler_config.h"
@@ -62,72 +83,69 @@
 typedef struct {
     const char *name;
     const char *next;
+    int nextfeed; // The ID of the next feed in the chain, -1 if none.
+    int control;
+    int concurrent;
     char manual;
     char linger;
 } SprinklerFeed;
 
 static SprinklerFeed *Feed = 0;
 static int            FeedCount = 0;
+static SprinklerHash  FeedByName;
 
-static SprinklerFeed *housesprinkler_feed_search (const char *name) {
-    int i;
-    for (i = 0; i < FeedCount; ++i) {
-        if (!strcmp(name, Feed[i].name)) return Feed+i;
-    }
-    return 0;
+int housesprinkler_feed_find (const char *name) {
+    if (!name || !name[0]) return -1;
+    return housesprinkler_hash_find (&FeedByName, name);
 }
 
 void housesprinkler_feed_refresh (void) {
 
     int i;
-    int count;
-    int content;
-    char path[128];
-    int list[256];
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
 
     // Reload all feed items.
     //
-    if (Feed) free (Feed);
     Feed = 0;
-    FeedCount = 0;
-    content = housesprinkler_config_array (0, ".feeds");
-    if (content > 0) {
-        FeedCount = housesprinkler_config_array_length (content);
-        if (FeedCount > 0) {
-            Feed = calloc (FeedCount, sizeof(SprinklerFeed));
-            DEBUG ("Loading %d feed items\n", FeedCount);
-        }
+    FeedCount = config->feedscount;
+    if (FeedCount > 0) {
+        Feed = housesprinkler_config_allocate (FeedCount, sizeof(SprinklerFeed));
+        DEBUG ("Loading %d feed items\n", FeedCount);
     }
+    housesprinkler_hash_reset (&FeedByName, FeedCount);
 
     for (i = 0; i < FeedCount; ++i) {
-        snprintf (path, sizeof(path), "[%d]", i);
-        int item = housesprinkler_config_object (content, path);
-        if (item > 0) {
-            Feed[i].name = housesprinkler_config_string (item, ".name");
-            Feed[i].next = housesprinkler_config_string (item, ".next");
-            Feed[i].linger = housesprinkler_config_integer (item, ".linger");
-            Feed[i].manual = housesprinkler_config_boolean (item, ".manual");
-        }
+        const SprinklerConfigFeed *item = config->feeds + i;
+        Feed[i].name = item->name;
+        Feed[i].next = item->next;
+        Feed[i].nextfeed = -1;
+        Feed[i].control = -1;
+        Feed[i].concurrent = item->concurrent;
+        Feed[i].linger = item->linger;
+        Feed[i].manual = item->manual;
+        housesprinkler_hash_add (&FeedByName, Feed[i].name, i);
         housesprinkler_control_declare (Feed[i].name, "FEED");
-        housesprinkler_control_event (Feed[i].name, 0, 0);
         DEBUG ("\tFeed %s (manual=%s)\n",
                Feed[i].name, Feed[i].manual?"true":"false");
     }
 
+    // Resolve the chains. Report invalid references now, so that
+    // the activation does not need to check anything.
+    //
+    for (i = 0; i < FeedCount; ++i) {
+        if (!Feed[i].next || !Feed[i].next[0]) continue;
+        Feed[i].nextfeed = housesprinkler_feed_find (Feed[i].next);
+        if (Feed[i].nextfeed < 0)
+            houselog_event
+                ("FEED", Feed[i].name, "INVALID", "UNKNOWN NEXT %s", Feed[i].next);
+    }
+
     // Detect loops in chains. Having any is bad.
     for (i = 0; i < FeedCount; ++i) {
         int loop = 0;
-        const char *name = Feed[i].next;
-        const char *previous = Feed[i].name;
-        while (name && name[0]) {
-            SprinklerFeed *feed = housesprinkler_feed_search (name);
-            if (!feed) {
-                houselog_event
-                    ("FEED", previous, "INVALID", "UNKNOWN NEXT %s", name);
-                break;
-            }
-            previous = name;
-            name = feed->next;
+        int feed = Feed[i].nextfeed;
+        while (feed >= 0) {
+            feed = Feed[feed].nextfeed;
             if (++loop >= FeedCount) {
                 houselog_event
                     ("FEED", Feed[i].name, "INVALID", "INFINITE LOOP IN CHAIN");
@@ -137,33 +155,42 @@ void housesprinkler_feed_refresh (void) {
     }
 }
 
-void housesprinkler_feed_activate (const char *name,
-                                   int pulse, const char *context) {
+void housesprinkler_feed_resolve (void) {
+
+    int i;
+    for (i = 0; i < FeedCount; ++i) {
+        Feed[i].control = housesprinkler_control_find (Feed[i].name);
+        housesprinkler_control_event (Feed[i].control, 0, 0);
+    }
+}
+
+int housesprinkler_feed_concurrent (int feed) {
+    if (feed < 0 || feed >= FeedCount) return 0;
+    return Feed[feed].concurrent;
+}
+
+int housesprinkler_feed_latency (int feed) {
+    if (feed < 0 || feed >= FeedCount) return 0;
+    return housesprinkler_control_latency (Feed[feed].control);
+}
+
+void housesprinkler_feed_activate (int feed, int pulse, const char *context) {
 
-    const char *previous = 0;
     int loop = 0;
 
-    while (name && name[0]) {
-        SprinklerFeed *feed = housesprinkler_feed_search (name);
-        if (!feed) {
-            if (previous)
-                houselog_event
-                    ("FEED", previous, "INVALID", "UNKNOWN NEXT %s", name);
-            else
-                houselog_event ("FEED", name, "UNKNOWN", "");
-            return;
-        }
-        if (!feed->manual) {
+    while (feed >= 0 && feed < FeedCount) {
+        SprinklerFeed *item = Feed + feed;
+        if (!item->manual) {
             // No context means manually operated, i.e. a zone test.
             // In this case we generate an event (once) to help with
             // testing. Otherwise feed events just add noise.
             //
             if ((!context) || (context[0] == 0))
-                housesprinkler_control_event (name, 1, 1);
-            housesprinkler_control_start (name, pulse + feed->linger, context);
+                housesprinkler_control_event (item->control, 1, 1);
+            housesprinkler_control_start (item->control,
+                                          pulse + item->linger, context);
         }
-        previous = name;
-        name = feed->next;
+        feed = item->nextfeed;
 
         if (++loop >= FeedCount) break; // We went through all feeds.
     }
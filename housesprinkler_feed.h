@@ -22,7 +22,11 @@
  *
  */
 void housesprinkler_feed_refresh (void);
-void housesprinkler_feed_activate (const char *name,
+void housesprinkler_feed_resolve (void);
+int  housesprinkler_feed_find (const char *name);
+int  housesprinkler_feed_concurrent (int feed);
+int  housesprinkler_feed_latency (int feed);
+void housesprinkler_feed_activate (int feed,
                                    int pulse, const char *context);
 void housesprinkler_feed_cancel (void);
 void housesprinkler_feed_periodic (time_t now);
@@ -0,0 +1,256 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_file.c - Save files without blocking the main loop.
+ *
+ * SYNOPSYS:
+ *
+ * This module writes files from a background thread, so that a slow
+ * storage (e.g. an SD card) never delays the watering or the web server.
+ *
+ * Each file is first written to a temporary file in the same directory,
+ * which is synced to disk before being renamed to the actual file name.
+ * A crash in the middle of a write leaves either the old or the new file,
+ * never a truncated one.
+ *
+ * Writes are coalesced: if a file is written again before the previous
+ * data was saved, only the latest data is saved.
+ *
+ * int housesprinkler_file_write (const char *path,
+ *                                const char *data, int length);
+ *
+ *    Queue the data to be saved to the specified file. The data is copied,
+ *    so the caller can reuse its buffer immediately. Return 1 on success,
+ *    0 if the data could not be queued.
+ *
+ * void housesprinkler_file_periodic (time_t now);
+ *
+ *    Report the outcome of the background writes. This must be called
+ *    from the main loop, as the background thread does not log anything.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "houselog.h"
+
+#include "housesprinkler.h"
+#include "housesprinkler_timer.h"
+#include "housesprinkler_file.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+// There are only a few files to save (the configuration and the state),
+// so one slot per file is enough.
+//
+#define FILE_SLOTS 4
+
+typedef struct {
+    char *path;
+    char *data;     // Data waiting to be saved, 0 if none.
+    int   length;
+    int   busy;     // The background thread is saving this file.
+    int   error;    // The errno of the latest failed write, 0 if none.
+    int   written;  // Count of successful writes not reported yet.
+} SprinklerFile;
+
+static SprinklerFile   Files[FILE_SLOTS];
+static int             FilesCount = 0;
+static int             FilesPending = 0;
+
+static pthread_mutex_t FileLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  FileWakeup = PTHREAD_COND_INITIALIZER;
+static int             FileThreadStarted = 0;
+
+static int             FileTimer = -1; // Due while some writes are pending.
+
+static int housesprinkler_file_save (const char *path,
+                                     const char *data, int length) {
+
+    char temp[1024];
+    snprintf (temp, sizeof(temp), "%s.tmp", path);
+
+    int fd = open (temp, O_WRONLY|O_TRUNC|O_CREAT, 0777);
+    if (fd < 0) return errno;
+
+    while (length > 0) {
+        int written = write (fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            int error = errno;
+            close (fd);
+            unlink (temp);
+            return error;
+        }
+        data += written;
+        length -= written;
+    }
+    if (fsync (fd) < 0) {
+        int error = errno;
+        close (fd);
+        unlink (temp);
+        return error;
+    }
+    close (fd);
+
+    if (rename (temp, path) < 0) {
+        int error = errno;
+        unlink (temp);
+        return error;
+    }
+    return 0;
+}
+
+static void *housesprinkler_file_thread (void *context) {
+
+    pthread_mutex_lock (&FileLock);
+    for (;;) {
+        while (FilesPending <= 0) pthread_cond_wait (&FileWakeup, &FileLock);
+
+        int i;
+        for (i = 0; i < FilesCount; ++i) {
+            SprinklerFile *file = Files + i;
+            if (!file->data) continue;
+
+            char *data = file->data;
+            int length = file->length;
+            file->data = 0;
+            file->busy = 1;
+            FilesPending -= 1;
+
+            // The path never changes once the slot is assigned.
+            pthread_mutex_unlock (&FileLock);
+            int error = housesprinkler_file_save (file->path, data, length);
+            free (data);
+            pthread_mutex_lock (&FileLock);
+
+            file->busy = 0;
+            file->error = error;
+            if (!error) file->written += 1;
+        }
+    }
+    return 0;
+}
+
+int housesprinkler_file_write (const char *path, const char *data, int length) {
+
+    int i;
+    char *copy = malloc (length);
+    if (!copy) {
+        houselog_trace (HOUSE_FAILURE, path, "no more memory");
+        return 0;
+    }
+    memcpy (copy, data, length);
+
+    pthread_mutex_lock (&FileLock);
+
+    if (!FileThreadStarted) {
+        pthread_t thread;
+        if (pthread_create (&thread, 0, housesprinkler_file_thread, 0)) {
+            pthread_mutex_unlock (&FileLock);
+            houselog_trace (HOUSE_FAILURE, path, "cannot start the writer");
+            free (copy);
+            return 0;
+        }
+        pthread_detach (thread);
+        FileThreadStarted = 1;
+    }
+
+    SprinklerFile *file = 0;
+    for (i = 0; i < FilesCount; ++i) {
+        if (!strcmp (Files[i].path, path)) {
+            file = Files + i;
+            break;
+        }
+    }
+    if (!file) {
+        if (FilesCount >= FILE_SLOTS) {
+            pthread_mutex_unlock (&FileLock);
+            houselog_trace (HOUSE_FAILURE, path, "too many files");
+            free (copy);
+            return 0;
+        }
+        file = Files + FilesCount++;
+        file->path = strdup (path);
+        file->data = 0;
+    }
+
+    if (file->data) {
+        free (file->data); // Not saved yet: only the latest data matters.
+        DEBUG ("Coalesced write to %s\n", path);
+    } else {
+        FilesPending += 1;
+    }
+    file->data = copy;
+    file->length = length;
+
+    pthread_cond_signal (&FileWakeup);
+    pthread_mutex_unlock (&FileLock);
+
+    if (FileTimer < 0)
+        FileTimer = housesprinkler_timer_declare ("file", SPRINKLER_TIMER_REAL);
+    housesprinkler_timer_set (FileTimer, time(0) + 1);
+    return 1;
+}
+
+void housesprinkler_file_periodic (time_t now) {
+
+    int i;
+    static time_t LastCall = 0;
+
+    if (now == LastCall) return;
+    LastCall = now;
+
+    if (!FileThreadStarted) return; // Nothing was ever written.
+    if (!housesprinkler_timer_due (FileTimer, now)) return;
+
+    int busy = 0;
+
+    pthread_mutex_lock (&FileLock);
+    for (i = 0; i < FilesCount; ++i) {
+        SprinklerFile *file = Files + i;
+        if (file->error) {
+            houselog_trace (HOUSE_FAILURE, "FILE",
+                            "Cannot save to %s: %s",
+                            file->path, strerror(file->error));
+            file->error = 0;
+        }
+        if (file->written) {
+            DEBUG ("Saved %s (%d times)\n", file->path, file->written);
+            file->written = 0;
+        }
+        if (file->busy || file->data) busy = 1;
+    }
+    pthread_mutex_unlock (&FileLock);
+
+    // Check again later if some writes have not completed yet.
+    if (busy)
+        housesprinkler_timer_set (FileTimer, now + 1);
+    else
+        housesprinkler_timer_cancel (FileTimer);
+}
+
@@ -0,0 +1,620 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_flow.c - Measure the water flow of each zone.
+ *
+ * SYNOPSYS:
+ *
+ * This module collects the readings of the flow sensors, attributes each
+ * reading to the zone that was running, and keeps rolling statistics for
+ * each zone, so that a broken sprinkler head or pipe (too much water), or
+ * a valve that does not open (too little water), is detected.
+ *
+ * void housesprinkler_flow_refresh (void);
+ *
+ *    This function must be called each time the configuration changes.
+ *
+ * void housesprinkler_flow_periodic (time_t now);
+ *
+ *    The periodic function that requests the sensor readings.
+ *
+ * void housesprinkler_flow_status (SprinklerBuffer *buffer);
+ *
+ *    Populate the buffer with a JSON object that lists the sensors and
+ *    the flow statistics of each zone. Each sensor is listed as [name,
+ *    value, timestamp, attribution, zone, feed], where the attribution is
+ *    'z' (one zone), 'i' (no zone active) or 'm' (several zones active).
+ *    Each zone is listed as [name, mean, variance, readings, flag, latest,
+ *    timestamp], where the flag is 'n' (normal), 'h' (too high), 'l' (too
+ *    low) or 'w' (not enough readings yet).
+ *
+ * CONFIGURATION
+ *
+ * The top level "flowsensor" item is the name of the sensor that measures
+ * the flow of all the zones. A feed may have its own "flowsensor" item,
+ * which then measures the zones that use this feed directly. There is
+ * nothing to do if no sensor is configured.
+ *
+ * This module searches for the services providing "flow", and requests
+ * the status of each of them every minute. Each sensor is listed in
+ * the status as an object (.flow.status.NAME) which "value" item is the
+ * current flow rate, in the same unit as the zones' "flow" items.
+ *
+ * The zones start on the minute, so the requests are sent on the middle of
+ * the minute, when the water flow had time to settle. A reading is only
+ * attributed to a zone if this zone is the only one measured by the sensor
+ * that was active long enough before, and that is still active: when
+ * several zones are active, there is no way to tell them apart.
+ *
+ * The statistics are a moving average and variance, which use the same
+ * amount of memory regardless of the number of readings, and take a
+ * constant time to update. The first readings are weighted equally,
+ * until FLOW_WINDOW readings, after which the older readings weigh less
+ * and less. A reading that is far from the average (more than three
+ * standard deviations, and more than FLOW_TOLERANCE percent) flags the
+ * zone as abnormally high or low, once FLOW_WARMUP readings have been
+ * received. An abnormal reading is not added to the statistics, so that
+ * an incident does not hide the next one. If too many readings in a row
+ * are abnormal, e.g. after the sprinkler heads were replaced, these
+ * statistics are restarted from scratch. The statistics are saved in the
+ * backup state once the zones equipped with a sensor have all stopped.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <echttp.h>
+#include <echttp_json.h>
+
+#include "houselog.h"
+#include "housediscover.h"
+
+#include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+#include "housesprinkler_buffer.h"
+#include "housesprinkler_flow.h"
+#include "housesprinkler_zone.h"
+#include "housesprinkler_history.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_timer.h"
+#include "housesprinkler_state.h"
+#include "housesprinkler_config.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define FLOW_PERIOD     60 // Request the readings every minute..
+#define FLOW_PHASE      30 // .. on the middle of the minute.
+#define FLOW_SETTLE     20 // Seconds after the zone started.
+#define FLOW_TIMEOUT    50 // Give up on a request after this.
+
+#define FLOW_WINDOW     32 // Readings that weigh equally at first.
+#define FLOW_WARMUP      8 // Readings before anything is flagged.
+#define FLOW_TOLERANCE  20 // Percent of the average always tolerated.
+
+#define FLOW_SENSORS    16
+
+typedef struct {
+    const char *name;
+    double value;
+    time_t received; // 0: no reading yet.
+    int    zone;     // Zone of the latest reading, -1: none (or several).
+    char   attributed; // 'z': one zone, 'i': idle, 'm': several zones.
+} SprinklerFlowSensor;
+
+static SprinklerFlowSensor FlowSensors[FLOW_SENSORS];
+static int FlowSensorsCount = 0;
+
+static int *FlowSensorOfZone = 0; // Zone ID to sensor index, -1: none.
+static int *FlowStatsOfZone = 0;  // Zone ID to statistics index.
+static int  FlowZonesCount = 0;
+
+// The statistics of each zone, kept across configuration changes.
+//
+typedef struct {
+    char  *name;
+    double mean;
+    double variance;
+    long   samples;
+    double latest;
+    time_t updated;
+    int    abnormal; // Consecutive abnormal readings.
+    char   flag; // 'n': normal, 'h': high, 'l': low, 'w': warming up.
+} SprinklerFlowStats;
+
+static SprinklerFlowStats *FlowStats = 0;
+static int                 FlowStatsCount = 0;
+static int                 FlowStatsSize = 0;
+static SprinklerHash       FlowStatsByName;
+
+typedef struct {
+    char  *url;
+    time_t seen;    // Latest time this service was listed by discovery.
+    time_t queried; // Time of the pending request, 0 if none.
+} SprinklerFlowProvider;
+
+static SprinklerFlowProvider *Providers = 0;
+static int ProvidersCount = 0;
+static int ProvidersAllocated = 0;
+
+static ParserToken *FlowTokens = 0;
+static int          FlowTokensSize = 0;
+static int         *FlowList = 0;
+static int          FlowListSize = 0;
+
+static int FlowTimer = -1;
+
+static int FlowLearned = 0; // Statistics changed since the state was saved.
+
+// The state is saved in integer form, in thousandths.
+//
+static void housesprinkler_flow_backup (SprinklerBuffer *buffer) {
+
+    int i;
+    const char *prefix = "";
+
+    housesprinkler_buffer_printf (buffer, "\"flow\":{");
+    for (i = 0; i < FlowStatsCount; ++i) {
+        const SprinklerFlowStats *stats = FlowStats + i;
+        if (stats->samples <= 0) continue;
+        housesprinkler_buffer_printf
+            (buffer, "%s\"%s\":{\"mean\":%ld,\"variance\":%ld,\"samples\":%ld}",
+             prefix, stats->name, (long)(stats->mean * 1000),
+             (long)(stats->variance * 1000), stats->samples);
+        prefix = ",";
+    }
+    housesprinkler_buffer_printf (buffer, "}");
+}
+
+static int housesprinkler_flow_stats (const char *name) {
+
+    int i = housesprinkler_hash_find (&FlowStatsByName, name);
+    if (i >= 0) return i;
+
+    if (FlowStatsCount >= FlowStatsSize) {
+        int size = FlowStatsSize ? 2 * FlowStatsSize : 64;
+        SprinklerFlowStats *stats =
+            realloc (FlowStats, size * sizeof(SprinklerFlowStats));
+        if (!stats) {
+            houselog_trace (HOUSE_FAILURE, name, "no more memory");
+            return -1;
+        }
+        FlowStats = stats;
+        FlowStatsSize = size;
+        // Rebuild the hash table, to keep it efficient.
+        housesprinkler_hash_reset (&FlowStatsByName, size);
+        for (i = 0; i < FlowStatsCount; ++i)
+            housesprinkler_hash_add (&FlowStatsByName, FlowStats[i].name, i);
+    }
+
+    SprinklerFlowStats *stats = FlowStats + FlowStatsCount;
+    memset (stats, 0, sizeof(*stats));
+    stats->name = strdup (name);
+    stats->flag = 'w';
+
+    // Resume from the statistics saved before restart, if any.
+    char path[256];
+    snprintf (path, sizeof(path), ".flow.%s.samples", name);
+    stats->samples = housesprinkler_state_get (path);
+    if (stats->samples > 0) {
+        snprintf (path, sizeof(path), ".flow.%s.mean", name);
+        stats->mean = housesprinkler_state_get (path) / 1000.0;
+        snprintf (path, sizeof(path), ".flow.%s.variance", name);
+        stats->variance = housesprinkler_state_get (path) / 1000.0;
+        if (stats->samples >= FLOW_WARMUP) stats->flag = 'n';
+    } else {
+        stats->samples = 0;
+    }
+    housesprinkler_hash_add (&FlowStatsByName, stats->name, FlowStatsCount);
+    return FlowStatsCount++;
+}
+
+static int housesprinkler_flow_sensor (const char *name) {
+
+    int i;
+
+    if (!name || !name[0]) return -1;
+    for (i = 0; i < FlowSensorsCount; ++i) {
+        if (!strcmp (FlowSensors[i].name, name)) return i;
+    }
+    if (FlowSensorsCount >= FLOW_SENSORS) {
+        houselog_trace (HOUSE_FAILURE, name, "too many flow sensors");
+        return -1;
+    }
+    i = FlowSensorsCount++;
+    FlowSensors[i].name = name;
+    FlowSensors[i].value = 0.0;
+    FlowSensors[i].received = 0;
+    FlowSensors[i].zone = -1;
+    FlowSensors[i].attributed = 'i';
+    return i;
+}
+
+void housesprinkler_flow_refresh (void) {
+
+    int i, j;
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
+
+    housesprinkler_state_register (housesprinkler_flow_backup);
+    FlowTimer = housesprinkler_timer_declare ("flow", SPRINKLER_TIMER_REAL);
+    housesprinkler_timer_wakeup (FlowTimer);
+
+    if (!FlowStatsSize) housesprinkler_hash_reset (&FlowStatsByName, 64);
+
+    // The tables are allocated with the configuration: the previous
+    // tables were released with the previous configuration.
+    //
+    FlowSensorsCount = 0;
+    FlowSensorOfZone = FlowStatsOfZone = 0;
+    FlowZonesCount = config->zonescount;
+    if (FlowZonesCount <= 0) return;
+
+    FlowSensorOfZone = housesprinkler_config_allocate (FlowZonesCount, sizeof(int));
+    FlowStatsOfZone = housesprinkler_config_allocate (FlowZonesCount, sizeof(int));
+
+    int sensor = housesprinkler_flow_sensor (config->flowsensor);
+    int measured = 0;
+    for (i = 0; i < FlowZonesCount; ++i) {
+        const SprinklerConfigZone *zone = config->zones + i;
+        FlowSensorOfZone[i] = sensor;
+        FlowStatsOfZone[i] = -1;
+        if (!zone->name) continue;
+        if (zone->feed) {
+            for (j = 0; j < config->feedscount; ++j) {
+                const SprinklerConfigFeed *feed = config->feeds + j;
+                if (!feed->name || !feed->flowsensor) continue;
+                if (strcmp (feed->name, zone->feed)) continue;
+                FlowSensorOfZone[i] = housesprinkler_flow_sensor (feed->flowsensor);
+                break;
+            }
+        }
+        if (FlowSensorOfZone[i] < 0) continue;
+        FlowStatsOfZone[i] = housesprinkler_flow_stats (zone->name);
+        measured += 1;
+    }
+    DEBUG ("%d flow sensors measure %d zones\n", FlowSensorsCount, measured);
+    housesprinkler_status_changed (SPRINKLER_STATUS_FLOW);
+}
+
+// Update the statistics of the zone with a new reading, and flag the
+// reading if it is abnormal.
+//
+static void housesprinkler_flow_learn (SprinklerFlowStats *stats,
+                                       double value, time_t now) {
+
+    char flag = 'w';
+    double delta = value - stats->mean;
+
+    if (stats->samples >= FLOW_WARMUP) {
+        // Compare the squares, i.e. the variance: no square root needed.
+        double limit = 9.0 * stats->variance;
+        double tolerance = (stats->mean * FLOW_TOLERANCE) / 100.0;
+        if (limit < tolerance * tolerance) limit = tolerance * tolerance;
+        if (delta * delta <= limit) flag = 'n';
+        else flag = (delta > 0) ? 'h' : 'l';
+    }
+    if (flag != stats->flag && (flag == 'h' || flag == 'l')) {
+        houselog_event ("ZONE", stats->name, "FLOW",
+                        "%s, %.2f INSTEAD OF %.2f",
+                        (flag == 'h') ? "TOO HIGH" : "TOO LOW",
+                        value, stats->mean);
+    } else if (flag == 'n' && (stats->flag == 'h' || stats->flag == 'l')) {
+        houselog_event ("ZONE", stats->name, "FLOW", "NORMAL, %.2f", value);
+    }
+    stats->flag = flag;
+    stats->latest = value;
+    stats->updated = now;
+
+    if (flag == 'h' || flag == 'l') {
+        if (++stats->abnormal < FLOW_WINDOW) return;
+        houselog_event ("ZONE", stats->name, "FLOW", "RESTART STATISTICS");
+        stats->samples = 0;
+        stats->mean = value;
+        stats->variance = 0.0;
+        delta = 0.0;
+    }
+    stats->abnormal = 0;
+
+    // The first readings weigh equally, the older readings weigh less once
+    // the window is full (exponentially weighted mean and variance).
+    //
+    stats->samples += 1;
+    double alpha = 1.0 / ((stats->samples < FLOW_WINDOW) ? stats->samples : FLOW_WINDOW);
+    stats->mean += alpha * delta;
+    stats->variance = (1.0 - alpha) * (stats->variance + (alpha * delta * delta));
+}
+
+// Attribute a new reading to the zone that is running, if only one is.
+//
+static void housesprinkler_flow_sample (int sensor, double value, time_t now) {
+
+    int i;
+    int zone;
+    int count = 0;
+    int steady = -1;
+    time_t start, end;
+    time_t scheduling = sprinkler_schedulingtime (now);
+
+    SprinklerFlowSensor *s = FlowSensors + sensor;
+    s->value = value;
+    s->received = now;
+
+    for (i = 0; (zone = housesprinkler_zone_active (i, &start, &end)) >= 0; ++i) {
+        if (zone >= FlowZonesCount || FlowSensorOfZone[zone] != sensor) continue;
+        count += 1;
+        if (start + FLOW_SETTLE <= scheduling && end >= scheduling) steady = zone;
+    }
+    s->zone = -1;
+    if (count == 0) {
+        s->attributed = 'i';
+    } else if (count > 1) {
+        s->attributed = 'm';
+    } else {
+        s->attributed = 'z';
+        if (steady >= 0 && FlowStatsOfZone[steady] >= 0) {
+            SprinklerFlowStats *stats = FlowStats + FlowStatsOfZone[steady];
+            s->zone = steady;
+            housesprinkler_flow_learn (stats, value, now);
+            housesprinkler_history_flow (stats->name, scheduling, value);
+            FlowLearned = 1;
+            DEBUG ("Flow %.2f attributed to zone %s\n", value, stats->name);
+        }
+    }
+    housesprinkler_status_changed (SPRINKLER_STATUS_FLOW);
+}
+
+static SprinklerFlowProvider *housesprinkler_flow_provider (const char *url) {
+    int i;
+    for (i = 0; i < ProvidersCount; ++i) {
+        if (!strcmp (Providers[i].url, url)) return Providers + i;
+    }
+    return 0;
+}
+
+static void housesprinkler_flow_store (SprinklerFlowProvider *provider,
+                                       char *data, time_t now) {
+
+   int i, j;
+   int count = echttp_json_estimate (data);
+
+   if (count > FlowTokensSize) {
+       FlowTokensSize = count + 32;
+       FlowTokens = realloc (FlowTokens, FlowTokensSize * sizeof(ParserToken));
+       if (!FlowTokens) {
+           FlowTokensSize = 0;
+           houselog_trace (HOUSE_FAILURE, provider->url, "no more memory");
+           return;
+       }
+   }
+   ParserToken *tokens = FlowTokens;
+
+   const char *error = echttp_json_parse (data, tokens, &count);
+   if (error) {
+       houselog_trace
+           (HOUSE_FAILURE, provider->url, "JSON syntax error, %s", error);
+       return;
+   }
+   if (count <= 0) {
+       houselog_trace (HOUSE_FAILURE, provider->url, "no data");
+       return;
+   }
+
+   int sensors = echttp_json_search (tokens, ".flow.status");
+   if (sensors <= 0) {
+       houselog_trace (HOUSE_FAILURE, provider->url, "no flow data");
+       return;
+   }
+   int n = tokens[sensors].length;
+   if (n <= 0) return;
+   if (n > FlowListSize) {
+       int *list = realloc (FlowList, n * sizeof(int));
+       if (!list) {
+           houselog_trace (HOUSE_FAILURE, provider->url, "no more memory");
+           return;
+       }
+       FlowList = list;
+       FlowListSize = n;
+   }
+   error = echttp_json_enumerate (tokens+sensors, FlowList);
+   if (error) {
+       houselog_trace (HOUSE_FAILURE, provider->url, "%s", error);
+       return;
+   }
+
+   for (i = 0; i < n; ++i) {
+       ParserToken *inner = tokens + sensors + FlowList[i];
+       if (!inner->key) continue;
+       for (j = 0; j < FlowSensorsCount; ++j) {
+           if (!strcmp (FlowSensors[j].name, inner->key)) break;
+       }
+       if (j >= FlowSensorsCount) continue; // Not one of ours.
+
+       int value = echttp_json_search (inner, ".value");
+       if (value <= 0) continue;
+       ParserToken *token = inner + value;
+       if (token->type == PARSER_REAL)
+           housesprinkler_flow_sample (j, token->value.real, now);
+       else if (token->type == PARSER_INTEGER)
+           housesprinkler_flow_sample (j, (double)(token->value.integer), now);
+   }
+}
+
+static void housesprinkler_flow_response
+               (void *origin, int status, char *data, int length) {
+
+   char *url = (char *) origin;
+
+   status = echttp_redirected("GET");
+   if (!status) {
+       echttp_submit (0, 0, housesprinkler_flow_response, origin);
+       return;
+   }
+
+   // The service might have been forgotten while the request was pending.
+   SprinklerFlowProvider *provider = housesprinkler_flow_provider (url);
+   free (url);
+   if (!provider) return;
+
+   provider->queried = 0;
+   if (status != 200) {
+       houselog_trace (HOUSE_FAILURE, provider->url, "HTTP code %d", status);
+       return;
+   }
+   housesprinkler_flow_store (provider, data, time(0));
+}
+
+static void housesprinkler_flow_query (SprinklerFlowProvider *provider,
+                                       time_t now) {
+
+    char url[256];
+
+    snprintf (url, sizeof(url), "%s/status", provider->url);
+
+    DEBUG ("Requesting flow from %s\n", url);
+    const char *error = echttp_client ("GET", url);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, provider->url, "%s", error);
+        return;
+    }
+    provider->queried = now;
+    echttp_submit (0, 0, housesprinkler_flow_response,
+                   (void *)strdup(provider->url));
+}
+
+static void housesprinkler_flow_scan
+                (const char *service, void *context, const char *url) {
+
+    time_t now = *((time_t *)context);
+
+    SprinklerFlowProvider *provider = housesprinkler_flow_provider (url);
+    if (!provider) {
+        if (ProvidersCount >= ProvidersAllocated) {
+            ProvidersAllocated += 16;
+            Providers = realloc (Providers,
+                                 ProvidersAllocated * sizeof(*Providers));
+            if (!Providers) {
+                houselog_trace (HOUSE_FAILURE, url, "no more memory");
+                ProvidersAllocated = ProvidersCount = 0;
+                return;
+            }
+        }
+        DEBUG ("New flow service %s\n", url);
+        provider = Providers + ProvidersCount++;
+        memset (provider, 0, sizeof(*provider));
+        provider->url = strdup (url);
+    }
+    provider->seen = now;
+}
+
+void housesprinkler_flow_periodic (time_t now) {
+
+    int i;
+
+    if (!now) return;
+    if (!housesprinkler_timer_due (FlowTimer, now)) return;
+
+    // Next time on the middle of the minute.
+    time_t next = now - (now % FLOW_PERIOD) + FLOW_PHASE;
+    if (next <= now) next += FLOW_PERIOD;
+    housesprinkler_timer_set (FlowTimer, next);
+
+    // Save the new statistics once the zones that fed them have stopped,
+    // not on every reading.
+    //
+    if (FlowLearned) {
+        int zone;
+        time_t start, end;
+        for (i = 0; (zone = housesprinkler_zone_active (i, &start, &end)) >= 0; ++i) {
+            if (zone < FlowZonesCount && FlowSensorOfZone[zone] >= 0) break;
+        }
+        if (zone < 0) {
+            housesprinkler_state_changed ();
+            FlowLearned = 0;
+        }
+    }
+
+    if (FlowSensorsCount <= 0) return;
+    if (now % FLOW_PERIOD < FLOW_PHASE) return; // Just refreshed.
+
+    // Update the list of flow services. The services that are no longer
+    // listed are forgotten, unless a request is pending.
+    //
+    housediscovered ("flow", &now, housesprinkler_flow_scan);
+
+    int kept = 0;
+    for (i = 0; i < ProvidersCount; ++i) {
+        if (Providers[i].seen < now && !Providers[i].queried) {
+            DEBUG ("Forget flow service %s\n", Providers[i].url);
+            free (Providers[i].url);
+            continue;
+        }
+        if (kept != i) Providers[kept] = Providers[i];
+        kept += 1;
+    }
+    ProvidersCount = kept;
+
+    for (i = 0; i < ProvidersCount; ++i) {
+        SprinklerFlowProvider *provider = Providers + i;
+        if (provider->queried) {
+            if (now < provider->queried + FLOW_TIMEOUT) continue;
+            houselog_trace (HOUSE_FAILURE, provider->url, "no response");
+        }
+        housesprinkler_flow_query (provider, now);
+    }
+}
+
+void housesprinkler_flow_status (SprinklerBuffer *buffer) {
+
+    int i;
+    const char *prefix = "";
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
+
+    housesprinkler_buffer_printf (buffer, "\"sensors\":[");
+    for (i = 0; i < FlowSensorsCount; ++i) {
+        const SprinklerFlowSensor *sensor = FlowSensors + i;
+        const char *zone = "";
+        const char *feed = "";
+        if (sensor->zone >= 0 && sensor->zone < config->zonescount) {
+            zone = config->zones[sensor->zone].name;
+            if (config->zones[sensor->zone].feed)
+                feed = config->zones[sensor->zone].feed;
+        }
+        housesprinkler_buffer_printf (buffer, "%s[\"%s\",%.2f,%ld,\"%c\",\"%s\",\"%s\"]",
+                                      prefix, sensor->name, sensor->value,
+                                      (long)(sensor->received),
+                                      sensor->attributed, zone, feed);
+        prefix = ",";
+    }
+
+    housesprinkler_buffer_printf (buffer, "],\"zones\":[");
+    prefix = "";
+    for (i = 0; i < FlowZonesCount; ++i) {
+        if (FlowStatsOfZone[i] < 0) continue;
+        const SprinklerFlowStats *stats = FlowStats + FlowStatsOfZone[i];
+        if (stats->samples <= 0) continue;
+        housesprinkler_buffer_printf (buffer, "%s[\"%s\",%.2f,%.2f,%ld,\"%c\",%.2f,%ld]",
+                                      prefix, stats->name, stats->mean,
+                                      stats->variance, stats->samples,
+                                      stats->flag, stats->latest,
+                                      (long)(stats->updated));
+        prefix = ",";
+    }
+    housesprinkler_buffer_printf (buffer, "]");
+}
+
@@ -0,0 +1,159 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_hash.c - A name to index table.
+ *
+ * SYNOPSYS:
+ *
+ * This module provides a simple hash table that maps a name to the index
+ * of an item in a module's table (zones, controls, feeds, programs, etc).
+ * Each module owns its own hash table and rebuilds it each time its own
+ * table is rebuilt.
+ *
+ * The hash table does not copy the names: the names must remain valid
+ * for as long as the hash table is used. This is consistent with the
+ * way the configuration strings are used everywhere else.
+ *
+ * void housesprinkler_hash_reset (SprinklerHash *hash, int count);
+ *
+ *    Erase all names from the table. The count is the number of names
+ *    expected, which is used to size the table. The table grows
+ *    automatically if more names are added anyway.
+ *
+ * void housesprinkler_hash_add (SprinklerHash *hash,
+ *                               const char *name, int index);
+ *
+ *    Add one name to the table. If the name was already present, the
+ *    first index added is kept (this matches the traditional linear search
+ *    that returns the first match).
+ *
+ * int housesprinkler_hash_find (const SprinklerHash *hash, const char *name);
+ *
+ *    Return the index associated with the name, or -1 if not found.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define HASH_MINIMUM_SIZE 16
+
+static unsigned int housesprinkler_hash_signature (const char *name) {
+
+    // FNV-1a: simple, fast and good enough for short names.
+    unsigned int signature = 2166136261u;
+    while (*name) {
+        signature ^= (unsigned char)(*name++);
+        signature *= 16777619u;
+    }
+    return signature;
+}
+
+static void housesprinkler_hash_allocate (SprinklerHash *hash, int count) {
+
+    int size = HASH_MINIMUM_SIZE;
+    while (size < 2 * count) size *= 2; // Keep half of the slots free.
+
+    if (size > hash->size) {
+        if (hash->items) free (hash->items);
+        hash->items = calloc (size, sizeof(SprinklerHashItem));
+        hash->size = hash->items ? size : 0;
+    } else if (hash->items) {
+        memset (hash->items, 0, hash->size * sizeof(SprinklerHashItem));
+    }
+    hash->count = 0;
+}
+
+static void housesprinkler_hash_insert (SprinklerHash *hash,
+                                        const char *name,
+                                        unsigned int signature, int index) {
+
+    unsigned int mask = hash->size - 1;
+    unsigned int slot = signature & mask;
+
+    while (hash->items[slot].name) {
+        if (hash->items[slot].signature == signature &&
+            !strcmp (hash->items[slot].name, name)) return; // Keep the first.
+        slot = (slot + 1) & mask;
+    }
+    hash->items[slot].name = name;
+    hash->items[slot].signature = signature;
+    hash->items[slot].index = index;
+    hash->count += 1;
+}
+
+void housesprinkler_hash_reset (SprinklerHash *hash, int count) {
+    housesprinkler_hash_allocate (hash, count);
+}
+
+void housesprinkler_hash_add (SprinklerHash *hash,
+                              const char *name, int index) {
+
+    if (!name) return;
+
+    if (2 * (hash->count + 1) > hash->size) {
+
+        // Rehash everything into a table twice as large.
+        //
+        SprinklerHashItem *old = hash->items;
+        int oldsize = hash->size;
+        int i;
+
+        hash->items = 0;
+        hash->size = 0;
+        housesprinkler_hash_allocate (hash, hash->count + 1);
+        if (!hash->items) {
+            hash->items = old;
+            hash->size = oldsize;
+            return;
+        }
+        DEBUG ("Hash table resized from %d to %d slots\n", oldsize, hash->size);
+        for (i = 0; i < oldsize; ++i) {
+            if (!old[i].name) continue;
+            housesprinkler_hash_insert
+                (hash, old[i].name, old[i].signature, old[i].index);
+        }
+        if (old) free (old);
+    }
+    housesprinkler_hash_insert
+        (hash, name, housesprinkler_hash_signature (name), index);
+}
+
+int housesprinkler_hash_find (const SprinklerHash *hash, const char *name) {
+
+    if (!name || hash->size <= 0) return -1;
+
+    unsigned int signature = housesprinkler_hash_signature (name);
+    unsigned int mask = hash->size - 1;
+    unsigned int slot = signature & mask;
+
+    while (hash->items[slot].name) {
+        if (hash->items[slot].signature == signature &&
+            !strcmp (hash->items[slot].name, name))
+            return hash->items[slot].index;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
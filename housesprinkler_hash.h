@@ -0,0 +1,40 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_hash.h - A name to index table.
+ */
+
+typedef struct {
+    const char *name;
+    unsigned int signature;
+    int index;
+} SprinklerHashItem;
+
+typedef struct {
+    int size;
+    int count;
+    SprinklerHashItem *items;
+} SprinklerHash;
+
+void housesprinkler_hash_reset (SprinklerHash *hash, int count);
+void housesprinkler_hash_add   (SprinklerHash *hash,
+                                const char *name, int index);
+int  housesprinkler_hash_find  (const SprinklerHash *hash, const char *name);
+
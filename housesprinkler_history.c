@@ -0,0 +1,301 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_history.c - Keep a record of the zone pulses.
+ *
+ * SYNOPSYS:
+ *
+ * This module keeps the most recent zone pulses in memory, so that the
+ * watering history can be queried without parsing the event log. The
+ * records are kept in a fixed size ring buffer: once full, the oldest
+ * record is overwritten. Each record has a sequence ID that increases
+ * forever, which is used to page through the history.
+ *
+ * The module also maintains the watering totals of each zone for the
+ * current day and for the last 7 days (including today), updated with
+ * each new record. These totals do not depend on the depth of the ring
+ * buffer.
+ *
+ * void housesprinkler_history_record (const char *zone, time_t start,
+ *                                     int duration, const char *context,
+ *                                     int index);
+ *
+ *    Record one pulse. The context is the name of the program, or 0 (or
+ *    an empty string) for a manual activation. The index is the watering
+ *    index that was applied (100 if none).
+ *
+ * void housesprinkler_history_failed (const char *zone, time_t start);
+ *
+ *    Mark the zone's pulse that started at the specified time as failed,
+ *    i.e. its control command did not go through. A failed pulse remains
+ *    listed, but does not count in the totals.
+ *
+ * void housesprinkler_history_flow (const char *zone, time_t t, double flow);
+ *
+ *    Add one flow measurement to the zone's pulse that was running at
+ *    time t, if it is still in the recent history. The pulse reports the
+ *    average of its measurements.
+ *
+ * long housesprinkler_history_latest (void);
+ *
+ *    Return the ID of the latest record, 0 if none.
+ *
+ * void housesprinkler_history_status (SprinklerBuffer *buffer,
+ *                                     long since, int count, time_t now);
+ *
+ *    Populate the buffer with a JSON object that lists up to count
+ *    records with an ID higher than since, oldest first, followed by the
+ *    totals for each zone.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "houselog.h"
+
+#include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+#include "housesprinkler_buffer.h"
+#include "housesprinkler_history.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define HISTORY_DEPTH 2048 // A few weeks of typical watering.
+#define HISTORY_DAYS  7
+#define HISTORY_FLOW_SEARCH 64 // How far back to look for a running pulse.
+
+typedef struct {
+    long   id;
+    time_t start;
+    int    duration;
+    int    index;
+    int    samples; // Count of flow measurements.
+    double flow;    // Sum of the flow measurements.
+    char   failed;
+    char   zone[48];
+    char   context[48];
+} SprinklerHistoryRecord;
+
+static SprinklerHistoryRecord History[HISTORY_DEPTH];
+static long HistoryLatest = 0;
+
+// The totals for each zone: one bucket per day, reused every week.
+//
+typedef struct {
+    long day; // Day number of this bucket's data.
+    int  watered;
+    int  pulses;
+} SprinklerHistoryDay;
+
+typedef struct {
+    char *name;
+    SprinklerHistoryDay days[HISTORY_DAYS];
+} SprinklerHistoryZone;
+
+static SprinklerHistoryZone *HistoryZones = 0;
+static int                   HistoryZonesCount = 0;
+static int                   HistoryZonesSize = 0;
+static SprinklerHash         HistoryZonesByName;
+
+// The local day number, so that a day starts and ends at midnight.
+//
+static long housesprinkler_history_day (time_t t) {
+    struct tm local;
+    localtime_r (&t, &local);
+    return (long)((t + local.tm_gmtoff) / 86400);
+}
+
+static SprinklerHistoryZone *housesprinkler_history_zone (const char *name) {
+
+    int i = housesprinkler_hash_find (&HistoryZonesByName, name);
+    if (i >= 0) return HistoryZones + i;
+
+    if (HistoryZonesCount >= HistoryZonesSize) {
+        int size = HistoryZonesSize + 16;
+        SprinklerHistoryZone *zones =
+            realloc (HistoryZones, size * sizeof(SprinklerHistoryZone));
+        if (!zones) {
+            houselog_trace (HOUSE_FAILURE, name, "no more memory");
+            return 0;
+        }
+        HistoryZones = zones;
+        HistoryZonesSize = size;
+    }
+    if (!HistoryZonesCount) housesprinkler_hash_reset (&HistoryZonesByName, 16);
+
+    SprinklerHistoryZone *zone = HistoryZones + HistoryZonesCount;
+    memset (zone, 0, sizeof(*zone));
+    zone->name = strdup (name);
+    housesprinkler_hash_add (&HistoryZonesByName, zone->name, HistoryZonesCount++);
+    return zone;
+}
+
+void housesprinkler_history_record (const char *zone, time_t start,
+                                    int duration, const char *context,
+                                    int index) {
+
+    if (!zone) return;
+    if (!context) context = "";
+
+    SprinklerHistoryRecord *record = History + (++HistoryLatest % HISTORY_DEPTH);
+    record->id = HistoryLatest;
+    record->start = start;
+    record->duration = duration;
+    record->index = index;
+    record->samples = 0;
+    record->flow = 0.0;
+    record->failed = 0;
+    snprintf (record->zone, sizeof(record->zone), "%s", zone);
+    snprintf (record->context, sizeof(record->context), "%s", context);
+
+    SprinklerHistoryZone *totals = housesprinkler_history_zone (zone);
+    if (totals) {
+        long day = housesprinkler_history_day (start);
+        SprinklerHistoryDay *bucket = totals->days + (day % HISTORY_DAYS);
+        if (bucket->day != day) {
+            bucket->day = day;
+            bucket->watered = 0;
+            bucket->pulses = 0;
+        }
+        bucket->watered += duration;
+        bucket->pulses += 1;
+    }
+    DEBUG ("History %ld: zone %s for %d seconds (%s, index %d)\n",
+           HistoryLatest, zone, duration, context, index);
+}
+
+void housesprinkler_history_failed (const char *zone, time_t start) {
+
+    long id;
+    long oldest = HistoryLatest - HISTORY_FLOW_SEARCH;
+
+    if (!zone) return;
+
+    for (id = HistoryLatest; id > oldest && id > 0; --id) {
+        SprinklerHistoryRecord *record = History + (id % HISTORY_DEPTH);
+        if (strcmp (record->zone, zone)) continue;
+        if (record->start != start || record->failed) return;
+        record->failed = 1;
+
+        SprinklerHistoryZone *totals = housesprinkler_history_zone (zone);
+        if (totals) {
+            long day = housesprinkler_history_day (start);
+            SprinklerHistoryDay *bucket = totals->days + (day % HISTORY_DAYS);
+            if (bucket->day == day) {
+                bucket->watered -= record->duration;
+                bucket->pulses -= 1;
+            }
+        }
+        DEBUG ("History %ld: zone %s failed\n", id, zone);
+        return;
+    }
+}
+
+void housesprinkler_history_flow (const char *zone, time_t t, double flow) {
+
+    long id;
+    long oldest = HistoryLatest - HISTORY_FLOW_SEARCH;
+
+    if (!zone) return;
+
+    for (id = HistoryLatest; id > oldest && id > 0; --id) {
+        SprinklerHistoryRecord *record = History + (id % HISTORY_DEPTH);
+        if (strcmp (record->zone, zone)) continue;
+        if (t < record->start || t > record->start + record->duration) return;
+        record->flow += flow;
+        record->samples += 1;
+        return;
+    }
+}
+
+long housesprinkler_history_latest (void) {
+    return HistoryLatest;
+}
+
+void housesprinkler_history_status (SprinklerBuffer *buffer,
+                                    long since, int count, time_t now) {
+
+    int i;
+    const char *prefix = "";
+
+    long oldest = HistoryLatest - HISTORY_DEPTH + 1;
+    if (oldest < 1) oldest = 1;
+    if (since < oldest - 1) since = oldest - 1;
+    if (since > HistoryLatest) since = HistoryLatest;
+
+    long last = since + count;
+    if (last > HistoryLatest) last = HistoryLatest;
+
+    housesprinkler_buffer_printf (buffer,
+                                  "\"latest\":%ld,\"oldest\":%ld,\"next\":%ld,\"pulses\":[",
+                                  HistoryLatest, (HistoryLatest > 0) ? oldest : 0, last);
+
+    long id;
+    for (id = since + 1; id <= last; ++id) {
+        const SprinklerHistoryRecord *record = History + (id % HISTORY_DEPTH);
+        housesprinkler_buffer_printf (buffer,
+                                      "%s[%ld,\"%s\",%ld,%d,\"%s\",%d",
+                                      prefix, record->id, record->zone,
+                                      (long)(record->start), record->duration,
+                                      record->context, record->index);
+        if (record->samples > 0)
+            housesprinkler_buffer_printf (buffer, ",%.2f",
+                                          record->flow / record->samples);
+        else
+            housesprinkler_buffer_printf (buffer, ",null");
+        housesprinkler_buffer_printf (buffer, ",%s]",
+                                      record->failed ? "true" : "false");
+        prefix = ",";
+    }
+
+    housesprinkler_buffer_printf (buffer, "],\"zones\":[");
+    prefix = "";
+
+    long today = housesprinkler_history_day (now);
+    for (i = 0; i < HistoryZonesCount; ++i) {
+        const SprinklerHistoryZone *zone = HistoryZones + i;
+        const SprinklerHistoryDay *bucket = zone->days + (today % HISTORY_DAYS);
+        int daywatered = 0;
+        int daypulses = 0;
+        if (bucket->day == today) {
+            daywatered = bucket->watered;
+            daypulses = bucket->pulses;
+        }
+        int weekwatered = 0;
+        int weekpulses = 0;
+        int d;
+        for (d = 0; d < HISTORY_DAYS; ++d) {
+            bucket = zone->days + d;
+            if (bucket->day <= today - HISTORY_DAYS || bucket->day > today)
+                continue;
+            weekwatered += bucket->watered;
+            weekpulses += bucket->pulses;
+        }
+        housesprinkler_buffer_printf (buffer, "%s[\"%s\",%d,%d,%d,%d]",
+                                      prefix, zone->name,
+                                      daywatered, daypulses,
+                                      weekwatered, weekpulses);
+        prefix = ",";
+    }
+    housesprinkler_buffer_printf (buffer, "]");
+}
+
@@ -0,0 +1,34 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_history.h - Keep a record of the zone pulses.
+ */
+
+#include "housesprinkler_buffer.h"
+
+void housesprinkler_history_record (const char *zone, time_t start,
+                                    int duration, const char *context,
+                                    int index);
+void housesprinkler_history_failed (const char *zone, time_t start);
+void housesprinkler_history_flow (const char *zone, time_t t, double flow);
+long housesprinkler_history_latest (void);
+void housesprinkler_history_status (SprinklerBuffer *buffer,
+                                    long since, int count, time_t now);
+
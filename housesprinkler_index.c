@@ -44,7 +44,7 @@
  *
  *    The periodic function that schedule index requests.
  *
- * int housesprinkler_index_status (char *buffer, int size);
+ * void housesprinkler_index_status (SprinklerBuffer *buffer);
  *
  *    Populate the buffer with a JSON object that represents the state
  *    of the watering index.
@@ -52,12 +52,27 @@
  * CONFIGURATION
  *
  * This module searches for the services providing "waterindex", and requests
- * an index from each of them. It reports the index with the highest priority
- * that it knows of.
+ * an index from each of them. The latest index received from each service
+ * is kept, so that all the sources can be shown. The requests to the
+ * different services are independent: a slow or dead service does not delay
+ * the others.
  *
  * The module does not query a service more often than every hour,
  * regardless of the schedule provided. A watering index does not change
- * frequently anyway.
+ * frequently anyway. The queries are conditional (If-Modified-Since),
+ * so that a service may skip sending the same index again. A service that
+ * failed is queried again after one minute, then with an increasing delay
+ * up to one hour.
+ *
+ * The top level "indexmode" configuration item decides how the indexes
+ * from multiple services are combined:
+ * - "priority" (default): use the index with the highest priority, and
+ *   the most recent one if several have the same priority.
+ * - "weighted": use the average of all the indexes, weighted by their
+ *   priority.
+ *
+ * An index older than 3 days is ignored. An index older than one day is
+ * still used, but its origin is reported as "default".
  *
  * The most reasonable use of multiple services is to use one as the primary
  * source (highest priority) and set the others as backups (lower priority).
@@ -73,7 +88,10 @@
 #include "housediscover.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_buffer.h"
 #include "housesprinkler_index.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_timer.h"
 #include "housesprinkler_config.h"
 
 #define DEBUG if (sprinkler_isdebug()) printf
@@ -81,25 +99,63 @@
 #define ONEDAY       86400
 #define DEFAULTINDEX   100
 
+#define INDEX_REFRESH   3600 // Query a service that responded after this.
+#define INDEX_RETRY       60 // First retry after a failure, or no index.
+#define INDEX_DISCOVERY   60 // Look for new services every minute.
+#define INDEX_TIMEOUT    120 // Give up on a request after this.
+
 static int         SprinklerIndex = DEFAULTINDEX;
 static int         SprinklerIndexPriority = 0;
 static time_t      SprinklerIndexTimestamp = 0;
 static char       *SprinklerIndexOrigin = 0;
 static int         SprinklerIndexOriginSize = 0;
 
+static int         SprinklerIndexWeighted = 0;
+
+typedef struct {
+    char  *url;
+    time_t seen;      // Latest time this service was listed by discovery.
+    time_t queried;   // Time of the pending request, 0 if none.
+    time_t next;      // Do not query the service again before this time.
+    int    failures;  // Count of consecutive failures.
+    char   modified[64]; // Last-Modified of the latest response.
+    int    index;
+    int    priority;
+    time_t received;  // When the service received its index, 0: none.
+    char   origin[128];
+    char   source[128];
+} SprinklerIndexProvider;
+
+static SprinklerIndexProvider *Providers = 0;
+static int ProvidersCount = 0;
+static int ProvidersAllocated = 0;
+
+static ParserToken *IndexTokens = 0;
+static int          IndexTokensSize = 0;
+
+static int SprinklerIndexTimer = -1;
+
 static int housesprinkler_index_isvalid (void) {
 
     if (SprinklerIndexTimestamp <= 0) return 0; // No index.
 
-    // Ignore the index if more than 3 days old.
-    int isvalid = (SprinklerIndexTimestamp > (time(0) - (3 * 86400)));
-    if (!isvalid) SprinklerIndexTimestamp = 0; // Do no repeat the same test.
-
-    return isvalid;
+    // Ignore the index if more than 3 days old. This is called when
+    // formatting the status, so the state is left alone: the index is
+    // forgotten by housesprinkler_index_select().
+    //
+    return (SprinklerIndexTimestamp > (time(0) - (3 * 86400)));
 }
 
 void housesprinkler_index_refresh (void) {
-    // No static configuration at this time: based on service discovery.
+
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
+
+    SprinklerIndexWeighted =
+        config->indexmode && (!strcmp (config->indexmode, "weighted"));
+
+    SprinklerIndexTimer =
+        housesprinkler_timer_declare ("index", SPRINKLER_TIMER_REAL);
+    housesprinkler_timer_wakeup (SprinklerIndexTimer);
 }
 
 const char *housesprinkler_index_origin (void) {
@@ -124,45 +180,151 @@ int housesprinkler_index_get (void) {
     return SprinklerIndex;
 }
 
-static void housesprinkler_index_response
-               (void *origin, int status, char *data, int length) {
+static void housesprinkler_index_set_origin (const char *origin) {
 
-   const char *service = (const char *) origin;
-   ParserToken tokens[100];
-   int  count = 100;
-   time_t now = time(0);
+    int size = strlen(origin) + 1;
+    if (size > SprinklerIndexOriginSize) {
+        if (SprinklerIndexOrigin) free (SprinklerIndexOrigin);
+        size += 32; // Avoid repeating the free/malloc sequence too often.
+        SprinklerIndexOrigin = (char *) malloc (size);
+        SprinklerIndexOriginSize = size;
+    }
+    snprintf (SprinklerIndexOrigin, SprinklerIndexOriginSize, "%s", origin);
+}
 
-   status = echttp_redirected("GET");
-   if (!status) {
-       echttp_submit (0, 0, housesprinkler_index_response, origin);
-       return;
-   }
+// Combine the indexes received from all services into the current index.
+//
+static void housesprinkler_index_select (time_t now) {
+
+    int i;
+    const SprinklerIndexProvider *best = 0;
+    long weighted = 0;
+    long weights = 0;
+    int  count = 0;
+    time_t latest = 0;
+
+    for (i = 0; i < ProvidersCount; ++i) {
+        const SprinklerIndexProvider *provider = Providers + i;
+        if (provider->received <= 0) continue;
+        if (provider->received < now - (3 * ONEDAY)) continue; // Expired.
+
+        count += 1;
+        if (provider->received > latest) latest = provider->received;
+        if (provider->priority > 0) {
+            weighted += (long)(provider->index) * provider->priority;
+            weights += provider->priority;
+        }
+        if ((!best) || (provider->priority > best->priority) ||
+            ((provider->priority == best->priority) &&
+             (provider->received > best->received))) best = provider;
+    }
 
-   if (status != 200) {
-       houselog_trace (HOUSE_FAILURE, service, "HTTP code %d", status);
-       return;
+    if (!best) {
+        if (SprinklerIndexTimestamp) {
+            SprinklerIndexTimestamp = 0;
+            housesprinkler_index_set_origin ("default");
+            housesprinkler_status_changed (SPRINKLER_STATUS_INDEX);
+        }
+        return;
+    }
+
+    int index = best->index;
+    time_t timestamp = best->received;
+    char origin[256];
+    snprintf (origin, sizeof(origin), "%s", best->origin);
+
+    if (SprinklerIndexWeighted && count > 1 && weights > 0) {
+        index = (int)((weighted + (weights / 2)) / weights);
+        timestamp = latest;
+        snprintf (origin, sizeof(origin), "%d sources", count);
+    }
+
+    int changed = (index != SprinklerIndex) ||
+                  (best->priority != SprinklerIndexPriority) ||
+                  (!SprinklerIndexOrigin) ||
+                  strcmp (origin, SprinklerIndexOrigin);
+
+    if (!changed && timestamp == SprinklerIndexTimestamp) return;
+
+    SprinklerIndex = index;
+    SprinklerIndexPriority = best->priority;
+    SprinklerIndexTimestamp = timestamp;
+    housesprinkler_index_set_origin (origin);
+    housesprinkler_status_changed (SPRINKLER_STATUS_INDEX);
+
+    // Record this brand new index.
+    //
+    if (changed) {
+        houselog_event ("INDEX", SprinklerIndexOrigin, "APPLY",
+                        "%d%% FROM %s (PRIORITY %d)",
+                        SprinklerIndex,
+                        (count > 1 && SprinklerIndexWeighted) ? "WEIGHTED AVERAGE" : best->source,
+                        SprinklerIndexPriority);
+    }
+}
+
+static SprinklerIndexProvider *housesprinkler_index_provider (const char *url) {
+    int i;
+    for (i = 0; i < ProvidersCount; ++i) {
+        if (!strcmp (Providers[i].url, url)) return Providers + i;
+    }
+    return 0;
+}
+
+// Record a failed request. The delay before the next attempt doubles
+// with each consecutive failure, up to the normal refresh period.
+//
+static void housesprinkler_index_failed (SprinklerIndexProvider *provider,
+                                         time_t now, const char *reason) {
+
+    if (provider->failures == 0)
+        houselog_trace (HOUSE_FAILURE, provider->url, "%s", reason);
+    else
+        DEBUG ("Index service %s failed again: %s\n", provider->url, reason);
+
+    int delay = INDEX_RETRY << (provider->failures < 6 ? provider->failures : 6);
+    if (delay > INDEX_REFRESH) delay = INDEX_REFRESH;
+    provider->failures += 1;
+    provider->next = now + delay;
+    housesprinkler_status_changed (SPRINKLER_STATUS_INDEX); // The source.
+}
+
+static void housesprinkler_index_store (SprinklerIndexProvider *provider,
+                                        char *data, time_t now) {
+
+   int count = echttp_json_estimate (data);
+   if (count > IndexTokensSize) {
+       IndexTokensSize = count + 32;
+       IndexTokens = realloc (IndexTokens, IndexTokensSize * sizeof(ParserToken));
+       if (!IndexTokens) {
+           IndexTokensSize = 0;
+           housesprinkler_index_failed (provider, now, "no more memory");
+           return;
+       }
    }
+   ParserToken *tokens = IndexTokens;
 
-   const char *error;
-   error = echttp_json_parse (data, tokens, &count);
+   const char *error = echttp_json_parse (data, tokens, &count);
    if (error) {
-       houselog_trace (HOUSE_FAILURE, service, "syntax error, %s", error);
+       char reason[256];
+       snprintf (reason, sizeof(reason), "syntax error, %s", error);
+       housesprinkler_index_failed (provider, now, reason);
        return;
    }
    if (count <= 0) {
-       houselog_trace (HOUSE_FAILURE, service, "no data");
+       housesprinkler_index_failed (provider, now, "no data");
        return;
    }
 
    int server = echttp_json_search (tokens, ".host");
    if (server < 0) {
-       houselog_trace (HOUSE_FAILURE, service, "No host name");
+       housesprinkler_index_failed (provider, now, "No host name");
        return;
    }
    int received = echttp_json_search (tokens, ".waterindex.status.received");
    int priority = echttp_json_search (tokens, ".waterindex.status.priority");
    if (received <= 0 || priority <= 0) {
-       houselog_trace (HOUSE_FAILURE, service, "No timestamp or priority");
+       housesprinkler_index_failed (provider, now, "No timestamp or priority");
        return;
    }
 
@@ -170,108 +332,207 @@ static void housesprinkler_index_response
    int    name = echttp_json_search (tokens, ".waterindex.status.name");
    int    source = echttp_json_search (tokens, ".waterindex.status.origin");
    if (index <= 0 || name <= 0 || source <= 0) {
-       houselog_trace (HOUSE_FAILURE, service, "No index or origin");
+       housesprinkler_index_failed (provider, now, "No index or origin");
        return;
    }
 
-   time_t timestamp = (time_t) tokens[received].value.integer;
-   int    ipriority = (int)(tokens[priority].value.integer);
-   int    rawindex  = (int)(tokens[index].value.integer);
-   char  *urlsource = tokens[source].value.string;
+   provider->received = (time_t) tokens[received].value.integer;
+   provider->priority = (int)(tokens[priority].value.integer);
+   provider->index    = (int)(tokens[index].value.integer);
+   snprintf (provider->origin, sizeof(provider->origin), "%s@%s",
+             tokens[name].value.string, tokens[server].value.string);
+   snprintf (provider->source, sizeof(provider->source), "%s",
+             tokens[source].value.string);
 
    DEBUG ("Received index %d at priority %d from %s (service %s)\n",
-          rawindex, ipriority, urlsource, service);
-
-   // Ignore any new index if it is of lower priority, or too old.
-   //
-   if (ipriority < SprinklerIndexPriority ||
-       timestamp < SprinklerIndexTimestamp - ONEDAY ) return;
-
-   // Ignore any new index of the same priority if it is older.
-   //
-   if (ipriority == SprinklerIndexPriority &&
-       timestamp <= SprinklerIndexTimestamp) return;
-
-   // This index seems to be a better one than we currently have:
-   // store the data.
-   //
-   SprinklerIndex = rawindex;
-   SprinklerIndexPriority = ipriority;
-   SprinklerIndexTimestamp = timestamp;
-
-   int size = strlen(tokens[name].value.string) +
-              strlen(tokens[server].value.string) + 2; // Size needed.
-   if (size > SprinklerIndexOriginSize) {
-       if (SprinklerIndexOrigin) free (SprinklerIndexOrigin);
-       size += 32; // Avoid repeating the free/malloc sequence too often.
-       SprinklerIndexOrigin = (char *) malloc (size);
-       SprinklerIndexOriginSize = size;
+          provider->index, provider->priority, provider->source, provider->url);
+
+   const char *modified = echttp_attribute_get ("Last-Modified");
+   snprintf (provider->modified, sizeof(provider->modified),
+             "%s", modified ? modified : "");
+
+   provider->failures = 0;
+   provider->next = now + INDEX_REFRESH;
+   housesprinkler_status_changed (SPRINKLER_STATUS_INDEX); // The source.
+   housesprinkler_index_select (now);
+}
+
+static void housesprinkler_index_response
+               (void *origin, int status, char *data, int length) {
+
+   char *url = (char *) origin;
+   time_t now = time(0);
+
+   status = echttp_redirected("GET");
+   if (!status) {
+       echttp_submit (0, 0, housesprinkler_index_response, origin);
+       return;
    }
-   snprintf (SprinklerIndexOrigin, SprinklerIndexOriginSize, "%s@%s",
-             tokens[name].value.string, tokens[server].value.string);
 
-   // Record this brand new index.
-   //
-   houselog_event ("INDEX", SprinklerIndexOrigin, "APPLY",
-                   "%d%% FROM %s (PRIORITY %d)",
-                   SprinklerIndex, urlsource, ipriority);
+   // The service might have been forgotten while the request was pending.
+   SprinklerIndexProvider *provider = housesprinkler_index_provider (url);
+   free (url);
+   if (!provider) return;
+
+   provider->queried = 0;
+   if (status == 304) {
+       // Nothing new: the index received previously remains current.
+       provider->failures = 0;
+       provider->next = now + INDEX_REFRESH;
+   } else if (status != 200) {
+       char reason[64];
+       snprintf (reason, sizeof(reason), "HTTP code %d", status);
+       housesprinkler_index_failed (provider, now, reason);
+   } else {
+       housesprinkler_index_store (provider, data, now);
+   }
+   housesprinkler_timer_wakeup (SprinklerIndexTimer); // Plan the next query.
 }
 
-static void housesprinkler_index_query
-                (const char *service, void *context, const char *provider) {
+static void housesprinkler_index_query (SprinklerIndexProvider *provider,
+                                        time_t now) {
 
-    char url[156];
+    char url[256];
 
-    snprintf (url, sizeof(url), "%s/status", provider);
+    snprintf (url, sizeof(url), "%s/status", provider->url);
 
     DEBUG ("Requesting index from %s\n", url);
     const char *error = echttp_client ("GET", url);
     if (error) {
-        houselog_trace (HOUSE_FAILURE, url, "%s", error);
+        housesprinkler_index_failed (provider, now, error);
         return;
     }
+    if (provider->modified[0] && provider->received > 0)
+        echttp_attribute_set ("If-Modified-Since", provider->modified);
+
+    provider->queried = now;
+    echttp_submit (0, 0, housesprinkler_index_response,
+                   (void *)strdup(provider->url));
+}
 
-    echttp_submit (0, 0, housesprinkler_index_response, (void *)service);
+static void housesprinkler_index_scan
+                (const char *service, void *context, const char *url) {
+
+    time_t now = *((time_t *)context);
+
+    SprinklerIndexProvider *provider = housesprinkler_index_provider (url);
+    if (!provider) {
+        if (ProvidersCount >= ProvidersAllocated) {
+            ProvidersAllocated += 16;
+            Providers = realloc (Providers,
+                                 ProvidersAllocated * sizeof(*Providers));
+            if (!Providers) {
+                houselog_trace (HOUSE_FAILURE, url, "no more memory");
+                ProvidersAllocated = ProvidersCount = 0;
+                return;
+            }
+        }
+        DEBUG ("New index service %s\n", url);
+        provider = Providers + ProvidersCount++;
+        memset (provider, 0, sizeof(*provider));
+        provider->url = strdup (url);
+    }
+    provider->seen = now;
 }
 
 void housesprinkler_index_periodic (time_t now) {
 
-    static time_t LastInquiry = 0;
+    static time_t LastDiscovery = 0;
 
-    int i, h;
-    struct tm local = *localtime(&now);
+    int i;
 
     if (!now) { // This is a manual reset (force refresh request).
+        for (i = 0; i < ProvidersCount; ++i) {
+            Providers[i].next = 0;
+            Providers[i].received = 0;
+            Providers[i].modified[0] = 0;
+        }
         SprinklerIndexTimestamp = 0;
-        LastInquiry = 0;
+        LastDiscovery = 0;
+        housesprinkler_timer_wakeup (SprinklerIndexTimer);
+        housesprinkler_status_changed (SPRINKLER_STATUS_INDEX);
         return;
     }
-    if (!SprinklerIndexTimestamp) {
-        // We do not know any index yet: try to get an index fast.
-        if (now < LastInquiry + 60) return; // Limit to one attempt per minute.
-    } else {
-        // We just want an update: go slower.
-        if (now < LastInquiry + 3600) return;
+    if (!housesprinkler_timer_due (SprinklerIndexTimer, now)) return;
+
+    // Update the list of index services. The services that are no longer
+    // listed are forgotten, unless a request is pending.
+    //
+    if ((!LastDiscovery) || (now >= LastDiscovery + INDEX_DISCOVERY) ||
+        housediscover_changed ("waterindex", LastDiscovery)) {
+        LastDiscovery = now;
+        int known = ProvidersCount;
+        housediscovered ("waterindex", &now, housesprinkler_index_scan);
+        int added = ProvidersCount - known;
+
+        int kept = 0;
+        for (i = 0; i < ProvidersCount; ++i) {
+            if (Providers[i].seen < now && !Providers[i].queried) {
+                DEBUG ("Forget index service %s\n", Providers[i].url);
+                free (Providers[i].url);
+                continue;
+            }
+            if (kept != i) Providers[kept] = Providers[i];
+            kept += 1;
+        }
+        if (added > 0 || kept != ProvidersCount)
+            housesprinkler_status_changed (SPRINKLER_STATUS_INDEX);
+        ProvidersCount = kept;
     }
-    LastInquiry = now;
 
-    // Forget a stale index.
+    // Query every service that is due, all in parallel. A service that
+    // has not provided any index yet is queried more often.
     //
-    if (now > SprinklerIndexTimestamp + ONEDAY) {
-        SprinklerIndexTimestamp = 0;
-        snprintf (SprinklerIndexOrigin, SprinklerIndexOriginSize, "default");
+    time_t wakeup = LastDiscovery + INDEX_DISCOVERY;
+    for (i = 0; i < ProvidersCount; ++i) {
+        SprinklerIndexProvider *provider = Providers + i;
+        if (provider->queried) {
+            if (now < provider->queried + INDEX_TIMEOUT) continue;
+            provider->queried = 0;
+            housesprinkler_index_failed (provider, now, "no response");
+        }
+        if (now >= provider->next) {
+            if (provider->received <= 0 && provider->failures == 0)
+                provider->next = now + INDEX_RETRY;
+            housesprinkler_index_query (provider, now);
+        }
+        if (provider->queried) {
+            if (provider->queried + INDEX_TIMEOUT < wakeup)
+                wakeup = provider->queried + INDEX_TIMEOUT;
+        } else if (provider->next < wakeup) {
+            wakeup = provider->next;
+        }
     }
+    housesprinkler_timer_set (SprinklerIndexTimer, wakeup);
 
-    housediscovered ("waterindex", 0, housesprinkler_index_query);
+    // Forget the indexes that became too old.
+    housesprinkler_index_select (now);
 }
 
-int housesprinkler_index_status (char *buffer, int size) {
+void housesprinkler_index_status (SprinklerBuffer *buffer) {
+
+    int i;
+    const char *prefix = "";
 
     if (!housesprinkler_index_isvalid()) {
-        return snprintf (buffer, size, "\"origin\":\"default\",\"value\":100");
+        housesprinkler_buffer_printf
+            (buffer, "\"origin\":\"default\",\"value\":100");
+    } else {
+        housesprinkler_buffer_printf (buffer, "\"origin\":\"%s\",\"value\":%d",
+                                      SprinklerIndexOrigin?SprinklerIndexOrigin:"default",
+                                      SprinklerIndex);
     }
-    return snprintf (buffer, size, "\"origin\":\"%s\",\"value\":%d",
-                     SprinklerIndexOrigin?SprinklerIndexOrigin:"default",
-                     SprinklerIndex);
+    housesprinkler_buffer_printf (buffer, ",\"mode\":\"%s\",\"sources\":[",
+                                  SprinklerIndexWeighted?"weighted":"priority");
+    for (i = 0; i < ProvidersCount; ++i) {
+        const SprinklerIndexProvider *provider = Providers + i;
+        housesprinkler_buffer_printf (buffer,
+                                      "%s[\"%s\",\"%s\",%d,%d,%ld,%d]",
+                                      prefix, provider->url, provider->origin,
+                                      provider->index, provider->priority,
+                                      (long)(provider->received),
+                                      provider->failures);
+        prefix = ",";
+    }
+    housesprinkler_buffer_printf (buffer, "]");
 }
-
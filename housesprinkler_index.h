@@ -21,6 +21,8 @@
  * housesprinkler_index.h - Access watering index services.
  */
 
+#include "housesprinkler_buffer.h"
+
 void housesprinkler_index_refresh (void);
 
 const char *housesprinkler_index_origin (void);
@@ -30,5 +32,5 @@ int    housesprinkler_index_get (void);
 
 void housesprinkler_index_periodic (time_t now);
 
-int housesprinkler_index_status (char *buffer, int size);
+void housesprinkler_index_status (SprinklerBuffer *buffer);
 
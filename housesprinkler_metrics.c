@@ -0,0 +1,162 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_metrics.c - Latency histograms for the main loop.
+ *
+ * SYNOPSYS:
+ *
+ * This module measures how long the main loop spends in each activity,
+ * using fixed bucket histograms: recording a measurement is a few integer
+ * operations, and nothing is ever allocated after the metric was declared.
+ * The histograms are reported in the Prometheus text format.
+ *
+ * int housesprinkler_metrics_declare (const char *family, const char *help,
+ *                                     const char *label);
+ *
+ *    Declare a new histogram and return its identifier. The family is the
+ *    Prometheus metric name; the label is either empty or a Prometheus
+ *    label list without the braces, e.g. phase="zone". All the histograms
+ *    of the same family must be declared one after the other, and share
+ *    the same help text. Return -1 if no more histogram can be declared.
+ *
+ * long long housesprinkler_metrics_clock (void);
+ *
+ *    Return a monotonic time in microseconds, to be used as the start
+ *    of a measurement.
+ *
+ * void housesprinkler_metrics_record (int metric, long long started);
+ *
+ *    Record the time elapsed since started (as returned by
+ *    housesprinkler_metrics_clock). An invalid metric is ignored.
+ *
+ * void housesprinkler_metrics_format (SprinklerBuffer *buffer);
+ *
+ *    Append all the histograms to the buffer, in Prometheus text format.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "housesprinkler.h"
+#include "housesprinkler_buffer.h"
+#include "housesprinkler_metrics.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+// The upper bounds of the buckets, in microseconds. The last bucket
+// (+Inf) is implicit.
+//
+static const long long MetricsBounds[] = {
+    100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+};
+#define METRICS_BUCKETS ((sizeof(MetricsBounds) / sizeof(MetricsBounds[0])) + 1)
+
+// There are only a few phases and routes to measure.
+#define METRICS_SLOTS 64
+
+typedef struct {
+    const char *family;
+    const char *help;
+    const char *label;
+    long long sum; // Microseconds.
+    unsigned long count;
+    unsigned long buckets[METRICS_BUCKETS];
+} SprinklerMetric;
+
+static SprinklerMetric Metrics[METRICS_SLOTS];
+static int MetricsCount = 0;
+
+int housesprinkler_metrics_declare (const char *family, const char *help,
+                                    const char *label) {
+
+    if (MetricsCount >= METRICS_SLOTS) return -1;
+
+    SprinklerMetric *metric = Metrics + MetricsCount;
+    memset (metric, 0, sizeof(*metric));
+    metric->family = family;
+    metric->help = help;
+    metric->label = label ? label : "";
+    return MetricsCount++;
+}
+
+long long housesprinkler_metrics_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+void housesprinkler_metrics_record (int metric, long long started) {
+
+    if (metric < 0 || metric >= MetricsCount) return;
+
+    long long elapsed = housesprinkler_metrics_clock() - started;
+    if (elapsed < 0) elapsed = 0;
+
+    SprinklerMetric *m = Metrics + metric;
+    int i;
+    for (i = 0; i < METRICS_BUCKETS - 1; ++i) {
+        if (elapsed <= MetricsBounds[i]) break;
+    }
+    m->buckets[i] += 1;
+    m->count += 1;
+    m->sum += elapsed;
+}
+
+void housesprinkler_metrics_format (SprinklerBuffer *buffer) {
+
+    int i, j;
+    const char *family = "";
+
+    for (i = 0; i < MetricsCount; ++i) {
+        SprinklerMetric *m = Metrics + i;
+        const char *sep = m->label[0] ? "," : "";
+
+        if (strcmp (family, m->family)) {
+            family = m->family;
+            housesprinkler_buffer_printf (buffer,
+                                          "# HELP %s %s\n# TYPE %s histogram\n",
+                                          family, m->help, family);
+        }
+        unsigned long cumulated = 0;
+        for (j = 0; j < METRICS_BUCKETS - 1; ++j) {
+            cumulated += m->buckets[j];
+            housesprinkler_buffer_printf (buffer,
+                                          "%s_bucket{%s%sle=\"%g\"} %lu\n",
+                                          family, m->label, sep,
+                                          MetricsBounds[j] / 1000000.0,
+                                          cumulated);
+        }
+        housesprinkler_buffer_printf (buffer,
+                                      "%s_bucket{%s%sle=\"+Inf\"} %lu\n",
+                                      family, m->label, sep, m->count);
+        if (m->label[0]) {
+            housesprinkler_buffer_printf (buffer, "%s_sum{%s} %.6f\n",
+                                          family, m->label, m->sum / 1000000.0);
+            housesprinkler_buffer_printf (buffer, "%s_count{%s} %lu\n",
+                                          family, m->label, m->count);
+        } else {
+            housesprinkler_buffer_printf (buffer, "%s_sum %.6f\n",
+                                          family, m->sum / 1000000.0);
+            housesprinkler_buffer_printf (buffer, "%s_count %lu\n",
+                                          family, m->count);
+        }
+    }
+}
@@ -0,0 +1,30 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_metrics.h - Latency histograms for the main loop.
+ */
+
+int  housesprinkler_metrics_declare (const char *family, const char *help,
+                                     const char *label);
+
+long long housesprinkler_metrics_clock (void);
+void housesprinkler_metrics_record (int metric, long long started);
+
+void housesprinkler_metrics_format (SprinklerBuffer *buffer);
@@ -0,0 +1,465 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_partition.c - Share the zones between sprinkler instances.
+ *
+ * SYNOPSYS:
+ *
+ * This module lets several sprinkler instances share one configuration,
+ * each instance controlling its own subset of the zones. Each zone belongs
+ * to a partition (the zone's "partition" item, "default" if none), and each
+ * partition is controlled by a single instance at a time.
+ *
+ * An instance takes part in this scheme only when started with the
+ * -partitions=LIST option, where LIST is a comma-separated list of the
+ * partitions it is responsible for (possibly empty, for a standby instance).
+ * Without this option, all zones are controlled locally, and only one
+ * sprinkler instance can be active, as before.
+ *
+ * The instance that controls a partition holds a lease on it, which is
+ * renewed periodically. The leases of all partitions are shared through
+ * the depot, as the file "sprinklerpartitions.json" in the state repository.
+ * Each instance publishes the leases as it knows them, and merges the
+ * leases published by the other instances. The instance responsible for a
+ * partition claims it at any time. Any other instance claims a partition
+ * only when its lease has not been renewed for a while (failover), and
+ * releases it when the responsible instance claims it back. If two
+ * instances claim the same partition, the one responsible for it wins,
+ * then the one with the lowest host name.
+ *
+ * A lost update (two instances writing the file at the same time) is not
+ * an issue: the leases are published again on the next renewal.
+ *
+ * void housesprinkler_partition_initialize (int argc, const char **argv);
+ *
+ *    Decode the command line options and listen to the shared leases.
+ *
+ * void housesprinkler_partition_refresh (void);
+ *
+ *    Build the list of partitions from the new configuration. The leases of
+ *    the partitions that still exist are kept.
+ *
+ * int housesprinkler_partition_enabled (void);
+ *
+ *    Return true if this instance shares the zones with other instances.
+ *
+ * int housesprinkler_partition_find (const char *name);
+ *
+ *    Return the ID of the named partition ("default" if name is 0),
+ *    or -1 if not found.
+ *
+ * int housesprinkler_partition_local (int partition);
+ *
+ *    Return true if the zones of this partition are controlled by this
+ *    instance. Always true when partitioning is not enabled.
+ *
+ * long housesprinkler_partition_generation (void);
+ *
+ *    Return a number that changes each time this instance acquires or
+ *    releases a partition.
+ *
+ * void housesprinkler_partition_periodic (time_t now);
+ *
+ *    Renew, claim or release the partitions' leases.
+ *
+ * void housesprinkler_partition_status (SprinklerBuffer *buffer);
+ *
+ *    Populate the buffer with the partitions' status (JSON).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <echttp_json.h>
+
+#include "houselog.h"
+#include "housedepositor.h"
+
+#include "housesprinkler.h"
+#include "housesprinkler_buffer.h"
+#include "housesprinkler_config.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_timer.h"
+#include "housesprinkler_partition.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define PARTITION_RENEW  20 // Seconds between publications of the leases.
+#define PARTITION_LEASE  90 // Seconds before an unrenewed lease expires.
+
+#define PARTITION_FILE "sprinklerpartitions.json"
+
+static const char PartitionDefault[] = "default";
+
+typedef struct {
+    const char *name;
+    char   owner[64]; // Empty if no known owner.
+    time_t renewed;   // When the owner last renewed its lease.
+    char   preferred; // The owner is responsible for this partition.
+    char   local;     // This instance is the owner.
+    char   assigned;  // This instance is responsible for this partition.
+} SprinklerPartition;
+
+static SprinklerPartition *Partitions = 0;
+static int                 PartitionsCount = 0;
+
+static const char *PartitionAssigned = 0; // 0: partitioning not enabled.
+static time_t      PartitionStarted = 0;
+static long        PartitionGeneration = 0;
+static int         PartitionTimer = -1;
+
+static ParserToken *PartitionTokens = 0;
+static int          PartitionTokensSize = 0;
+static int         *PartitionList = 0;
+static int          PartitionListSize = 0;
+
+static SprinklerBuffer PartitionOut;
+
+// Return true if the name appears in the comma-separated list.
+//
+static int housesprinkler_partition_listed (const char *list,
+                                            const char *name) {
+    int length = strlen (name);
+    while (list && *list) {
+        const char *end = strchr (list, ',');
+        int size = end ? end - list : strlen (list);
+        if (size == length && !strncmp (list, name, size)) return 1;
+        list = end ? end + 1 : 0;
+    }
+    return 0;
+}
+
+// Return true if the claim (owner, preferred) wins over the claim
+// currently recorded for this partition.
+//
+static int housesprinkler_partition_wins (const SprinklerPartition *partition,
+                                          const char *owner, int preferred) {
+    if (preferred != partition->preferred) return preferred;
+    return strcmp (owner, partition->owner) < 0;
+}
+
+static void housesprinkler_partition_acquire (SprinklerPartition *partition,
+                                              time_t now, int expired) {
+    const char *reason = "UNOWNED";
+    if (partition->owner[0]) reason = expired ? "FAILOVER" : "RECLAIM";
+    houselog_event ("PARTITION", partition->name, "ACQUIRED", "%s%s%s",
+                    reason, partition->owner[0] ? " FROM " : "",
+                    partition->owner);
+    snprintf (partition->owner, sizeof(partition->owner), "%s", sprinkler_host());
+    partition->renewed = now;
+    partition->preferred = partition->assigned;
+    partition->local = 1;
+    PartitionGeneration += 1;
+    housesprinkler_status_changed (SPRINKLER_STATUS_PARTITION);
+}
+
+static void housesprinkler_partition_release (SprinklerPartition *partition,
+                                              const char *owner,
+                                              time_t renewed, int preferred) {
+    houselog_event ("PARTITION", partition->name, "RELEASED", "TO %s", owner);
+    housesprinkler_timer_wakeup (PartitionTimer); // Let the zones react.
+    snprintf (partition->owner, sizeof(partition->owner), "%s", owner);
+    partition->renewed = renewed;
+    partition->preferred = preferred;
+    partition->local = 0;
+    PartitionGeneration += 1;
+    housesprinkler_status_changed (SPRINKLER_STATUS_PARTITION);
+}
+
+static void housesprinkler_partition_merge (const char *name,
+                                            const char *owner,
+                                            time_t renewed, int preferred) {
+
+    int i = housesprinkler_partition_find (name);
+    if (i < 0) return; // Not in our configuration (yet).
+    SprinklerPartition *partition = Partitions + i;
+
+    if (!strcmp (owner, sprinkler_host())) return; // We know better.
+    if (renewed < time(0) - PARTITION_LEASE) return; // Expired.
+
+    if (partition->local) {
+        // Two instances claim this partition: only one can win.
+        if (housesprinkler_partition_wins (partition, owner, preferred))
+            housesprinkler_partition_release (partition, owner, renewed, preferred);
+        return;
+    }
+    if (!strcmp (owner, partition->owner)) {
+        if (renewed > partition->renewed) {
+            partition->renewed = renewed;
+            partition->preferred = preferred;
+            housesprinkler_status_changed (SPRINKLER_STATUS_PARTITION);
+        }
+        return;
+    }
+    // A different owner: accept the new claim if the current one expired,
+    // or if this claim wins.
+    //
+    if (partition->renewed < time(0) - PARTITION_LEASE ||
+        (!partition->owner[0]) ||
+        housesprinkler_partition_wins (partition, owner, preferred)) {
+        snprintf (partition->owner, sizeof(partition->owner), "%s", owner);
+        partition->renewed = renewed;
+        partition->preferred = preferred;
+        housesprinkler_status_changed (SPRINKLER_STATUS_PARTITION);
+    }
+}
+
+static void housesprinkler_partition_listener (const char *name, time_t timestamp,
+                                               const char *data, int length) {
+
+    int i;
+
+    char *text = malloc (length + 1);
+    if (!text) return;
+    memcpy (text, data, length);
+    text[length] = 0;
+
+    int count = echttp_json_estimate (text);
+    if (count > PartitionTokensSize) {
+        PartitionTokensSize = count + 32;
+        PartitionTokens =
+            realloc (PartitionTokens, PartitionTokensSize * sizeof(ParserToken));
+        if (!PartitionTokens) {
+            PartitionTokensSize = 0;
+            free (text);
+            return;
+        }
+    }
+    const char *error = echttp_json_parse (text, PartitionTokens, &count);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, name, "syntax error, %s", error);
+        free (text);
+        return;
+    }
+    int leases = echttp_json_search (PartitionTokens, ".partitions");
+    if (leases < 0 || PartitionTokens[leases].type != PARSER_ARRAY) {
+        houselog_trace (HOUSE_FAILURE, name, "no partitions");
+        free (text);
+        return;
+    }
+    int n = PartitionTokens[leases].length;
+    if (n > PartitionListSize) {
+        PartitionListSize = n + 16;
+        PartitionList = realloc (PartitionList, PartitionListSize * sizeof(int));
+        if (!PartitionList) {
+            PartitionListSize = 0;
+            free (text);
+            return;
+        }
+    }
+    if (n > 0) {
+        error = echttp_json_enumerate (PartitionTokens+leases, PartitionList);
+        if (error) {
+            houselog_trace (HOUSE_FAILURE, name, "%s", error);
+            free (text);
+            return;
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        ParserToken *inner = PartitionTokens + leases + PartitionList[i];
+        int partition = echttp_json_search (inner, ".name");
+        int owner = echttp_json_search (inner, ".owner");
+        int renewed = echttp_json_search (inner, ".renewed");
+        int preferred = echttp_json_search (inner, ".preferred");
+        if (partition < 0 || owner < 0 || renewed < 0) continue;
+        if (inner[partition].type != PARSER_STRING) continue;
+        if (inner[owner].type != PARSER_STRING) continue;
+        if (inner[renewed].type != PARSER_INTEGER) continue;
+        housesprinkler_partition_merge
+            (inner[partition].value.string, inner[owner].value.string,
+             (time_t)(inner[renewed].value.integer),
+             (preferred >= 0 && inner[preferred].type == PARSER_BOOL) ?
+                 inner[preferred].value.bool : 0);
+    }
+    free (text);
+}
+
+void housesprinkler_partition_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-partitions=", argv[i], &PartitionAssigned))
+            continue;
+    }
+    if (!PartitionAssigned) return;
+
+    PartitionStarted = time(0);
+    PartitionTimer = housesprinkler_timer_declare ("partition", SPRINKLER_TIMER_REAL);
+    housesprinkler_timer_wakeup (PartitionTimer);
+    housedepositor_subscribe ("state", PARTITION_FILE,
+                              housesprinkler_partition_listener);
+    houselog_event ("PARTITION", "SYSTEM", "ENABLED",
+                    "RESPONSIBLE FOR %s",
+                    PartitionAssigned[0] ? PartitionAssigned : "NONE");
+}
+
+void housesprinkler_partition_refresh (void) {
+
+    int i, j;
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
+
+    SprinklerPartition *old = Partitions;
+    int oldcount = PartitionsCount;
+
+    Partitions = 0;
+    PartitionsCount = 0;
+    if (config->zonescount > 0) {
+        Partitions = housesprinkler_config_allocate
+                         (config->zonescount, sizeof(SprinklerPartition));
+        if (!Partitions) {
+            houselog_trace (HOUSE_FAILURE, "PARTITION", "no more memory");
+            Partitions = old;
+            PartitionsCount = oldcount;
+            return;
+        }
+    }
+    for (i = 0; i < config->zonescount; ++i) {
+        const char *name = config->zones[i].partition;
+        if (!name || !name[0]) name = PartitionDefault;
+        if (housesprinkler_partition_find (name) >= 0) continue;
+
+        SprinklerPartition *partition = Partitions + PartitionsCount++;
+        partition->name = name;
+        partition->assigned =
+            housesprinkler_partition_listed (PartitionAssigned, name);
+        for (j = 0; j < oldcount; ++j) {
+            if (strcmp (old[j].name, name)) continue;
+            memcpy (partition->owner, old[j].owner, sizeof(partition->owner));
+            partition->renewed = old[j].renewed;
+            partition->preferred = old[j].preferred;
+            partition->local = old[j].local;
+            break;
+        }
+        DEBUG ("Partition %s%s\n", name, partition->assigned ? " (assigned)" : "");
+    }
+
+    PartitionGeneration += 1;
+    if (PartitionAssigned) housesprinkler_timer_wakeup (PartitionTimer);
+    housesprinkler_status_changed (SPRINKLER_STATUS_PARTITION);
+}
+
+int housesprinkler_partition_enabled (void) {
+    return PartitionAssigned != 0;
+}
+
+int housesprinkler_partition_find (const char *name) {
+    int i;
+    if (!name || !name[0]) name = PartitionDefault;
+    for (i = 0; i < PartitionsCount; ++i) {
+        if (!strcmp (Partitions[i].name, name)) return i;
+    }
+    return -1;
+}
+
+int housesprinkler_partition_local (int partition) {
+    if (!PartitionAssigned) return 1;
+    if (partition < 0 || partition >= PartitionsCount) return 0;
+    return Partitions[partition].local;
+}
+
+long housesprinkler_partition_generation (void) {
+    return PartitionGeneration;
+}
+
+static void housesprinkler_partition_publish (time_t now) {
+
+    int i;
+    const char *prefix = "";
+
+    housesprinkler_buffer_reset (&PartitionOut);
+    housesprinkler_buffer_printf (&PartitionOut,
+                                  "{\"host\":\"%s\",\"timestamp\":%ld,\"partitions\":[",
+                                  sprinkler_host(), (long)now);
+    for (i = 0; i < PartitionsCount; ++i) {
+        const SprinklerPartition *partition = Partitions + i;
+        if (!partition->owner[0]) continue;
+        housesprinkler_buffer_printf (&PartitionOut,
+                                      "%s{\"name\":\"%s\",\"owner\":\"%s\",\"renewed\":%ld,\"preferred\":%s}",
+                                      prefix, partition->name, partition->owner,
+                                      (long)(partition->renewed),
+                                      partition->preferred ? "true" : "false");
+        prefix = ",";
+    }
+    housesprinkler_buffer_printf (&PartitionOut, "]}");
+    housedepositor_put ("state", PARTITION_FILE,
+                        housesprinkler_buffer_text (&PartitionOut),
+                        housesprinkler_buffer_length (&PartitionOut));
+}
+
+void housesprinkler_partition_periodic (time_t now) {
+
+    int i;
+
+    if (!PartitionAssigned) return;
+    if (!housesprinkler_timer_due (PartitionTimer, now)) return;
+
+    int owned = 0;
+    for (i = 0; i < PartitionsCount; ++i) {
+        SprinklerPartition *partition = Partitions + i;
+        if (partition->local) {
+            partition->renewed = now;
+            owned += 1;
+            continue;
+        }
+        int expired = (!partition->owner[0]) ||
+                      (partition->renewed < now - PARTITION_LEASE);
+        if (partition->assigned) {
+            // Claim it back from an instance that is not responsible for it.
+            if (expired || !partition->preferred ||
+                housesprinkler_partition_wins (partition, sprinkler_host(), 1)) {
+                housesprinkler_partition_acquire (partition, now, expired);
+                owned += 1;
+            }
+        } else if (expired && now > PartitionStarted + PARTITION_LEASE) {
+            // Give the responsible instance some time to claim its
+            // partitions after a restart before taking over.
+            housesprinkler_partition_acquire (partition, now, 1);
+            owned += 1;
+        }
+    }
+    if (owned > 0) housesprinkler_partition_publish (now);
+    housesprinkler_timer_set (PartitionTimer, now + PARTITION_RENEW);
+}
+
+void housesprinkler_partition_status (SprinklerBuffer *buffer) {
+
+    int i;
+    const char *prefix = "";
+
+    housesprinkler_buffer_printf (buffer, "\"enabled\":%s",
+                                  PartitionAssigned ? "true" : "false");
+    if (!PartitionAssigned) return;
+
+    housesprinkler_buffer_printf (buffer, ",\"partitions\":[");
+    for (i = 0; i < PartitionsCount; ++i) {
+        const SprinklerPartition *partition = Partitions + i;
+        housesprinkler_buffer_printf (buffer, "%s[\"%s\",\"%s\",%ld,%s,%s]",
+                                      prefix, partition->name,
+                                      partition->owner,
+                                      (long)(partition->renewed),
+                                      partition->local ? "true" : "false",
+                                      partition->assigned ? "true" : "false");
+        prefix = ",";
+    }
+    housesprinkler_buffer_printf (buffer, "]");
+}
@@ -26,7 +26,7 @@
  *
  *    This function must be called each time the sprinkler configuration
  *    has been changed. It converts the configured programs into activable
- *    ones.
+ *    ones. The zones and seasons must have been refreshed first.
  *
  * void housesprinkler_program_index (int state);
  *
@@ -42,6 +42,11 @@
  *
  *    The two methods for running a watering program: manual or automatic.
  *
+ * void housesprinkler_program_start_batch (const char **names, int count);
+ *
+ *    Manually start a list of programs at once. The external watering
+ *    index is retrieved only once for the whole list.
+ *
  * int housesprinkler_program_running (const char *name);
  *
  *    Indicate is the named program is currently running.
@@ -49,9 +54,10 @@
  * void housesprinkler_program_periodic (time_t now);
  *
  *    Periodic background processing. Detects when the running programs
- *    have completed their run.
+ *    have completed their run, and reports how late the zones started
+ *    (the cumulative drift, see housesprinkler_zone.c).
  *
- * int housesprinkler_program_status (char *buffer, int size);
+ * void housesprinkler_program_status (SprinklerBuffer *buffer);
  *
  *    Report the status of this module as a JSON string.
  */
@@ -65,7 +71,11 @@
 #include "houselog.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+#include "housesprinkler_buffer.h"
 #include "housesprinkler_state.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_timer.h"
 #include "housesprinkler_config.h"
 #include "housesprinkler_zone.h"
 #include "housesprinkler_season.h"
@@ -75,12 +85,14 @@
 
 typedef struct {
     const char *name;
+    int zone; // Resolved when the configuration is loaded, -1 if unknown.
     int runtime;
 } SprinklerProgramZone;
 
 typedef struct {
     const char *name;
     const char *season;
+    int seasonid; // Resolved when the configuration is loaded.
     char running;
     short count;
     SprinklerProgramZone *zones;
@@ -88,93 +100,132 @@ typedef struct {
 
 static SprinklerProgram *Programs = 0;
 static int ProgramsCount = 0;
+static SprinklerHash ProgramsByName;
 
 static int WateringIndexEnabled = 1;
 
+static int ProgramsTimer = -1; // Due every second while a program runs.
+
 static void housesprinkler_program_restore (void) {
     WateringIndexEnabled = housesprinkler_state_get (".useindex");
+    housesprinkler_status_changed (SPRINKLER_STATUS_PROGRAM);
 }
 
-static int housesprinkler_program_backup (char *buffer, int size) {
-    return snprintf (buffer, size,
-                     "\"useindex\":%s", WateringIndexEnabled?"true":"false");
+static void housesprinkler_program_backup (SprinklerBuffer *buffer) {
+    housesprinkler_buffer_printf (buffer, "\"useindex\":%s",
+                                  WateringIndexEnabled?"true":"false");
 }
 
 void housesprinkler_program_refresh (void) {
 
     int i;
-    short count;
-    int content;
-    char path[128];
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
 
     housesprinkler_state_listen (housesprinkler_program_restore);
     housesprinkler_state_register (housesprinkler_program_backup);
 
+    ProgramsTimer =
+        housesprinkler_timer_declare ("program", SPRINKLER_TIMER_SCHEDULED);
+    housesprinkler_timer_wakeup (ProgramsTimer);
+
+    // Keep the old programs on the side, to recover which ones are running.
+    //
+    SprinklerProgram *oldprograms = Programs;
+    int oldprogramscount = ProgramsCount;
+
     // Reload all watering programs.
     //
-    if (Programs) {
-        for (i = 0; i < ProgramsCount; ++i) {
-            if (Programs[i].zones) free(Programs[i].zones);
-        }
-        free (Programs);
-    } else {
+    if (!oldprograms) {
         // Program start: restore the internal state.
         housesprinkler_program_restore();
     }
     Programs = 0;
-    ProgramsCount = 0;
-    content = housesprinkler_config_array (0, ".programs");
-    if (content > 0) {
-        ProgramsCount = housesprinkler_config_array_length (content);
-        if (ProgramsCount > 0) {
-            Programs = calloc (ProgramsCount, sizeof(SprinklerProgram));
-            DEBUG ("Loading %d programs\n", ProgramsCount);
-        }
+    ProgramsCount = config->programscount;
+    if (ProgramsCount > 0) {
+        Programs = housesprinkler_config_allocate (ProgramsCount, sizeof(SprinklerProgram));
+        DEBUG ("Loading %d programs\n", ProgramsCount);
     }
+    housesprinkler_hash_reset (&ProgramsByName, ProgramsCount);
 
     for (i = 0; i < ProgramsCount; ++i) {
+        const SprinklerConfigProgram *program = config->programs + i;
+
         Programs[i].name = 0;
         Programs[i].zones = 0;
         Programs[i].count = 0;
         Programs[i].season = 0;
+        Programs[i].seasonid = -1;
         Programs[i].running = 0;
 
-        snprintf (path, sizeof(path), "[%d]", i);
-        int program = housesprinkler_config_object (content, path);
-        if (program > 0) {
-            Programs[i].name = housesprinkler_config_string (program, ".name");
-            if (!Programs[i].name) continue;
-
-            Programs[i].season = housesprinkler_config_string (program, ".season");
-            int zones = housesprinkler_config_array (program, ".zones");
-            if (zones <= 0) continue;
-
-            count = housesprinkler_config_array_length (zones);
-            if (count > 0) {
-                int j;
-                Programs[i].zones = calloc (count, sizeof(SprinklerProgramZone));
-                for (j = 0; j < count; ++j) {
-                    snprintf (path, sizeof(path), "[%d]", j);
-                    int zone = housesprinkler_config_object (zones, path);
-                    Programs[i].zones[j].name =
-                        housesprinkler_config_string (zone, ".name");
-                    Programs[i].zones[j].runtime =
-                        housesprinkler_config_integer (zone, ".time");
+        Programs[i].name = program->name;
+        if (!Programs[i].name) continue;
+        housesprinkler_hash_add (&ProgramsByName, Programs[i].name, i);
+
+        Programs[i].season = program->season;
+        Programs[i].seasonid = housesprinkler_season_find (program->season);
+
+        short count = program->count;
+        if (count > 0) {
+            int j;
+            Programs[i].zones =
+                housesprinkler_config_allocate (count, sizeof(SprinklerProgramZone));
+            for (j = 0; j < count; ++j) {
+                Programs[i].zones[j].name = program->zones[j].name;
+                Programs[i].zones[j].zone =
+                    housesprinkler_zone_find (program->zones[j].name);
+                Programs[i].zones[j].runtime = program->zones[j].time;
+                if (Programs[i].zones[j].zone < 0)
+                    houselog_event ("PROGRAM", Programs[i].name, "INVALID",
+                                    "UNKNOWN ZONE %s", program->zones[j].name);
+            }
+        }
+        Programs[i].count = count;
+        DEBUG ("\tProgram %s (%d zones)\n", Programs[i].name, count);
+    }
+
+    if (oldprograms) {
+        // This is a configuration change: a program that was running
+        // is still running, since its zones remain queued.
+        //
+        for (i = 0; i < oldprogramscount; ++i) {
+            if (oldprograms[i].running) {
+                int program =
+                    housesprinkler_hash_find (&ProgramsByName, oldprograms[i].name);
+                if (program >= 0) {
+                    Programs[program].running = 1;
+                } else {
+                    houselog_event
+                        ("PROGRAM", oldprograms[i].name, "STOP", "REMOVED");
                 }
             }
-            Programs[i].count = count;
-            DEBUG ("\tProgram %s (%d zones)\n", Programs[i].name, count);
         }
     }
+    housesprinkler_status_changed (SPRINKLER_STATUS_PROGRAM);
 }
 
 void housesprinkler_program_index (int state) {
     WateringIndexEnabled = state;
     housesprinkler_state_changed ();
+    housesprinkler_status_changed (SPRINKLER_STATUS_PROGRAM);
+}
+
+// The external index, as retrieved for the current activation(s).
+//
+typedef struct {
+    int priority;
+    int index;
+    const char *origin;
+} SprinklerProgramIndex;
+
+static void housesprinkler_program_external (SprinklerProgramIndex *external) {
+    external->priority = housesprinkler_index_priority ();
+    external->index = housesprinkler_index_get ();
+    external->origin = housesprinkler_index_origin ();
 }
 
 static void housesprinkler_program_activate
-                (SprinklerProgram *program, int manual) {
+                (SprinklerProgram *program, int manual,
+                 const SprinklerProgramIndex *external) {
 
     // The first task during activation is to calculate the watering index
     // that applies at this time.
@@ -202,7 +253,7 @@ static void housesprinkler_program_activate
     if (WateringIndexEnabled) {
 
         if (program->season) {
-            index = housesprinkler_season_index (program->season);
+            index = housesprinkler_season_index (program->seasonid);
             if (!index) {
                 if (!manual) {
                     houselog_event ("PROGRAM", program->name,
@@ -212,13 +263,13 @@ static void housesprinkler_program_activate
                 index = 100; // The user did override the season index.
             }
             indexname = program->season;
-            priority = housesprinkler_season_priority (program->season);
+            priority = housesprinkler_season_priority (program->seasonid);
         }
 
         // Uses the external index only if valid and of a higher priority.
-        if (housesprinkler_index_priority () > priority) {
-            index = housesprinkler_index_get ();
-            indexname = housesprinkler_index_origin ();
+        if (external->priority > priority) {
+            index = external->index;
+            indexname = external->origin;
         }
     }
 
@@ -238,30 +289,52 @@ static void housesprinkler_program_activate
     for (i = 0; i < program->count; ++i) {
         int runtime = (program->zones[i].runtime * index) / 100;
         housesprinkler_zone_activate
-            (program->zones[i].name, runtime, context);
+            (program->zones[i].zone, runtime, context, index);
     }
 
     program->running = 1;
+    housesprinkler_timer_wakeup (ProgramsTimer);
+    housesprinkler_status_changed (SPRINKLER_STATUS_PROGRAM);
 }
 
 static int housesprinkler_program_find (const char *name) {
-    int i;
-    for (i = 0; i < ProgramsCount; ++i) {
-        if (strcmp (name, Programs[i].name) == 0) return i;
-    }
-    return -1;
+    return housesprinkler_hash_find (&ProgramsByName, name);
 }
 
 void housesprinkler_program_start_manual (const char *name) {
 
     int i = housesprinkler_program_find(name);
-    if (i >= 0) housesprinkler_program_activate (Programs+i, 1);
+    if (i >= 0) {
+        SprinklerProgramIndex external;
+        housesprinkler_program_external (&external);
+        housesprinkler_program_activate (Programs+i, 1, &external);
+    }
 }
 
 void housesprinkler_program_start_scheduled (const char *name) {
 
     int i = housesprinkler_program_find(name);
-    if (i >= 0) housesprinkler_program_activate (Programs+i, 0);
+    if (i >= 0) {
+        SprinklerProgramIndex external;
+        housesprinkler_program_external (&external);
+        housesprinkler_program_activate (Programs+i, 0, &external);
+    }
+}
+
+void housesprinkler_program_start_batch (const char **names, int count) {
+
+    int i;
+    SprinklerProgramIndex external;
+
+    housesprinkler_program_external (&external);
+    for (i = 0; i < count; ++i) {
+        int program = housesprinkler_program_find(names[i]);
+        if (program < 0) {
+            houselog_event ("PROGRAM", names[i], "UNKNOWN", "%s", "not found");
+            continue;
+        }
+        housesprinkler_program_activate (Programs+program, 1, &external);
+    }
 }
 
 int housesprinkler_program_running (const char *name) {
@@ -273,45 +346,45 @@ int housesprinkler_program_running (const char *name) {
 
 void housesprinkler_program_periodic (time_t now) {
 
+    int i;
+    int running = 0;
+
+    if (!housesprinkler_timer_due (ProgramsTimer, now)) return;
+
     if (housesprinkler_zone_idle()) {
-        int i;
         for (i = 0; i < ProgramsCount; ++i) {
             if (Programs[i].running) {
-                houselog_event ("PROGRAM", Programs[i].name, "STOP", "");
+                houselog_event ("PROGRAM", Programs[i].name, "STOP",
+                                "DRIFT %ld MS", housesprinkler_zone_drift());
                 Programs[i].running = 0;
+                housesprinkler_status_changed (SPRINKLER_STATUS_PROGRAM);
             }
         }
     }
+    for (i = 0; i < ProgramsCount; ++i) running |= Programs[i].running;
+
+    // The end of a program cannot be predicted: check again in a second.
+    if (running)
+        housesprinkler_timer_set (ProgramsTimer, now + 1);
+    else
+        housesprinkler_timer_cancel (ProgramsTimer);
 }
 
-int housesprinkler_program_status (char *buffer, int size) {
+void housesprinkler_program_status (SprinklerBuffer *buffer) {
 
     int i;
     const char *prefix = "";
 
-    int cursor = housesprinkler_program_backup (buffer, size);
-    if (cursor >= size) goto overflow;
-
-    cursor += snprintf (buffer+cursor, size-cursor, ",\"active\":[");
-    if (cursor >= size) goto overflow;
+    housesprinkler_program_backup (buffer);
+    housesprinkler_buffer_printf (buffer, ",\"active\":[");
 
     for (i = 0; i < ProgramsCount; ++i) {
         if (Programs[i].running) {
-            cursor += snprintf (buffer+cursor, size-cursor,
-                                "%s\"%s\"", prefix, Programs[i].name);
+            housesprinkler_buffer_printf (buffer,
+                                          "%s\"%s\"", prefix, Programs[i].name);
             prefix = ",";
         }
     }
-
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
-
-    return cursor;
-
-overflow:
-    houselog_trace (HOUSE_FAILURE, "STATUS",
-                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
-    buffer[0] = 0;
-    return 0;
+    housesprinkler_buffer_printf (buffer, "]");
 }
 
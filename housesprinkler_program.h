@@ -19,6 +19,8 @@
  *
  */
 
+#include "housesprinkler_buffer.h"
+
 void housesprinkler_program_refresh (void);
 
 void housesprinkler_program_index (int state);
@@ -27,10 +29,11 @@ void housesprinkler_program_set_index
 
 void housesprinkler_program_start_manual    (const char *name);
 void housesprinkler_program_start_scheduled (const char *name);
+void housesprinkler_program_start_batch (const char **names, int count);
 int  housesprinkler_program_running         (const char *name);
 
 void housesprinkler_program_periodic (time_t now);
-int  housesprinkler_program_status (char *buffer, int size);
+void housesprinkler_program_status (SprinklerBuffer *buffer);
 
 void housesprinkler_program_switch (void);
 
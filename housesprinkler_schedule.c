@@ -39,6 +39,10 @@
  *
  *    Alternate the sprinkler system between on and off.
  *
+ * int housesprinkler_schedule_on (void);
+ *
+ *    Return true if the sprinkler system is on.
+ *
  * void housesprinkler_schedule_rain (int enabled);
  *
  *    Enable or disable the rain delay feature. This is independent of
@@ -54,7 +58,14 @@
  *    This is the heart of the sprinkler function: activate watering
  *    programs automatically, based on the schedule.
  *
- * int housesprinkler_schedule_status (char *buffer, int size);
+ *    The next start time of each schedule is calculated when the
+ *    configuration is loaded, and again after each start. The schedules
+ *    are kept in a list sorted by next start time, so that this function
+ *    only needs to look at the schedules that are due. A schedule that
+ *    is due while the program is already running, the sprinkler system
+ *    is off or during a rain delay, is skipped until its next start time.
+ *
+ * void housesprinkler_schedule_status (SprinklerBuffer *buffer);
  *
  *    Report the status of this module as a JSON string.
  */
@@ -70,9 +81,13 @@
 
 #include "housesprinkler.h"
 #include "housesprinkler_time.h"
+#include "housesprinkler_buffer.h"
 #include "housesprinkler_state.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_timer.h"
 #include "housesprinkler_config.h"
 #include "housesprinkler_program.h"
+#include "housesprinkler_partition.h"
 #include "housesprinkler_schedule.h"
 
 #define DEBUG if (sprinkler_isdebug()) printf
@@ -92,11 +107,17 @@ typedef struct {
     char days[7];
     char interval;
     time_t lastlaunch;
+    time_t next; // 0 if the schedule will never start.
 } SprinklerSchedule;
 
 static SprinklerSchedule *Schedules = 0;
 static int SchedulesCount = 0;
 
+// The schedules that will start, sorted by next start time.
+static int   *ScheduleTimers = 0;
+static int    ScheduleTimersCount = 0;
+static int    ScheduleTimer = -1; // Nothing to do before its deadline.
+
 static int         WateringIndexState = 1;
 static int         WateringIndex = 100;
 static const char *WateringIndexOrigin = 0;
@@ -106,12 +127,11 @@ static int    RainDelayEnabled = 1;
 static time_t RainDelay = 0;
 
 
-static time_t housesprinkler_schedule_time (int index, const char *path) {
+static time_t housesprinkler_schedule_time (const char *date) {
 
     struct tm local = {0};
     const char *p;
 
-    const char *date = housesprinkler_config_string (index, path);
     if (date) {
         local.tm_mon = atoi(date) - 1;
         p = strchr (date, '/');
@@ -133,11 +153,107 @@ static time_t housesprinkler_schedule_time (int index, const char *path) {
     return 0;
 }
 
+// Calculate the first start time of the schedule at, or after, the
+// specified time (which must be the start of a minute), or 0 if this
+// schedule will never start.
+//
+static time_t housesprinkler_schedule_next (const SprinklerSchedule *schedule,
+                                            time_t from) {
+    int day;
+
+    if (schedule->disabled || !schedule->program) return 0;
+    if (schedule->start.hour < 0) return 0;
+    if (schedule->until > 0 && schedule->until < from) return 0;
+
+    if (schedule->begin > from) from = schedule->begin - (schedule->begin % 60);
+
+    // All the weekdays come back within one week, so there is no point
+    // searching beyond this week plus the interval.
+    //
+    int interval = (schedule->interval > 1) ? schedule->interval : 1;
+    struct tm base = *localtime(&from);
+
+    for (day = 0; day <= 7 * interval + 1; ++day) {
+        struct tm local = base;
+        local.tm_mday += day;
+        local.tm_hour = schedule->start.hour;
+        local.tm_min = schedule->start.minute;
+        local.tm_sec = 0;
+        local.tm_isdst = -1;
+        time_t next = mktime (&local);
+        if (next < from) continue;
+        if (schedule->until > 0 && schedule->until < next) return 0;
+        if (schedule->begin > next) continue;
+        if (!schedule->days[local.tm_wday]) continue;
+
+        // Start only after the specified day interval has passed.
+        // We use a 6 hours (21600 sec) leniency to account for changes
+        // to the schedule start time, for example when the start time is
+        // changed to be a few hours early.
+        //
+        if (schedule->interval > 1) {
+            if (((next - schedule->lastlaunch + 21600) / 86400) < schedule->interval) continue;
+        }
+        return next;
+    }
+    return 0;
+}
+
+// Insert the schedule in the list of timers, based on its next start time.
+//
+static void housesprinkler_schedule_insert (int index) {
+
+    time_t next = Schedules[index].next;
+    if (!next) return;
+
+    int low = 0;
+    int high = ScheduleTimersCount;
+    while (low < high) {
+        // Schedules due at the same time start in configuration order.
+        int middle = (low + high) / 2;
+        time_t other = Schedules[ScheduleTimers[middle]].next;
+        if (other < next || (other == next && ScheduleTimers[middle] < index))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    memmove (ScheduleTimers + low + 1, ScheduleTimers + low,
+             (ScheduleTimersCount - low) * sizeof(int));
+    ScheduleTimers[low] = index;
+    ScheduleTimersCount += 1;
+    housesprinkler_timer_wakeup (ScheduleTimer);
+}
+
+// Recalculate the next start time of every schedule. A schedule never
+// starts twice during the same minute.
+//
+static void housesprinkler_schedule_plan (time_t now) {
+
+    int i;
+    time_t minute = now - (now % 60);
+
+    ScheduleTimersCount = 0;
+    housesprinkler_timer_wakeup (ScheduleTimer);
+    for (i = 0; i < SchedulesCount; ++i) {
+        SprinklerSchedule *schedule = Schedules + i;
+        time_t from = minute;
+        if (schedule->lastlaunch >= minute) from += 60;
+        schedule->next = housesprinkler_schedule_next (schedule, from);
+        if (schedule->next) {
+            DEBUG ("Schedule program %s next start at %ld\n",
+                   schedule->program, (long)(schedule->next));
+            housesprinkler_schedule_insert (i);
+        }
+    }
+    housesprinkler_status_changed (SPRINKLER_STATUS_SCHEDULE);
+}
+
 static void housesprinkler_schedule_restore (void) {
 
-    // Only one sprinkler controller can be active at a time.
+    // Only one sprinkler controller can be active at a time, unless the
+    // zones are partitioned between multiple controllers.
     SprinklerOn = housesprinkler_state_get (".on");
-    if (SprinklerOn) {
+    if (SprinklerOn && !housesprinkler_partition_enabled ()) {
         const char *active = housesprinkler_state_get_string (".host");
         if (active && strcmp (active, sprinkler_host())) SprinklerOn = 0;
     }
@@ -145,37 +261,34 @@ static void housesprinkler_schedule_restore (void) {
 
     RainDelay = (time_t)housesprinkler_state_get (".raindelay");
     if (RainDelay < time(0)) RainDelay = 0; // Expired.
+    housesprinkler_status_changed (SPRINKLER_STATUS_SCHEDULE);
 
     if (!Schedules) return; // To early for restoring.
 
     DEBUG ("Restore from state backup\n");
-    int i = 0;
-    for (;;) {
-        uuid_t uuid;
+    int j;
+    for (j = 0; j < SchedulesCount; ++j) {
+        char ascii[40];
         char path[128];
-        snprintf (path, sizeof(path), ".schedule[%d].id", i);
-        const char *id = housesprinkler_state_get_string (path);
-        if (!id) break;
-        uuid_parse (id, uuid);
-        int j;
-        for (j = 0; j < SchedulesCount; ++j) {
-            if (uuid_compare (uuid, Schedules[j].id)) continue;
-            snprintf (path, sizeof(path), ".schedule[%d].launched", i);
-            Schedules[j].lastlaunch = housesprinkler_state_get (path);
-            DEBUG ("Schedule %d (%s at %02d:%02d) recovers data from backup: lastlaunch = %ld\n", j, Schedules[j].program, Schedules[j].start.hour, Schedules[j].start.minute, (long)(Schedules[j].lastlaunch));
-            break;
+        uuid_unparse (Schedules[j].id, ascii);
+        snprintf (path, sizeof(path), ".schedules.%s.launched", ascii);
+        time_t launched = (time_t)housesprinkler_state_get (path);
+        if (!launched) {
+            // Older backups used a different name for the array.
+            snprintf (path, sizeof(path), ".schedule.%s.launched", ascii);
+            launched = (time_t)housesprinkler_state_get (path);
         }
-        i += 1;
+        if (!launched) continue;
+        Schedules[j].lastlaunch = launched;
+        DEBUG ("Schedule %d (%s at %02d:%02d) recovers data from backup: lastlaunch = %ld\n", j, Schedules[j].program, Schedules[j].start.hour, Schedules[j].start.minute, (long)(Schedules[j].lastlaunch));
     }
+    housesprinkler_schedule_plan (sprinkler_schedulingtime(time(0)));
 }
 
 void housesprinkler_schedule_refresh (void) {
 
     int i, j;
-    int count;
-    int content;
-    char path[128];
-    const char *programname = ".program";
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
 
     // Keep the old schedule set on the side, to recover some live data.
     SprinklerSchedule *oldschedules = Schedules;
@@ -183,30 +296,18 @@ void housesprinkler_schedule_refresh (void) {
 
     // Recalculate all watering schedules.
     Schedules = 0;
-    SchedulesCount = 0;
-    content = housesprinkler_config_array (0, ".schedules");
-    if (content <= 0) {
-        // Compatibility with previous generation of HouseSprinkler configs.
-        DEBUG ("No schedules, loading from programs\n");
-        content = housesprinkler_config_array (0, ".programs");
-        programname = ".name";
-    }
-    if (content > 0) {
-        SchedulesCount = housesprinkler_config_array_length (content);
-        if (SchedulesCount > 0) {
-            Schedules = calloc (SchedulesCount, sizeof(SprinklerSchedule));
-            DEBUG ("Loading %d schedules\n", SchedulesCount);
-        }
+    SchedulesCount = config->schedulescount;
+    ScheduleTimers = 0;
+    ScheduleTimersCount = 0;
+    if (SchedulesCount > 0) {
+        Schedules = housesprinkler_config_allocate (SchedulesCount, sizeof(SprinklerSchedule));
+        ScheduleTimers = housesprinkler_config_allocate (SchedulesCount, sizeof(int));
+        DEBUG ("Loading %d schedules\n", SchedulesCount);
     }
 
     for (i = 0; i < SchedulesCount; ++i) {
-        snprintf (path, sizeof(path), "[%d]", i);
-        int schedule = housesprinkler_config_object (content, path);
-        if (schedule <= 0) {
-            DEBUG ("\tNo schedule at index %d\n", i);
-            continue;
-        }
-        Schedules[i].program = housesprinkler_config_string (schedule, programname);
+        const SprinklerConfigSchedule *schedule = config->schedules + i;
+        Schedules[i].program = schedule->program;
         if (!Schedules[i].program) {
             DEBUG ("\tSchedule with no name at index %d\n", i);
             continue;
@@ -215,7 +316,7 @@ void housesprinkler_schedule_refresh (void) {
         // Retrieve the schedule's ID. If none can be recovered, just
         // generate a new ID so that there is always one.
         //
-        const char *id = housesprinkler_config_string (schedule, ".id");
+        const char *id = schedule->id;
         if (id) {
             if (uuid_parse (id, Schedules[i].id)) {
                 uuid_generate_random (Schedules[i].id);
@@ -224,22 +325,12 @@ void housesprinkler_schedule_refresh (void) {
             uuid_generate_random (Schedules[i].id);
         }
 
-        int days = housesprinkler_config_array (schedule, ".days");
-        j = 0;
-        if (days > 0) {
-            int daylist[8];
-            int daycount = housesprinkler_config_enumerate (days, daylist);
-            for (j = 0; j < daycount; ++j) {
-                Schedules[i].days[j] =
-                    housesprinkler_config_boolean (daylist[j], "");
-            }
-        }
-        for (; j < 8; ++j) Schedules[i].days[j] = 0;
+        for (j = 0; j < 7; ++j) Schedules[i].days[j] = schedule->days[j];
 
-        Schedules[i].interval = housesprinkler_config_integer (schedule, ".interval");
-        Schedules[i].begin = housesprinkler_schedule_time (schedule, ".begin");
-        Schedules[i].until = housesprinkler_schedule_time (schedule, ".until");
-        const char *s = housesprinkler_config_string (schedule, ".start");
+        Schedules[i].interval = schedule->interval;
+        Schedules[i].begin = housesprinkler_schedule_time (schedule->begin);
+        Schedules[i].until = housesprinkler_schedule_time (schedule->until);
+        const char *s = schedule->start;
         if (s) {
             Schedules[i].start.hour = atoi(s);
             const char *m = strchr (s, ':');
@@ -248,8 +339,7 @@ void housesprinkler_schedule_refresh (void) {
             Schedules[i].start.hour = -1; // Will never start, basically.
         }
         Schedules[i].lastlaunch = 0;
-        Schedules[i].disabled =
-            housesprinkler_config_boolean (schedule, ".disabled");
+        Schedules[i].disabled = schedule->disabled;
         DEBUG ("\tSchedule program %s at %02d:%02d\n",
                Schedules[i].program, Schedules[i].start.hour, Schedules[i].start.minute);
     }
@@ -270,7 +360,7 @@ void housesprinkler_schedule_refresh (void) {
                 break;
             }
         }
-        free (oldschedules);
+        housesprinkler_schedule_plan (sprinkler_schedulingtime(time(0)));
         return;
     }
 
@@ -286,9 +376,15 @@ void housesprinkler_schedule_refresh (void) {
 void housesprinkler_schedule_switch (void) {
 
     SprinklerOn = !SprinklerOn;
+    housesprinkler_timer_wakeup (ScheduleTimer);
     houselog_event ("PROGRAM", "SWITCH", SprinklerOn?"ON":"OFF", "");
     housesprinkler_state_share (SprinklerOn);
     housesprinkler_state_changed();
+    housesprinkler_status_changed (SPRINKLER_STATUS_SCHEDULE);
+}
+
+int housesprinkler_schedule_on (void) {
+    return SprinklerOn;
 }
 
 void housesprinkler_schedule_rain (int enabled) {
@@ -301,6 +397,7 @@ void housesprinkler_schedule_rain (int enabled) {
         }
     }
     houselog_event ("SYSTEM", "RAIN DELAY", enabled?"ENABLED":"DISABLED", "");
+    housesprinkler_status_changed (SPRINKLER_STATUS_SCHEDULE);
 }
 
 void housesprinkler_schedule_set_rain (int delay) {
@@ -327,94 +424,73 @@ void housesprinkler_schedule_set_rain (int delay) {
         houselog_event ("SYSTEM", "RAIN DELAY", "EXTENDED",
                         housesprinkler_time_delta_printable (now, RainDelay));
     }
+    housesprinkler_timer_wakeup (ScheduleTimer);
     housesprinkler_state_changed();
+    housesprinkler_status_changed (SPRINKLER_STATUS_SCHEDULE);
 }
 
 void housesprinkler_schedule_periodic (time_t now) {
 
-    static char lasthour = -1;
-    static char lastminute = -1;
+    // Time went backward: the start times cannot be trusted.
+    static time_t latest = 0;
+    if (now < latest) housesprinkler_schedule_plan (now);
+    latest = now;
 
-    if (!SprinklerOn) return;
+    // Nothing to do until then.
+    if (!housesprinkler_timer_due (ScheduleTimer, now)) return;
 
-    struct tm local = *localtime(&now);
-    if (local.tm_hour == lasthour && local.tm_min == lastminute) return;
-    lasthour = local.tm_hour;
-    lastminute = local.tm_min;
-
-    if ((RainDelay > 0) && (RainDelay < now)) {
+    if (SprinklerOn && (RainDelay > 0) && (RainDelay < now)) {
         RainDelay = 0; // No need to save: what was saved is an expired value anyway.
         houselog_event ("SYSTEM", "RAIN DELAY", "EXPIRED", "");
+        housesprinkler_status_changed (SPRINKLER_STATUS_SCHEDULE);
     }
-    if (RainDelay > 0) return;
-
-    DEBUG ("== Checking schedule at %02d:%02d\n", local.tm_hour, local.tm_min);
-
-    int i;
-
-    for (i = 0; i < SchedulesCount; ++i) {
-
-        SprinklerSchedule *schedule = Schedules + i;
-
-        DEBUG ("== Checking schedule for program %s\n", schedule->program);
-
-        if (schedule->disabled) continue;
-        DEBUG ("== program %s is enabled\n", schedule->program);
-
-        if (housesprinkler_program_running(schedule->program)) continue;
-
-        DEBUG ("== Program %s is not running\n", schedule->program);
 
-        // Start only at the time specified.
-        //
-        DEBUG ("== Program %s: must start at %02d:%02d\n", schedule->program, schedule->start.hour, schedule->start.minute);
-        if (local.tm_hour != schedule->start.hour
-            || local.tm_min != schedule->start.minute) continue;
+    time_t minute = now - (now % 60);
 
-        DEBUG ("== Program %s: time of day matches\n", schedule->program);
+    while (ScheduleTimersCount > 0) {
 
-        // Start only if the schedule entry is active at that time.
-        //
-        if (schedule->begin > now) continue;
-        if (schedule->until > 0 && schedule->until < now) continue;
+        int index = ScheduleTimers[0];
+        SprinklerSchedule *schedule = Schedules + index;
+        if (schedule->next > now) break;
 
-        DEBUG ("== Program %s: schedule is active\n", schedule->program);
+        ScheduleTimersCount -= 1;
+        memmove (ScheduleTimers, ScheduleTimers + 1,
+                 ScheduleTimersCount * sizeof(int));
 
-        // Start only on the days specified.
+        // Start only during the minute specified: a start time that
+        // was missed (e.g. the clock jumped forward) is skipped.
         //
-        if (!schedule->days[local.tm_wday]) continue;
-
-        DEBUG ("== Program %s: schedule is for this day\n", schedule->program);
+        if (SprinklerOn && (RainDelay <= 0) && (schedule->next >= minute) &&
+            !housesprinkler_program_running(schedule->program)) {
 
-        // Start only after the specified day interval has passed.
-        // We use a 6 hours (21600 sec) leniency to account for changes
-        // to the schedule start time, for example when the start time is
-        // changed to be a few hours early.
-        //
-        if (schedule->interval > 1) {
-            if (((now - schedule->lastlaunch + 21600) / 86400) < schedule->interval) continue;
+            DEBUG ("== Program %s activated at %ld\n", schedule->program, (long)now);
+            housesprinkler_program_start_scheduled (schedule->program);
+            schedule->lastlaunch = now;
+            housesprinkler_state_changed();
         }
-        DEBUG ("== Program %s: interval  %d has passed\n", schedule->program, schedule->interval);
-
-        DEBUG ("== Program %s activated at %ld\n", schedule->program, (long)now);
-        housesprinkler_program_start_scheduled (schedule->program);
-        schedule->lastlaunch = now;
-        housesprinkler_state_changed();
+        schedule->next = housesprinkler_schedule_next (schedule, minute + 60);
+        housesprinkler_schedule_insert (index);
+        housesprinkler_status_changed (SPRINKLER_STATUS_SCHEDULE);
     }
-}
 
-int housesprinkler_schedule_status (char *buffer, int size) {
+    // Wake up at the next start time, or when the rain delay expires.
+    //
+    time_t wakeup = minute + 3600;
+    if (ScheduleTimersCount > 0)
+        wakeup = Schedules[ScheduleTimers[0]].next;
+    if (SprinklerOn && (RainDelay > 0) && (RainDelay + 1 < wakeup))
+        wakeup = RainDelay + 1;
+    housesprinkler_timer_set (ScheduleTimer, wakeup);
+}
 
-    int cursor = 0;
+void housesprinkler_schedule_status (SprinklerBuffer *buffer) {
 
-    cursor = snprintf (buffer, size,
-                       "\"on\":%s", SprinklerOn?"true":"false");
-    if (cursor >= size) goto overflow;
+    housesprinkler_buffer_printf (buffer,
+                                  "\"on\":%s", SprinklerOn?"true":"false");
 
     if (RainDelayEnabled) {
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            ",\"raindelay\":%d", RainDelay);
-        if (cursor >= size) goto overflow;
+        housesprinkler_buffer_printf (buffer,
+                                      ",\"raindelay\":%ld", (long)RainDelay);
     }
 
     int i;
@@ -422,25 +498,20 @@ int housesprinkler_schedule_status (char *buffer, int size) {
     const char *sep = ",\"schedules\":[";
     for (i = 0; i < SchedulesCount; ++i) {
         uuid_unparse (Schedules[i].id, ascii);
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"id\":\"%s\",\"program\":\"%s\",\"start\":\"%02d:%02d\",\"launched\":%ld}",
-                            sep, ascii, Schedules[i].program, Schedules[i].start.hour, Schedules[i].start.minute, (long)(Schedules[i].lastlaunch));
-        if (cursor >= size) return cursor;
+        housesprinkler_buffer_printf (buffer,
+                            "%s{\"id\":\"%s\",\"program\":\"%s\",\"start\":\"%02d:%02d\",\"launched\":%ld,\"next\":%ld}",
+                            sep, ascii, Schedules[i].program, Schedules[i].start.hour, Schedules[i].start.minute, (long)(Schedules[i].lastlaunch), (long)(Schedules[i].next));
         sep = ",";
     }
     if (sep[1] == 0)
-        cursor += snprintf (buffer+cursor,size-cursor,"]");
-    return cursor;
-
-overflow:
-    houselog_trace (HOUSE_FAILURE, "STATUS",
-                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
-    buffer[0] = 0;
-    return 0;
+        housesprinkler_buffer_printf (buffer, "]");
 }
 
 void housesprinkler_schedule_initialize (int argc, const char **argv) {
 
+    ScheduleTimer =
+        housesprinkler_timer_declare ("schedule", SPRINKLER_TIMER_SCHEDULED);
+
     housesprinkler_state_listen (housesprinkler_schedule_restore);
     housesprinkler_state_register (housesprinkler_schedule_status);
 }
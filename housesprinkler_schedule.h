@@ -21,12 +21,15 @@
  * housesprinkler_schedule.h - Manage the watering schedules.
  */
 
+#include "housesprinkler_buffer.h"
+
 void housesprinkler_schedule_refresh (void);
 void housesprinkler_schedule_switch (void);
+int  housesprinkler_schedule_on (void);
 void housesprinkler_schedule_rain (int enabled);
 void housesprinkler_schedule_set_rain (int delay);
 void housesprinkler_schedule_periodic (time_t now);
-int  housesprinkler_schedule_status (char *buffer, int size);
+void housesprinkler_schedule_status (SprinklerBuffer *buffer);
 
 void housesprinkler_schedule_initialize (int argc, const char **argv);
 
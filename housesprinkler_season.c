@@ -28,15 +28,32 @@
  *    has been changed. It converts the configured seasons into activable
  *    ones.
  *
- * int housesprinkler_season_priority (const char *name);
+ * The index of each season is computed for every day of the current year
+ * when the configuration is loaded (and again when the year changes), so
+ * that the index for today is only a table access. The index values of all
+ * seasons for the current day are kept in a dense array, updated once at
+ * the first query after midnight.
  *
- *    Return the priority of the specified season. or 0 if the season does
+ * int housesprinkler_season_find (const char *name);
+ *
+ *    Return the ID of the specified season, or -1 if the season does not
+ *    exist. The ID remains valid until the next refresh: the programs
+ *    resolve their season when the configuration is loaded.
+ *
+ * int housesprinkler_season_priority (int season);
+ *
+ *    Return the priority of the specified season, or 0 if the season does
  *    not exist.
  *
- * int housesprinkler_season_index (const char *name);
+ * int housesprinkler_season_index (int season);
  *
  *    Return the current watering index given the specific season setting,
  *    or 100 (full watering) if the season does not exist.
+ *
+ * void housesprinkler_season_preview (SprinklerBuffer *buffer);
+ *
+ *    Populate the buffer with a JSON object that lists the index of each
+ *    season for every day of the current year.
  */
 
 #include <string.h>
@@ -48,6 +65,8 @@
 #include "houselog.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+#include "housesprinkler_buffer.h"
 #include "housesprinkler_config.h"
 #include "housesprinkler_season.h"
 
@@ -58,6 +77,7 @@ typedef struct {
     int priority;
     int unit;
     int index[52];
+    int curve[366]; // One index per day of the current year.
 } SprinklerSeason;
 
 #define SPRINKLER_SEASON_INVALID  0
@@ -66,110 +86,201 @@ typedef struct {
 
 static SprinklerSeason *Seasons = 0;
 static int SeasonsCount = 0;
+static SprinklerHash SeasonsByName;
 
-static int housesprinkler_season_find (const char *name) {
-    int i;
+static int  SeasonsYear = 0;    // The year of the curves.
+static int  SeasonsDays = 0;    // The number of days in that year.
+static int *SeasonsToday = 0;   // The index of each season for today.
+static time_t SeasonsTodayStart = 0; // Today's index is valid from..
+static time_t SeasonsTodayEnd = 0;   // .. until then.
+
+int housesprinkler_season_find (const char *name) {
     if (!name) return -1;
+    return housesprinkler_hash_find (&SeasonsByName, name);
+}
+
+static int housesprinkler_season_compute (const SprinklerSeason *season,
+                                          const struct tm *local) {
+
+    // Week of the year. We do not care about getting the exact
+    // result, just having something matching the period of the year.
+    //
+    int week = (local->tm_yday - local->tm_wday + 4) / 7;
+    if (week < 0) week = 51;
+    else if (week >= 52) week -= 52;
+
+    switch (season->unit) {
+        case SPRINKLER_SEASON_WEEKLY:
+            return season->index[week];
+        case SPRINKLER_SEASON_MONTHLY:
+            return season->index[local->tm_mon];
+    }
+    return 100;
+}
+
+// Compute the index of every season for each day of the specified year.
+//
+static void housesprinkler_season_curves (int year) {
+
+    int i, day;
+    struct tm local;
+
+    memset (&local, 0, sizeof(local));
+    local.tm_year = year - 1900;
+    local.tm_mon = 0;
+    local.tm_mday = 1;
+    local.tm_hour = 12; // Avoid any daylight saving time side effect.
+    local.tm_isdst = -1;
+    time_t t = mktime (&local);
+
+    for (day = 0; day < 366; ++day) {
+        struct tm current;
+        localtime_r (&t, &current);
+        if (current.tm_year != year - 1900) break;
+        for (i = 0; i < SeasonsCount; ++i) {
+            int index = housesprinkler_season_compute (Seasons + i, &current);
+            if (index < 0) index = 0;
+            Seasons[i].curve[day] = index;
+        }
+        t += 86400;
+    }
+    SeasonsYear = year;
+    SeasonsDays = day;
+    SeasonsTodayEnd = 0; // Force a new daily update.
+}
+
+// Update the index for today if this is a new day (or the configuration
+// has changed).
+//
+static void housesprinkler_season_today (void) {
+
+    int i;
+    time_t now = sprinkler_schedulingtime (time(0));
+
+    if (now >= SeasonsTodayStart && now < SeasonsTodayEnd) return;
+
+    struct tm local;
+    localtime_r (&now, &local);
+    if (local.tm_year + 1900 != SeasonsYear)
+        housesprinkler_season_curves (local.tm_year + 1900);
+
+    int day = local.tm_yday;
+    if (day >= SeasonsDays) day = SeasonsDays - 1;
     for (i = 0; i < SeasonsCount; ++i) {
-        if (strcmp (Seasons[i].name, name) == 0) return i;
+        if (Seasons[i].unit == SPRINKLER_SEASON_INVALID) {
+            DEBUG ("Invalid season %s\n", Seasons[i].name);
+            SeasonsToday[i] = 100;
+            continue;
+        }
+        SeasonsToday[i] = Seasons[i].curve[day];
     }
-    return -1;
+
+    local.tm_hour = local.tm_min = local.tm_sec = 0;
+    local.tm_isdst = -1;
+    SeasonsTodayStart = mktime (&local);
+    local.tm_mday += 1;
+    local.tm_isdst = -1;
+    SeasonsTodayEnd = mktime (&local);
+    DEBUG ("Season indexes updated for day %d of %d\n", day, SeasonsYear);
 }
 
 void housesprinkler_season_refresh (void) {
 
     int i, j;
     int count;
-    int content;
-    char path[128];
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
 
     // Reload all seasons.
     //
-    if (Seasons) free (Seasons);
     Seasons = 0;
-    SeasonsCount = 0;
-    content = housesprinkler_config_array (0, ".seasons");
-    if (content > 0) {
-        SeasonsCount = housesprinkler_config_array_length (content);
-        if (SeasonsCount > 0) {
-            Seasons = calloc (SeasonsCount, sizeof(SprinklerSeason));
-            DEBUG ("Loading %d seasons\n", SeasonsCount);
-        }
+    SeasonsToday = 0;
+    SeasonsCount = config->seasonscount;
+    if (SeasonsCount > 0) {
+        Seasons = housesprinkler_config_allocate (SeasonsCount, sizeof(SprinklerSeason));
+        SeasonsToday = housesprinkler_config_allocate (SeasonsCount, sizeof(int));
+        DEBUG ("Loading %d seasons\n", SeasonsCount);
     }
+    housesprinkler_hash_reset (&SeasonsByName, SeasonsCount);
 
     for (i = 0; i < SeasonsCount; ++i) {
-        snprintf (path, sizeof(path), "[%d]", i);
-        int season = housesprinkler_config_object (content, path);
-        if (season > 0) {
-            Seasons[i].unit = SPRINKLER_SEASON_INVALID; // Safe default.
-            Seasons[i].name = housesprinkler_config_string (season, ".name");
-            if (!Seasons[i].name) continue; // Bad entry.
-
-            int priority = housesprinkler_config_integer (season, ".priority");
+        const SprinklerConfigSeason *season = config->seasons + i;
+        Seasons[i].unit = SPRINKLER_SEASON_INVALID; // Safe default.
+        if (season->name) {
+            Seasons[i].name = season->name;
+            housesprinkler_hash_add (&SeasonsByName, Seasons[i].name, i);
+
+            int priority = season->priority;
             Seasons[i].priority = (priority <= 0) ? 0 : priority;
 
             count = 0;
-            int index = housesprinkler_config_array (season, ".weekly");
-            if (index <= 0) {
-                index = housesprinkler_config_array (season, ".monthly");
-                if (index <= 0) continue; // Bad entry.
+            if (season->weekly < 0) {
+                if (season->monthly < 0) continue; // Bad entry.
                 Seasons[i].unit = SPRINKLER_SEASON_MONTHLY;
                 count = 12;
+                if (count != season->monthly) {
+                    Seasons[i].unit = SPRINKLER_SEASON_INVALID;
+                    continue; // Bad entry.
+                }
             } else {
                 Seasons[i].unit = SPRINKLER_SEASON_WEEKLY;
                 count = 52;
-            }
-            if (count != housesprinkler_config_array_length(index)) {
-                Seasons[i].unit = SPRINKLER_SEASON_INVALID;
-                continue; // Bad entry.
+                if (count != season->weekly) {
+                    Seasons[i].unit = SPRINKLER_SEASON_INVALID;
+                    continue; // Bad entry.
+                }
             }
             for (j = 0; j < count; ++j) {
-                snprintf (path, sizeof(path), "[%d]", j);
-                Seasons[i].index[j] =
-                    housesprinkler_config_integer(index, path);
+                Seasons[i].index[j] = season->index[j];
             }
             DEBUG ("\tSeason %s (%sly)\n",
                    Seasons[i].name,
                    (Seasons[i].unit==SPRINKLER_SEASON_WEEKLY)?"week":"month");
         }
     }
+    SeasonsYear = 0; // Force new curves.
+    SeasonsTodayEnd = 0;
 }
 
-int housesprinkler_season_priority (const char *name) {
-
-    int season = housesprinkler_season_find (name);
-    if (season < 0) return 0; // No season, lowest priority.
+int housesprinkler_season_priority (int season) {
 
+    if (season < 0 || season >= SeasonsCount) return 0; // No season.
     return Seasons[season].priority;
 }
 
-int housesprinkler_season_index (const char *name) {
+int housesprinkler_season_index (int season) {
+
+    if (season < 0 || season >= SeasonsCount) return 100; // Full water.
 
-    int season = housesprinkler_season_find (name);
-    if (season < 0) return 100; // No season, no index. Go full water.
+    housesprinkler_season_today ();
+    return SeasonsToday[season];
+}
 
-    int index = 100;
+void housesprinkler_season_preview (SprinklerBuffer *buffer) {
 
-    // Week of the year. We do not care about getting the exact
-    // result, just having something matching the period of the year.
-    //
-    time_t now = time(0);
-    struct tm local = *localtime(&now);
-    int week = (local.tm_yday - local.tm_wday + 4) / 7;
-    if (week < 0) week = 51;
-    else if (week >= 52) week -= 52;
+    static const char *units[] = {"invalid", "weekly", "monthly"};
+    int i, day;
+    const char *prefix = "";
 
-    switch (Seasons[season].unit) {
-        case SPRINKLER_SEASON_WEEKLY:
-            index = Seasons[season].index[week];
-            break;
-        case SPRINKLER_SEASON_MONTHLY:
-            index = Seasons[season].index[local.tm_mon];
-            break;
-        default:
-            DEBUG ("Invalid season unit %d for %s\n",
-                    Seasons[season].unit, Seasons[season].name);
+    housesprinkler_season_today ();
+
+    housesprinkler_buffer_printf (buffer, "\"year\":%d,\"seasons\":[",
+                                  SeasonsYear);
+    for (i = 0; i < SeasonsCount; ++i) {
+        const SprinklerSeason *season = Seasons + i;
+        if (!season->name) continue;
+        housesprinkler_buffer_printf
+            (buffer,
+             "%s{\"name\":\"%s\",\"priority\":%d,\"unit\":\"%s\",\"today\":%d,\"curve\":[",
+             prefix, season->name, season->priority, units[season->unit],
+             SeasonsToday[i]);
+        if (season->unit != SPRINKLER_SEASON_INVALID) {
+            for (day = 0; day < SeasonsDays; ++day) {
+                housesprinkler_buffer_printf (buffer, "%s%d",
+                                              day?",":"", season->curve[day]);
+            }
+        }
+        housesprinkler_buffer_printf (buffer, "]}");
+        prefix = ",";
     }
-    return index;
+    housesprinkler_buffer_printf (buffer, "]");
 }
-
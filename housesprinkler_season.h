@@ -21,7 +21,11 @@
  * housesprinkler_season.h - Manage the watering seasons.
  */
  
+#include "housesprinkler_buffer.h"
+
 void housesprinkler_season_refresh (void);
-int  housesprinkler_season_priority (const char *name);
-int  housesprinkler_season_index (const char *name);
+int  housesprinkler_season_find (const char *name);
+int  housesprinkler_season_priority (int season);
+int  housesprinkler_season_index (int season);
+void housesprinkler_season_preview (SprinklerBuffer *buffer);
 
@@ -38,6 +38,30 @@
  * - seamless transition from ocal storage only to deport repositories.
  * - keep working even if the depot is not accessible.
  *
+ * The backup data is JSON, both in the local file and in the depot. Once
+ * loaded, the backup is flattened into a table of fixed size records, sorted
+ * by item path, so that each lookup is a binary search. An array element that
+ * has an "id" item is identified by this ID instead of by its position: for
+ * example the last launch of a schedule is ".schedules.<uuid>.launched".
+ *
+ * The same table can also be saved as a binary snapshot file (option
+ * -snapshot=FILE). When present and valid, this snapshot is loaded at
+ * startup instead of the JSON file, using mmap: there is nothing to parse.
+ * The snapshot starts with a header (magic, version, record count, time
+ * saved), followed by the sorted records. A snapshot that does not match
+ * the current format, or that is older than the JSON backup, is ignored
+ * and the JSON backup is loaded instead.
+ *
+ * The state shared through the depot is versioned: a full snapshot
+ * (sprinkler.json, with a "version" item) is followed by deltas
+ * (sprinklerdelta.json) that list the items changed since that snapshot:
+ *
+ *    {"host":"...","base":V,"version":N,"set":{PATH:VALUE,..},"unset":[PATH,..]}
+ *
+ * The paths are the flattened record paths. A new full snapshot is published
+ * when the changes are too numerous, and at least once an hour, so that a
+ * peer that missed a snapshot recovers.
+ *
  * SYNOPSYS:
  *
  * void housesprinkler_state_share (int on);
@@ -57,7 +81,8 @@
  * void housesprinkler_state_register (BackupWorker *worker);
  *
  *    Register a worker function to export a module's internal state to JSON.
- *    Worker functions are called when the state must be saved.
+ *    Worker functions are called when the state must be saved. A worker
+ *    function appends its JSON items to the provided buffer.
  *
  *    Modules that need to backup data must use this to register a worker
  *    function that exports the module's internal state to a JSON structure
@@ -70,6 +95,7 @@
  *    saved live values that can be changed from the user interface and must
  *    survive a program restart. Supported data types are boolean, integer and
  *    string (for now). A boolean is reported as an integer (0 or 1).
+ *    Strings are limited to 127 characters.
  *
  * void housesprinkler_state_changed (void);
  *
@@ -93,7 +119,9 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include <echttp_json.h>
 
@@ -101,6 +129,9 @@
 #include "housedepositor.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_buffer.h"
+#include "housesprinkler_file.h"
+#include "housesprinkler_timer.h"
 #include "housesprinkler_state.h"
 
 #define DEBUG if (sprinkler_isdebug()) printf
@@ -111,17 +142,77 @@ static int   BackupTokenCount = 0;
 static char *BackupInText = 0;
 
 static const char *BackupFile = "/etc/house/sprinklerbkp.json";
+static const char *SnapshotFile = 0; // No binary snapshot by default.
 
 static const char FactoryBackupFile[] =
                       "/usr/local/share/house/public/sprinkler/backup.json";
 
 static time_t StateDataHasChanged = 0;
+static int    StateTimer = -1;
 
 static int ShareStateData = 1;
 static int StateFileEnabled = 1;
 
-static char *BackupOutBuffer = 0;
-static int BackupOutBufferSize = 0;
+static SprinklerBuffer BackupOut;
+
+// The flattened backup data, sorted by path.
+//
+#define STATE_PATH 64
+#define STATE_TEXT 128
+
+#define STATE_INTEGER 'i'
+#define STATE_STRING  's'
+
+typedef struct {
+    char     path[STATE_PATH];
+    char     text[STATE_TEXT];
+    int64_t  value;
+    uint32_t type;
+    uint32_t reserved;
+} SprinklerStateRecord;
+
+#define STATE_MAGIC   "HSPRSTAT" // Exactly 8 characters, no trailing nul.
+#define STATE_VERSION 2
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    int64_t  saved;
+} SprinklerStateHeader;
+
+static const SprinklerStateRecord *BackupRecords = 0;
+static int BackupRecordsCount = 0;
+
+typedef struct {
+    SprinklerStateRecord *records;
+    int count;
+    int size;
+} SprinklerStateTable;
+
+static SprinklerStateTable BackupFlat; // When loaded from JSON.
+
+// The state shared through the depot is a full snapshot (sprinkler.json),
+// followed by the changes since that snapshot (sprinklerdelta.json).
+// The delta is cumulative: it always lists all the changes since its base
+// snapshot, so that a peer that missed some deltas only needs the latest.
+//
+#define STATE_DEPOT_FULL  "sprinkler.json"
+#define STATE_DEPOT_DELTA "sprinklerdelta.json"
+
+#define STATE_FULL_PERIOD 3600 // Publish a full snapshot at least this often.
+#define STATE_DELTA_MAX     64 // Publish a full snapshot if more changes.
+
+static SprinklerStateTable DepotBase;    // The latest full snapshot.
+static long   DepotBaseVersion = 0;      // 0: no snapshot known.
+static long   DepotDeltaVersion = 0;     // Latest delta applied or sent.
+static char  *DepotDeltaPending = 0;     // A delta waiting for its snapshot.
+
+static SprinklerStateTable DepotCurrent; // The state being saved.
+static SprinklerBuffer     DepotDelta;
+
+static void  *SnapshotMap = 0; // When loaded from a snapshot file.
+static size_t SnapshotMapSize = 0;
 
 // The backup mechanism relies on collaboration from the modules that
 // need to backup data: only these modules know what data is to be saved.
@@ -173,12 +264,128 @@ static void housesprinkler_state_clear (void) {
         BackupInText = 0;
     }
     BackupTokenCount = 0;
+    if (SnapshotMap) {
+        munmap (SnapshotMap, SnapshotMapSize);
+        SnapshotMap = 0;
+        SnapshotMapSize = 0;
+    }
+    BackupRecords = 0;
+    BackupRecordsCount = 0;
 }
 
-static const char *housesprinkler_state_new (char *data) {
+static SprinklerStateRecord *housesprinkler_state_room
+                                  (SprinklerStateTable *table, int count) {
+    if (count > table->size) {
+        int size = count + 64;
+        SprinklerStateRecord *records =
+            realloc (table->records, size * sizeof(SprinklerStateRecord));
+        if (!records) return 0;
+        table->records = records;
+        table->size = size;
+    }
+    return table->records;
+}
+
+static void housesprinkler_state_add (SprinklerStateTable *table,
+                                      const char *path, int type,
+                                      const char *text, long long value) {
+
+    if (strlen(path) >= STATE_PATH) {
+        DEBUG ("Backup item %s ignored: path too long\n", path);
+        return;
+    }
+    if (!housesprinkler_state_room (table, table->count + 1)) return;
+    SprinklerStateRecord *record = table->records + table->count++;
+    memset (record, 0, sizeof(*record));
+    snprintf (record->path, sizeof(record->path), "%s", path);
+    if (text) snprintf (record->text, sizeof(record->text), "%s", text);
+    record->value = value;
+    record->type = type;
+}
+
+static int housesprinkler_state_skip (int i) {
+
+    int j = i + 1;
+    int c;
+    switch (BackupParsed[i].type) {
+        case PARSER_OBJECT:
+        case PARSER_ARRAY:
+            for (c = 0; c < BackupParsed[i].length; ++c)
+                j = housesprinkler_state_skip (j);
+            break;
+    }
+    return j;
+}
+
+static const char *housesprinkler_state_id (int i) {
+
+    if (BackupParsed[i].type != PARSER_OBJECT) return 0;
+
+    int j = i + 1;
+    int c;
+    for (c = 0; c < BackupParsed[i].length; ++c) {
+        if ((BackupParsed[j].type == PARSER_STRING) &&
+            (!strcmp (BackupParsed[j].key, "id")))
+            return BackupParsed[j].value.string;
+        j = housesprinkler_state_skip (j);
+    }
+    return 0;
+}
+
+static int housesprinkler_state_flatten (SprinklerStateTable *table,
+                                         int i, const char *prefix) {
+
+    char path[STATE_PATH*2];
+    int j = i + 1;
+    int c;
+
+    switch (BackupParsed[i].type) {
+        case PARSER_OBJECT:
+            for (c = 0; c < BackupParsed[i].length; ++c) {
+                snprintf (path, sizeof(path),
+                          "%s.%s", prefix, BackupParsed[j].key);
+                j = housesprinkler_state_flatten (table, j, path);
+            }
+            break;
+        case PARSER_ARRAY:
+            for (c = 0; c < BackupParsed[i].length; ++c) {
+                const char *id = housesprinkler_state_id (j);
+                if (id)
+                    snprintf (path, sizeof(path), "%s.%s", prefix, id);
+                else
+                    snprintf (path, sizeof(path), "%s[%d]", prefix, c);
+                j = housesprinkler_state_flatten (table, j, path);
+            }
+            break;
+        case PARSER_BOOL:
+            housesprinkler_state_add
+                (table, prefix, STATE_INTEGER, 0, BackupParsed[i].value.bool);
+            break;
+        case PARSER_INTEGER:
+            housesprinkler_state_add
+                (table, prefix, STATE_INTEGER, 0, BackupParsed[i].value.integer);
+            break;
+        case PARSER_STRING:
+            housesprinkler_state_add
+                (table, prefix, STATE_STRING, BackupParsed[i].value.string, 0);
+            break;
+    }
+    return j;
+}
+
+static int housesprinkler_state_compare (const void *a, const void *b) {
+    return strcmp (((const SprinklerStateRecord *)a)->path,
+                   ((const SprinklerStateRecord *)b)->path);
+}
+
+// Parse the JSON data into a sorted table of records. The data is freed.
+//
+static const char *housesprinkler_state_parse (char *data,
+                                               SprinklerStateTable *table) {
 
     const char *error;
 
+    table->count = 0;
     BackupInText = data;
     BackupTokenCount = echttp_json_estimate(BackupInText);
     if (BackupTokenCount > BackupTokenAllocated) {
@@ -187,32 +394,357 @@ static const char *housesprinkler_state_new (char *data) {
         BackupParsed = calloc (BackupTokenAllocated, sizeof(ParserToken));
     }
     error = echttp_json_parse (BackupInText, BackupParsed, &BackupTokenCount);
-    if (error) {
-        DEBUG ("Backup config parsing error: %s\n", error);
-        housesprinkler_state_clear ();
-    } else {
+    if (!error) {
         DEBUG ("Planned %d, read %d items of backup config\n", BackupTokenAllocated, BackupTokenCount);
+
+        // The records are copies: the JSON data is not needed anymore.
+        if (BackupTokenCount > 0) housesprinkler_state_flatten (table, 0, "");
+        qsort (table->records, table->count,
+               sizeof(SprinklerStateRecord), housesprinkler_state_compare);
     }
+    echttp_parser_free (BackupInText);
+    BackupInText = 0;
+    BackupTokenCount = 0;
     return error;
 }
 
-static int housesprinkler_state_save (int size) {
+static const char *housesprinkler_state_new (char *data) {
+
+    housesprinkler_state_clear ();
+    const char *error = housesprinkler_state_parse (data, &BackupFlat);
+    if (error) {
+        DEBUG ("Backup config parsing error: %s\n", error);
+        return error;
+    }
+    BackupRecords = BackupFlat.records;
+    BackupRecordsCount = BackupFlat.count;
+    return 0;
+}
+
+static const SprinklerStateRecord *housesprinkler_state_lookup
+              (const SprinklerStateRecord *records, int count, const char *path) {
+
+    int low = 0;
+    int high = count - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int delta = strcmp (records[middle].path, path);
+        if (delta == 0) return records + middle;
+        if (delta < 0)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return 0;
+}
+
+static int housesprinkler_state_same (const SprinklerStateRecord *a,
+                                      const SprinklerStateRecord *b) {
+    if (a->type != b->type) return 0;
+    if (a->type == STATE_STRING) return !strcmp (a->text, b->text);
+    return a->value == b->value;
+}
+
+static int housesprinkler_state_copy (SprinklerStateTable *table,
+                                      const SprinklerStateRecord *records,
+                                      int count) {
+    if (!housesprinkler_state_room (table, count)) return 0;
+    if (count > 0) memcpy (table->records, records, count * sizeof(*records));
+    table->count = count;
+    return 1;
+}
+
+// Return true if file a was modified after file b, or if b does not exist.
+//
+static int housesprinkler_state_newer (const char *a, const char *b) {
+
+    struct stat infoa;
+    struct stat infob;
+
+    if (stat (b, &infob) < 0) return 1;
+    if (stat (a, &infoa) < 0) return 0;
+    if (infoa.st_mtim.tv_sec != infob.st_mtim.tv_sec)
+        return infoa.st_mtim.tv_sec > infob.st_mtim.tv_sec;
+    return infoa.st_mtim.tv_nsec > infob.st_mtim.tv_nsec;
+}
+
+static int housesprinkler_state_map (const char *name) {
+
+    struct stat fileinfo;
+
+    // The JSON backup may have been saved without a snapshot, e.g. when
+    // the snapshot option was not used, or edited by hand. The snapshot
+    // is written after the JSON file when both are saved.
+    //
+    if (housesprinkler_state_newer (BackupFile, name)) {
+        DEBUG ("Snapshot %s is older than %s\n", name, BackupFile);
+        return 0;
+    }
+
+    int fd = open (name, O_RDONLY);
+    if (fd < 0) return 0;
+
+    if (fstat (fd, &fileinfo) < 0 ||
+        fileinfo.st_size < sizeof(SprinklerStateHeader)) {
+        close (fd);
+        return 0;
+    }
+    void *map = mmap (0, fileinfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) return 0;
+
+    const SprinklerStateHeader *header = (const SprinklerStateHeader *)map;
+    const SprinklerStateRecord *records =
+        (const SprinklerStateRecord *)(header + 1);
+
+    const char *error = 0;
+    if (memcmp (header->magic, STATE_MAGIC, sizeof(header->magic)))
+        error = "not a snapshot";
+    else if (header->version != STATE_VERSION)
+        error = "unsupported version";
+    else if (fileinfo.st_size != sizeof(SprinklerStateHeader)
+                                 + header->count * sizeof(*records))
+        error = "invalid size";
+    else {
+        int i;
+        for (i = 0; i < header->count; ++i) {
+            if (records[i].path[STATE_PATH-1] || records[i].text[STATE_TEXT-1]) {
+                error = "invalid record";
+                break;
+            }
+        }
+    }
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, name, "%s", error);
+        munmap (map, fileinfo.st_size);
+        return 0;
+    }
+
+    housesprinkler_state_clear ();
+    SnapshotMap = map;
+    SnapshotMapSize = fileinfo.st_size;
+    BackupRecords = records;
+    BackupRecordsCount = header->count;
+    DEBUG ("Mapped %d items of backup snapshot\n", BackupRecordsCount);
+    return 1;
+}
+
+static void housesprinkler_state_snapshot (const SprinklerStateTable *table) {
+
+    SprinklerStateHeader header;
+    int recordsize = table->count * sizeof(SprinklerStateRecord);
+    int size = sizeof(header) + recordsize;
+
+    char *data = malloc (size);
+    if (!data) return;
+
+    memcpy (header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.version = STATE_VERSION;
+    header.count = table->count;
+    header.saved = time(0);
+    memcpy (data, &header, sizeof(header));
+    if (recordsize > 0) memcpy (data + sizeof(header), table->records, recordsize);
+
+    if (housesprinkler_file_write (SnapshotFile, data, size))
+        DEBUG ("Queued %d records to %s\n", table->count, SnapshotFile);
+    free (data);
+}
+
+// Save the JSON data, and the snapshot of the same state if enabled. The
+// table is the flattened form of the JSON data, 0 if not available (in
+// which case no snapshot is saved, and the previous one becomes obsolete).
+//
+static int housesprinkler_state_save (int size,
+                                      const SprinklerStateTable *table) {
 
     if (!StateFileEnabled) return size; // No error.
 
-    int fd = open (BackupFile, O_WRONLY|O_TRUNC|O_CREAT, 0777);
-    if (fd < 0) {
-        DEBUG ("Cannot open %s\n", BackupFile);
+    // The file is written in the background: the disk may be slow.
+    if (!housesprinkler_file_write
+            (BackupFile, housesprinkler_buffer_text(&BackupOut), size))
         return 0; // Failure.
+
+    DEBUG ("Queued %d characters to %s\n", size, BackupFile);
+
+    if (SnapshotFile && table) housesprinkler_state_snapshot (table);
+    return size;
+}
+
+static void housesprinkler_state_notify (void) {
+    int i;
+    for (i = 0; i < BackupListenerCount; ++i) {
+        BackupRegisteredListener[i] ();
     }
-    int written = write (fd, BackupOutBuffer, size);
-    if (written < 0) {
-        DEBUG ("Cannot write to %s\n", BackupFile);
-    } else {
-        DEBUG ("Wrote %d characters to %s\n", written, BackupFile);
+}
+
+static int housesprinkler_state_format (const char *host);
+
+static int housesprinkler_state_ignored (const char *path) {
+    // The host and version items are carried by the delta's own header.
+    return (!strcmp (path, ".host")) || (!strcmp (path, ".version"));
+}
+
+static void housesprinkler_state_set (SprinklerStateTable *table, int base,
+                                      const char *path, int type,
+                                      const char *text, long long value) {
+
+    SprinklerStateRecord *record = (SprinklerStateRecord *)
+        housesprinkler_state_lookup (table->records, base, path);
+    if (!record) {
+        housesprinkler_state_add (table, path, type, text, value);
+        return;
     }
-    close(fd);
-    return written;
+    memset (record->text, 0, sizeof(record->text));
+    if (text) snprintf (record->text, sizeof(record->text), "%s", text);
+    record->value = value;
+    record->type = type;
+}
+
+// Apply a delta received from the depot on top of its base snapshot.
+// A delta is ignored if it is older than the current state. A delta that
+// is based on a snapshot not received yet is kept until that snapshot
+// arrives.
+//
+static void housesprinkler_state_apply (const char *data) {
+
+    static ParserToken *DeltaParsed = 0;
+    static int DeltaTokenAllocated = 0;
+    int i;
+
+    int count = echttp_json_estimate (data);
+    if (count > DeltaTokenAllocated) {
+        DeltaTokenAllocated = count + 64;
+        if (DeltaParsed) free (DeltaParsed);
+        DeltaParsed = calloc (DeltaTokenAllocated, sizeof(ParserToken));
+    }
+    char *text = echttp_parser_string (data);
+    const char *error = echttp_json_parse (text, DeltaParsed, &count);
+    if (error || count <= 0) {
+        houselog_event ("SYSTEM", "STATE", "ERROR", "DELTA %s",
+                        error ? error : "no data");
+        echttp_parser_free (text);
+        return;
+    }
+    int host = echttp_json_search (DeltaParsed, ".host");
+    int base = echttp_json_search (DeltaParsed, ".base");
+    int version = echttp_json_search (DeltaParsed, ".version");
+    int set = echttp_json_search (DeltaParsed, ".set");
+    int unset = echttp_json_search (DeltaParsed, ".unset");
+
+    if (host <= 0 || base <= 0 || version <= 0 ||
+        DeltaParsed[host].type != PARSER_STRING ||
+        !strcmp (DeltaParsed[host].value.string, sprinkler_host())) {
+        echttp_parser_free (text); // Not a delta, or our own.
+        return;
+    }
+    long baseversion = (long) DeltaParsed[base].value.integer;
+    long deltaversion = (long) DeltaParsed[version].value.integer;
+
+    if (baseversion != DepotBaseVersion) {
+        if (baseversion > DepotBaseVersion) {
+            DEBUG ("Delta %ld waiting for snapshot %ld\n",
+                   deltaversion, baseversion);
+            if (DepotDeltaPending) free (DepotDeltaPending);
+            DepotDeltaPending = strdup (data);
+        }
+        echttp_parser_free (text);
+        return;
+    }
+    if (deltaversion <= DepotDeltaVersion) {
+        echttp_parser_free (text); // Already applied.
+        return;
+    }
+    DepotDeltaVersion = deltaversion;
+
+    // Build the new state from the base and the delta. The lookups cover
+    // only the base records, which are sorted: new records are appended,
+    // and the table is sorted again at the end.
+    //
+    housesprinkler_state_copy (&DepotCurrent, DepotBase.records, DepotBase.count);
+    int basecount = DepotCurrent.count;
+
+    if (unset > 0 && DeltaParsed[unset].type == PARSER_ARRAY) {
+        int n = DeltaParsed[unset].length;
+        int index[n > 0 ? n : 1];
+        if (n > 0 && !echttp_json_enumerate (DeltaParsed+unset, index)) {
+            for (i = 0; i < n; ++i) {
+                const ParserToken *item = DeltaParsed + unset + index[i];
+                if (item->type != PARSER_STRING) continue;
+                SprinklerStateRecord *record = (SprinklerStateRecord *)
+                    housesprinkler_state_lookup (DepotCurrent.records,
+                                                 basecount, item->value.string);
+                if (record) record->type = 0; // Removed below.
+            }
+        }
+    }
+    if (set > 0 && DeltaParsed[set].type == PARSER_OBJECT) {
+        int n = DeltaParsed[set].length;
+        int index[n > 0 ? n : 1];
+        if (n > 0 && !echttp_json_enumerate (DeltaParsed+set, index)) {
+            for (i = 0; i < n; ++i) {
+                const ParserToken *item = DeltaParsed + set + index[i];
+                switch (item->type) {
+                    case PARSER_BOOL:
+                        housesprinkler_state_set (&DepotCurrent, basecount,
+                                                  item->key, STATE_INTEGER,
+                                                  0, item->value.bool);
+                        break;
+                    case PARSER_INTEGER:
+                        housesprinkler_state_set (&DepotCurrent, basecount,
+                                                  item->key, STATE_INTEGER,
+                                                  0, item->value.integer);
+                        break;
+                    case PARSER_STRING:
+                        housesprinkler_state_set (&DepotCurrent, basecount,
+                                                  item->key, STATE_STRING,
+                                                  item->value.string, 0);
+                        break;
+                }
+            }
+        }
+    }
+    housesprinkler_state_set (&DepotCurrent, basecount, ".host",
+                              STATE_STRING, DeltaParsed[host].value.string, 0);
+    char sender[STATE_TEXT];
+    snprintf (sender, sizeof(sender), "%s", DeltaParsed[host].value.string);
+    echttp_parser_free (text);
+
+    int kept = 0;
+    for (i = 0; i < DepotCurrent.count; ++i) {
+        if (!DepotCurrent.records[i].type) continue;
+        if (kept < i) DepotCurrent.records[kept] = DepotCurrent.records[i];
+        kept += 1;
+    }
+    DepotCurrent.count = kept;
+    qsort (DepotCurrent.records, DepotCurrent.count,
+           sizeof(SprinklerStateRecord), housesprinkler_state_compare);
+
+    if (DepotCurrent.count == BackupRecordsCount) {
+        for (i = 0; i < BackupRecordsCount; ++i) {
+            if (strcmp (DepotCurrent.records[i].path, BackupRecords[i].path))
+                break;
+            if (!housesprinkler_state_same (DepotCurrent.records + i,
+                                            BackupRecords + i)) break;
+        }
+        if (i >= BackupRecordsCount) return; // Nothing changed.
+    }
+    houselog_event ("SYSTEM", "STATE", "LOAD", "FROM DEPOT DELTA %ld", deltaversion);
+
+    housesprinkler_state_clear ();
+    SprinklerStateTable previous = BackupFlat;
+    BackupFlat = DepotCurrent;
+    DepotCurrent = previous;
+    BackupRecords = BackupFlat.records;
+    BackupRecordsCount = BackupFlat.count;
+
+    housesprinkler_state_notify ();
+
+    // The local backup is regenerated from the modules, which now reflect
+    // the new state.
+    if (StateFileEnabled)
+        housesprinkler_state_save (housesprinkler_state_format (sender),
+                                   &BackupFlat);
 }
 
 static void housesprinkler_state_listener (const char *name, time_t timestamp,
@@ -227,21 +759,32 @@ static void housesprinkler_state_listener (const char *name, time_t timestamp,
     // We need to make a copy because we do not control the lifetime of
     // the caller's data buffer.
     //
-    if (BackupOutBufferSize < length) {
-        if (BackupOutBuffer) free (BackupOutBuffer);
-        BackupOutBuffer = strdup (data);
-        BackupOutBufferSize = length;
-    } else {
-        snprintf (BackupOutBuffer, BackupOutBufferSize, "%s", data);
-    }
-    housesprinkler_state_save (length); // Best effort only, ignore errors.
+    housesprinkler_buffer_reset (&BackupOut);
+    housesprinkler_buffer_append (&BackupOut, data, length);
+    // Best effort only, ignore errors.
+    housesprinkler_state_save (length, &BackupFlat);
 
-    int i;
-    for (i = 0; i < BackupListenerCount; ++i) {
-        BackupRegisteredListener[i] ();
+    // This is the new base for the deltas that will follow.
+    housesprinkler_state_copy (&DepotBase, BackupRecords, BackupRecordsCount);
+    DepotBaseVersion = housesprinkler_state_get (".version");
+    DepotDeltaVersion = DepotBaseVersion;
+
+    housesprinkler_state_notify ();
+
+    if (DepotDeltaPending) {
+        char *pending = DepotDeltaPending;
+        DepotDeltaPending = 0;
+        housesprinkler_state_apply (pending);
+        free (pending);
     }
 }
 
+static void housesprinkler_state_delta_listener (const char *name,
+                                                 time_t timestamp,
+                                                 const char *data, int length) {
+    housesprinkler_state_apply (data);
+}
+
 const void housesprinkler_state_load (int argc, const char **argv) {
 
     char *newconfig;
@@ -249,6 +792,7 @@ const void housesprinkler_state_load (int argc, const char **argv) {
     int i;
     for (i = 1; i < argc; ++i) {
         if (echttp_option_match ("-backup=", argv[i], &BackupFile)) continue;
+        if (echttp_option_match ("-snapshot=", argv[i], &SnapshotFile)) continue;
         if (echttp_option_present ("-no-local-storage", argv[i])) {
             StateFileEnabled = 0;
             continue;
@@ -257,11 +801,24 @@ const void housesprinkler_state_load (int argc, const char **argv) {
 
     housesprinkler_state_clear ();
 
-    housedepositor_subscribe ("state", "sprinkler.json",
+    StateTimer = housesprinkler_timer_declare ("state", SPRINKLER_TIMER_REAL);
+    housesprinkler_timer_cancel (StateTimer);
+
+    housedepositor_subscribe ("state", STATE_DEPOT_FULL,
                               housesprinkler_state_listener);
+    housedepositor_subscribe ("state", STATE_DEPOT_DELTA,
+                              housesprinkler_state_delta_listener);
 
     if (!StateFileEnabled) return;
 
+    if (SnapshotFile) {
+        DEBUG ("Loading backup snapshot from %s\n", SnapshotFile);
+        if (housesprinkler_state_map (SnapshotFile)) {
+            houselog_event ("SYSTEM", "STATE", "LOAD", "SNAPSHOT %s", SnapshotFile);
+            return;
+        }
+    }
+
     const char *name = BackupFile;
     DEBUG ("Loading backup from %s\n", name);
     newconfig = echttp_parser_load (name);
@@ -270,6 +827,7 @@ const void housesprinkler_state_load (int argc, const char **argv) {
         DEBUG ("Loading backup from %s\n", name);
         newconfig = echttp_parser_load (name);
         StateDataHasChanged = time(0); // Force creation of the backup file.
+        housesprinkler_timer_set (StateTimer, StateDataHasChanged + 1);
     }
 
     if (newconfig) {
@@ -283,72 +841,156 @@ void housesprinkler_state_share (int on) {
     ShareStateData = on;
 }
 
-const char *housesprinkler_state_get_string (const char *path) {
+static const SprinklerStateRecord *housesprinkler_state_search
+                                         (const char *path) {
+    return housesprinkler_state_lookup (BackupRecords, BackupRecordsCount, path);
+}
 
-    if (BackupTokenCount <= 0) return 0;
+const char *housesprinkler_state_get_string (const char *path) {
 
-    int i = echttp_json_search(BackupParsed, path);
-    if (i < 0) return 0;
-    switch (BackupParsed[i].type) {
-        case PARSER_STRING: return BackupParsed[i].value.string;
-    }
-    return 0;
+    const SprinklerStateRecord *record = housesprinkler_state_search (path);
+    if (!record) return 0;
+    if (record->type != STATE_STRING) return 0;
+    return record->text;
 }
 
 long housesprinkler_state_get (const char *path) {
 
-    if (BackupTokenCount <= 0) return 0;
-
     // Support boolean and integer, all converted to integer.
     // Anything else: return 0
     //
-    long value = 0;
-    int i = echttp_json_search(BackupParsed, path);
-    if (i < 0) return 0;
-    switch (BackupParsed[i].type) {
-        case PARSER_BOOL: value = BackupParsed[i].value.bool; break;
-        case PARSER_INTEGER: value = BackupParsed[i].value.integer; break;
-    }
-    return value;
+    const SprinklerStateRecord *record = housesprinkler_state_search (path);
+    if (!record) return 0;
+    if (record->type != STATE_INTEGER) return 0;
+    return (long)(record->value);
 }
 
 void housesprinkler_state_changed (void) {
     if (!StateDataHasChanged) {
         DEBUG("State data has changed.\n");
         StateDataHasChanged = time(0);
+        housesprinkler_timer_set (StateTimer, StateDataHasChanged + 1);
     }
 }
 
-static int housesprinkler_state_format (void) {
+static int housesprinkler_state_format (const char *host) {
 
-    int cursor = 0;
     int i;
-    if (!BackupOutBuffer) {
-       BackupOutBufferSize = 1024;
-       BackupOutBuffer = malloc(BackupOutBufferSize);
-    }
+
     DEBUG("Saving backup data to %s\n", BackupFile);
-    cursor = snprintf (BackupOutBuffer, BackupOutBufferSize,
-                       "{\"host\":\"%s\"", sprinkler_host());
+    housesprinkler_buffer_reset (&BackupOut);
+    housesprinkler_buffer_printf (&BackupOut, "{\"host\":\"%s\"", host);
+    if (DepotBaseVersion > 0)
+        housesprinkler_buffer_printf (&BackupOut,
+                                      ",\"version\":%ld", DepotBaseVersion);
     for (i = 0; i < BackupWorkerCount; ++i) {
-        cursor += snprintf (BackupOutBuffer+cursor, BackupOutBufferSize-cursor, ",");
-        if (cursor >= BackupOutBufferSize) goto retry;
-        cursor += BackupRegisteredWorker[i] (BackupOutBuffer+cursor, BackupOutBufferSize-cursor);
-        if (cursor >= BackupOutBufferSize) goto retry;
+        housesprinkler_buffer_printf (&BackupOut, ",");
+        BackupRegisteredWorker[i] (&BackupOut);
     }
-    cursor += snprintf (BackupOutBuffer+cursor, BackupOutBufferSize-cursor, "}");
-    if (cursor >= BackupOutBufferSize) goto retry;
+    housesprinkler_buffer_printf (&BackupOut, "}");
 
-    return cursor;
+    return housesprinkler_buffer_length (&BackupOut);
+}
 
-retry:
-    DEBUG ("Backup failed: buffer too small\n");
-    houselog_trace (HOUSE_WARNING, "STATE",
-                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
-    BackupOutBufferSize += 1024;
-    free (BackupOutBuffer);
-    BackupOutBuffer = malloc(BackupOutBufferSize);
-    return housesprinkler_state_format ();
+static void housesprinkler_state_value (const SprinklerStateRecord *record) {
+    if (record->type == STATE_STRING)
+        housesprinkler_buffer_printf (&DepotDelta, "\"%s\"", record->text);
+    else
+        housesprinkler_buffer_printf (&DepotDelta, "%lld",
+                                      (long long)(record->value));
+}
+
+// Format the delta between the base snapshot and the current state.
+// Return the number of changes.
+//
+static int housesprinkler_state_diff (long version) {
+
+    const SprinklerStateRecord *base = DepotBase.records;
+    const SprinklerStateRecord *current = DepotCurrent.records;
+    int changes = 0;
+    int i, j;
+
+    housesprinkler_buffer_reset (&DepotDelta);
+    housesprinkler_buffer_printf (&DepotDelta,
+                                  "{\"host\":\"%s\",\"base\":%ld,\"version\":%ld,\"set\":{",
+                                  sprinkler_host(), DepotBaseVersion, version);
+    const char *prefix = "";
+    for (i = 0, j = 0; j < DepotCurrent.count; ++j) {
+        if (housesprinkler_state_ignored (current[j].path)) continue;
+        while (i < DepotBase.count && strcmp (base[i].path, current[j].path) < 0)
+            i += 1;
+        if (i < DepotBase.count && !strcmp (base[i].path, current[j].path) &&
+            housesprinkler_state_same (base + i, current + j)) continue;
+        housesprinkler_buffer_printf (&DepotDelta, "%s\"%s\":",
+                                      prefix, current[j].path);
+        housesprinkler_state_value (current + j);
+        prefix = ",";
+        changes += 1;
+    }
+    housesprinkler_buffer_printf (&DepotDelta, "},\"unset\":[");
+    prefix = "";
+    for (i = 0, j = 0; i < DepotBase.count; ++i) {
+        if (housesprinkler_state_ignored (base[i].path)) continue;
+        while (j < DepotCurrent.count && strcmp (current[j].path, base[i].path) < 0)
+            j += 1;
+        if (j < DepotCurrent.count && !strcmp (current[j].path, base[i].path))
+            continue;
+        housesprinkler_buffer_printf (&DepotDelta, "%s\"%s\"",
+                                      prefix, base[i].path);
+        prefix = ",";
+        changes += 1;
+    }
+    housesprinkler_buffer_printf (&DepotDelta, "]}");
+    return changes;
+}
+
+// Publish the state to the depot: a delta when the changes since the last
+// full snapshot are few, a new full snapshot otherwise. A full snapshot is
+// also published periodically, so that a peer that missed the snapshot
+// can recover. The current state was flattened in DepotCurrent, unless
+// there was an error. Return the size of the (possibly reformatted)
+// full state.
+//
+static int housesprinkler_state_publish (time_t now, int size,
+                                         const char *error) {
+
+    if (!error && DepotBaseVersion > 0 &&
+        now < DepotBaseVersion + STATE_FULL_PERIOD) {
+        long version = (now > DepotDeltaVersion) ? now : DepotDeltaVersion + 1;
+        int changes = housesprinkler_state_diff (version);
+        if (changes <= STATE_DELTA_MAX && changes * 4 <= DepotCurrent.count) {
+            DEBUG ("Publishing delta %ld (%d changes)\n", version, changes);
+            housedepositor_put ("state", STATE_DEPOT_DELTA,
+                                housesprinkler_buffer_text(&DepotDelta),
+                                housesprinkler_buffer_length(&DepotDelta));
+            DepotDeltaVersion = version;
+            return size;
+        }
+    }
+
+    DepotBaseVersion = (now > DepotBaseVersion) ? now : DepotBaseVersion + 1;
+    DepotDeltaVersion = DepotBaseVersion;
+    size = housesprinkler_state_format (sprinkler_host());
+
+    houselog_event ("SYSTEM", "STATE", "SAVE", "TO DEPOT %s", STATE_DEPOT_FULL);
+    housedepositor_put ("state", STATE_DEPOT_FULL,
+                        housesprinkler_buffer_text(&BackupOut), size);
+
+    if (!error) {
+        // The state was reformatted with the new version: keep the
+        // flattened form consistent, since it is also the snapshot.
+        housesprinkler_state_set (&DepotCurrent, DepotCurrent.count,
+                                  ".version", STATE_INTEGER, 0,
+                                  DepotBaseVersion);
+        qsort (DepotCurrent.records, DepotCurrent.count,
+               sizeof(SprinklerStateRecord), housesprinkler_state_compare);
+        housesprinkler_state_copy
+            (&DepotBase, DepotCurrent.records, DepotCurrent.count);
+    } else {
+        DepotBase.count = 0;
+        DepotBaseVersion = 0; // Force the next publication to be full.
+    }
+    return size;
 }
 
 void housesprinkler_state_periodic (time_t now) {
@@ -357,20 +999,32 @@ void housesprinkler_state_periodic (time_t now) {
     if (now == LastCall) return; // Run the logic once per second.
     LastCall = now;
 
+    if (!housesprinkler_timer_due (StateTimer, now)) return;
+
     if (StateDataHasChanged) {
         if (StateDataHasChanged < now - 10) {
+            // We tried 10 times, no point to try again.
             StateDataHasChanged = 0;
-            return; // We tried 10 times, no point to try again.
-        }
-        if (StateDataHasChanged < now) {
-            int size = housesprinkler_state_format();
-            if (ShareStateData) {
-                houselog_event ("SYSTEM", "STATE", "SAVE", "TO DEPOT sprinkler.json");
-                housedepositor_put ("state", "sprinkler.json", BackupOutBuffer, size);
+        } else if (StateDataHasChanged < now) {
+            // The JSON data is flattened once, for both the depot delta
+            // and the snapshot.
+            int size = housesprinkler_state_format (sprinkler_host());
+            const char *error = 0;
+            if (ShareStateData || SnapshotFile) {
+                const char *text = housesprinkler_buffer_text(&BackupOut);
+                error = housesprinkler_state_parse
+                            (echttp_parser_string(text), &DepotCurrent);
             }
-            if (housesprinkler_state_save (size) == size)
+            if (ShareStateData)
+                size = housesprinkler_state_publish (now, size, error);
+            if (housesprinkler_state_save
+                    (size, error ? 0 : &DepotCurrent) == size)
                 StateDataHasChanged = 0;
         }
     }
+    if (StateDataHasChanged)
+        housesprinkler_timer_set (StateTimer, now + 1); // Try again.
+    else
+        housesprinkler_timer_cancel (StateTimer);
 }
 
@@ -19,6 +19,8 @@
  *
  */
 
+#include "housesprinkler_buffer.h"
+
 void housesprinkler_state_load (int argc, const char **argv);
 
 void housesprinkler_state_share (int on);
@@ -26,7 +28,7 @@ void housesprinkler_state_share (int on);
 typedef void BackupListener (void);
 void housesprinkler_state_listen (BackupListener *listener);
 
-typedef int BackupWorker (char *buffer, int size);
+typedef void BackupWorker (SprinklerBuffer *buffer);
 void housesprinkler_state_register (BackupWorker *worker);
 
 long housesprinkler_state_get (const char *path);
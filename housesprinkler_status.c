@@ -0,0 +1,132 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_status.c - Track changes to the sprinkler status.
+ *
+ * SYNOPSYS:
+ *
+ * This module maintains a generation number for each section of the
+ * status (zone, program, schedule, control and index). Each module
+ * reports when its live state has changed, which assigns a new generation
+ * number to its section. This makes it possible to tell when the status
+ * has not changed, or which sections have changed, without formatting
+ * anything.
+ *
+ * The generation numbers start from the time the program started, so
+ * that they do not go back after a restart. Since they may still run
+ * ahead of the clock, a generation given to the clients comes with the
+ * start time, see housesprinkler_status_token().
+ *
+ * void housesprinkler_status_changed (int section);
+ *
+ *    Report that the live state of the specified section has changed.
+ *
+ * long housesprinkler_status_generation (int section);
+ *
+ *    Return the generation of the latest change to the specified section,
+ *    or of the latest change to any section if section is negative.
+ *
+ * const char *housesprinkler_status_etag (void);
+ *
+ *    Return an HTTP entity tag that represents the current status.
+ *    The returned string is a static location: every call erases the
+ *    previous result.
+ *
+ * const char *housesprinkler_status_token (long generation);
+ *
+ *    Return the text form of a generation given to the clients, which
+ *    includes the time the program started. The returned string is a
+ *    static location: every call erases the previous result.
+ *
+ * long housesprinkler_status_since (const char *token);
+ *
+ *    Return the generation from a token provided by a client, or -1 if
+ *    the token is invalid or comes from a previous run of the program.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "housesprinkler.h"
+#include "housesprinkler_status.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+static long StatusGeneration = 0;
+static long StatusSectionGeneration[SPRINKLER_STATUS_SECTIONS];
+static time_t StatusStarted = 0;
+
+static void housesprinkler_status_initialize (void) {
+    if (!StatusStarted) {
+        StatusStarted = time(0);
+        StatusGeneration = (long)StatusStarted;
+    }
+}
+
+void housesprinkler_status_changed (int section) {
+
+    if (section < 0 || section >= SPRINKLER_STATUS_SECTIONS) return;
+
+    housesprinkler_status_initialize ();
+    StatusSectionGeneration[section] = ++StatusGeneration;
+}
+
+long housesprinkler_status_generation (int section) {
+
+    housesprinkler_status_initialize ();
+
+    if (section < 0) return StatusGeneration;
+    if (section >= SPRINKLER_STATUS_SECTIONS) return 0;
+    return StatusSectionGeneration[section];
+}
+
+const char *housesprinkler_status_etag (void) {
+
+    static char ETag[64];
+
+    housesprinkler_status_initialize ();
+    snprintf (ETag, sizeof(ETag), "\"%lx-%lx\"",
+              (long)StatusStarted, StatusGeneration);
+    return ETag;
+}
+
+const char *housesprinkler_status_token (long generation) {
+
+    static char Token[64];
+
+    housesprinkler_status_initialize ();
+    snprintf (Token, sizeof(Token), "%ld.%ld", (long)StatusStarted, generation);
+    return Token;
+}
+
+long housesprinkler_status_since (const char *token) {
+
+    char *end;
+
+    if (!token) return -1;
+    housesprinkler_status_initialize ();
+
+    long started = strtol (token, &end, 10);
+    if (*end != '.' || started != (long)StatusStarted) return -1;
+    long generation = strtol (end + 1, &end, 10);
+    if (*end) return -1;
+    return generation;
+}
+
@@ -0,0 +1,39 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_status.h - Track changes to the sprinkler status.
+ */
+
+#define SPRINKLER_STATUS_ZONE      0
+#define SPRINKLER_STATUS_PROGRAM   1
+#define SPRINKLER_STATUS_SCHEDULE  2
+#define SPRINKLER_STATUS_CONTROL   3
+#define SPRINKLER_STATUS_INDEX     4
+#define SPRINKLER_STATUS_PARTITION 5
+#define SPRINKLER_STATUS_FLOW      6
+
+#define SPRINKLER_STATUS_SECTIONS  7
+
+void housesprinkler_status_changed (int section);
+long housesprinkler_status_generation (int section);
+const char *housesprinkler_status_etag (void);
+const char *housesprinkler_status_token (long generation);
+long housesprinkler_status_since (const char *token);
+
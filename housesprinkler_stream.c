@@ -0,0 +1,195 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_stream.c - Push the status changes to web clients.
+ *
+ * SYNOPSYS:
+ *
+ * This module sends server-sent events to the web clients that keep
+ * a stream open, so that these clients do not need to poll the status.
+ *
+ * The HTTP server completes each request before processing the next one,
+ * so a stream cannot be written directly to the client's socket. Instead
+ * each stream is a pipe: the read side is handed over to the HTTP server,
+ * which transfers whatever is written to the pipe as the response's
+ * content. This module only writes to the pipe. The write side is
+ * non-blocking: a client that does not keep up, or that is gone, is
+ * dropped, and the browser will open a new stream.
+ *
+ * int housesprinkler_stream_open (const char *id, const char *event,
+ *                                 const char *data);
+ *
+ *    Create a new stream and queue its first event. Return the file
+ *    descriptor to be transferred to the client, or -1 on failure.
+ *    The SPRINKLER_STREAM_SIZE value is the transfer size to use, since
+ *    a stream never ends on its own.
+ *
+ * int housesprinkler_stream_active (void);
+ *
+ *    Return the number of streams currently open.
+ *
+ * void housesprinkler_stream_send (const char *id, const char *event,
+ *                                  const char *data);
+ *
+ *    Send one event to every stream. The data must be a single line
+ *    of text, e.g. a JSON object.
+ *
+ * void housesprinkler_stream_periodic (time_t now);
+ *
+ *    Send a keepalive comment to all streams from time to time. This is
+ *    also how the streams of the clients that are gone are detected.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+
+#include "houselog.h"
+
+#include "housesprinkler.h"
+#include "housesprinkler_buffer.h"
+#include "housesprinkler_stream.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define STREAM_SLOTS      32
+#define STREAM_KEEPALIVE  15 // Seconds.
+#define STREAM_RETRY    5000 // Milliseconds before the browser reconnects.
+#define STREAM_PIPESIZE (256 * 1024)
+
+static int StreamFd[STREAM_SLOTS];
+static int StreamCount = 0;
+
+static time_t StreamLatestWrite = 0;
+
+static void housesprinkler_stream_drop (int i, const char *reason) {
+
+    DEBUG ("Dropping stream %d: %s\n", StreamFd[i], reason);
+    close (StreamFd[i]);
+    StreamFd[i] = StreamFd[--StreamCount];
+}
+
+// Write the whole text, or else drop the stream: a partial event would
+// corrupt the rest of the stream.
+//
+static int housesprinkler_stream_write (int i, const char *text, int length) {
+
+    int written = write (StreamFd[i], text, length);
+    if (written == length) return 1;
+
+    if (written >= 0 || errno == EAGAIN)
+        housesprinkler_stream_drop (i, "client too slow");
+    else
+        housesprinkler_stream_drop (i, strerror(errno));
+    return 0;
+}
+
+static void housesprinkler_stream_format (SprinklerBuffer *buffer,
+                                          const char *id,
+                                          const char *event, const char *data) {
+    housesprinkler_buffer_reset (buffer);
+    housesprinkler_buffer_printf (buffer, "id: %s\nevent: %s\ndata: %s\n\n",
+                                  id, event, data);
+}
+
+int housesprinkler_stream_open (const char *id, const char *event, const char *data) {
+
+    static SprinklerBuffer buffer;
+    int pipefd[2];
+
+    if (StreamCount >= STREAM_SLOTS) {
+        houselog_trace (HOUSE_FAILURE, "STREAM", "too many streams");
+        return -1;
+    }
+
+    // A client that is gone must not kill the program.
+    if (StreamCount == 0) signal (SIGPIPE, SIG_IGN);
+
+    if (pipe (pipefd) < 0) {
+        houselog_trace (HOUSE_FAILURE, "STREAM",
+                        "cannot create a pipe: %s", strerror(errno));
+        return -1;
+    }
+    fcntl (pipefd[1], F_SETFL, fcntl (pipefd[1], F_GETFL) | O_NONBLOCK);
+    fcntl (pipefd[1], F_SETFD, FD_CLOEXEC);
+#ifdef F_SETPIPE_SZ
+    fcntl (pipefd[1], F_SETPIPE_SZ, STREAM_PIPESIZE);
+#endif
+
+    int i = StreamCount++;
+    StreamFd[i] = pipefd[1];
+
+    housesprinkler_buffer_reset (&buffer);
+    housesprinkler_buffer_printf (&buffer, "retry: %d\n\n", STREAM_RETRY);
+    if (!housesprinkler_stream_write (i, housesprinkler_buffer_text (&buffer),
+                                      housesprinkler_buffer_length (&buffer))) {
+        close (pipefd[0]);
+        return -1;
+    }
+    housesprinkler_stream_format (&buffer, id, event, data);
+    if (!housesprinkler_stream_write (i, housesprinkler_buffer_text (&buffer),
+                                      housesprinkler_buffer_length (&buffer))) {
+        close (pipefd[0]);
+        return -1;
+    }
+    DEBUG ("New stream %d (%d active)\n", pipefd[1], StreamCount);
+    return pipefd[0];
+}
+
+int housesprinkler_stream_active (void) {
+    return StreamCount;
+}
+
+void housesprinkler_stream_send (const char *id, const char *event, const char *data) {
+
+    static SprinklerBuffer buffer;
+    int i;
+
+    if (StreamCount <= 0) return;
+
+    housesprinkler_stream_format (&buffer, id, event, data);
+    const char *text = housesprinkler_buffer_text (&buffer);
+    int length = housesprinkler_buffer_length (&buffer);
+
+    // Go backward, since dropping a stream moves the last one in its slot.
+    for (i = StreamCount - 1; i >= 0; --i) {
+        housesprinkler_stream_write (i, text, length);
+    }
+    StreamLatestWrite = time(0);
+}
+
+void housesprinkler_stream_periodic (time_t now) {
+
+    static const char keepalive[] = ":\n\n";
+    int i;
+
+    if (StreamCount <= 0) return;
+    if (now < StreamLatestWrite + STREAM_KEEPALIVE) return;
+
+    for (i = StreamCount - 1; i >= 0; --i) {
+        housesprinkler_stream_write (i, keepalive, sizeof(keepalive) - 1);
+    }
+    StreamLatestWrite = now;
+}
+
@@ -0,0 +1,134 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_timer.c - The deadlines of the background activities.
+ *
+ * SYNOPSYS:
+ *
+ * Each module that has some background activity registers the time when
+ * this activity is next needed. The main loop does not run any of these
+ * modules until one of their deadlines has been reached, and each module
+ * does nothing until its own deadline. A module that is waiting for an
+ * unpredictable event (e.g. the end of a program) can always set a deadline
+ * one second later.
+ *
+ * There are only a handful of timers: a simple table is enough.
+ *
+ * A timer follows either the real time (SPRINKLER_TIMER_REAL) or the time
+ * used for scheduling (SPRINKLER_TIMER_SCHEDULED), which is different when
+ * the -sim-speed or -sim-delta options are used.
+ *
+ * int housesprinkler_timer_declare (const char *name, int clock);
+ *
+ *    Return the identifier of the named timer, creating it if needed.
+ *    A new timer is due immediately. Return -1 if no more timer can be
+ *    created: an invalid timer is always due.
+ *
+ * void housesprinkler_timer_set (int timer, time_t deadline);
+ * void housesprinkler_timer_wakeup (int timer);
+ * void housesprinkler_timer_cancel (int timer);
+ *
+ *    Set the time when the timer is due: at the specified time, immediately
+ *    or never.
+ *
+ * time_t housesprinkler_timer_deadline (int timer);
+ *
+ *    Return the current deadline of the timer (0: immediately).
+ *
+ * int housesprinkler_timer_due (int timer, time_t now);
+ *
+ *    Return true if the timer's deadline has been reached.
+ *
+ * int housesprinkler_timer_pending (time_t now, time_t scheduling);
+ *
+ *    Return true if any timer is due, for the real time and the scheduling
+ *    time provided.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "housesprinkler.h"
+#include "housesprinkler_timer.h"
+
+#define DEBUG if (sprinkler_isdebug()) printf
+
+#define TIMER_SLOTS 16
+
+#define TIMER_NEVER ((time_t)-1)
+
+typedef struct {
+    const char *name;
+    int clock;
+    time_t deadline;
+} SprinklerTimer;
+
+static SprinklerTimer Timers[TIMER_SLOTS];
+static int TimersCount = 0;
+
+int housesprinkler_timer_declare (const char *name, int clock) {
+
+    int i;
+    for (i = 0; i < TimersCount; ++i) {
+        if (!strcmp (Timers[i].name, name)) return i;
+    }
+    if (TimersCount >= TIMER_SLOTS) return -1;
+
+    Timers[TimersCount].name = name;
+    Timers[TimersCount].clock = clock;
+    Timers[TimersCount].deadline = 0;
+    return TimersCount++;
+}
+
+void housesprinkler_timer_set (int timer, time_t deadline) {
+    if (timer < 0 || timer >= TimersCount) return;
+    Timers[timer].deadline = deadline;
+}
+
+void housesprinkler_timer_wakeup (int timer) {
+    housesprinkler_timer_set (timer, 0);
+}
+
+void housesprinkler_timer_cancel (int timer) {
+    housesprinkler_timer_set (timer, TIMER_NEVER);
+}
+
+time_t housesprinkler_timer_deadline (int timer) {
+    if (timer < 0 || timer >= TimersCount) return 0;
+    return Timers[timer].deadline;
+}
+
+int housesprinkler_timer_due (int timer, time_t now) {
+    if (timer < 0 || timer >= TimersCount) return 1;
+    if (Timers[timer].deadline == TIMER_NEVER) return 0;
+    return now >= Timers[timer].deadline;
+}
+
+int housesprinkler_timer_pending (time_t now, time_t scheduling) {
+
+    int i;
+    for (i = 0; i < TimersCount; ++i) {
+        time_t reference =
+            (Timers[i].clock == SPRINKLER_TIMER_SCHEDULED) ? scheduling : now;
+        if (housesprinkler_timer_due (i, reference)) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinkler_timer.h - The deadlines of the background activities.
+ */
+
+#define SPRINKLER_TIMER_REAL      0
+#define SPRINKLER_TIMER_SCHEDULED 1
+
+int    housesprinkler_timer_declare (const char *name, int clock);
+void   housesprinkler_timer_set (int timer, time_t deadline);
+void   housesprinkler_timer_wakeup (int timer);
+void   housesprinkler_timer_cancel (int timer);
+time_t housesprinkler_timer_deadline (int timer);
+int    housesprinkler_timer_due (int timer, time_t now);
+int    housesprinkler_timer_pending (time_t now, time_t scheduling);
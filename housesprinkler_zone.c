@@ -27,8 +27,10 @@
  * - Run periodic discoveries to find which server controls each zone.
  * - Run a queue of zone activation.
  *
- * The queue starts one zone at a time. If a pulse/pause duration was
- * defined, the zone is started only for the duration of the pulse. If
+ * The queue starts the zones that are ready, as many at a time as the
+ * concurrency and flow limits allow (see below). If a pulse/pause
+ * duration was defined, the zone is started only for the duration of
+ * the pulse. If
  * there is still some activation time left, the zone is scheduled for
  * re-activation pulse + pause seconds later.
  *
@@ -44,21 +46,54 @@
  * Another zone can be started while the previous zone is paused. The
  * queue mechanism selects the first entry with the lowest start time,
  * alternating through all the zones present in the queue, and no time
- * is wasted doing no watering.
+ * is wasted doing no watering. The manual activations and the program
+ * zones wait in separate queues.
+ *
+ * By default only one zone is active at a time. The configuration may
+ * allow more concurrent zones, globally ("concurrent") and for each feed
+ * ("concurrent" in the feed), as well as limit the total water flow
+ * ("flow", compared to the sum of the "flow" of every active zone). The
+ * queue then starts as many ready zones as these limits allow, skipping
+ * the zones that would exceed them. A zone whose own flow is larger than
+ * the total budget may still run when it is alone.
  *
  * A zone is removed from the queue once its last pulse has been completed.
  *
+ * If the control of an active zone failed to start, after all retries
+ * (see the control module), the pulse is returned to the queue, so that
+ * the zone is watered again once the other zones had their turn. This is
+ * done only a few times, in case the control server is gone for good.
+ *
+ * The zones that are part of a program start at the beginning of a minute.
+ * Because the control servers take some time to respond, the command is
+ * sent early by the typical response time of the zone's control (and its
+ * feed), so that the valve opens on the minute boundary. The difference
+ * between the expected opening of the valve and the minute boundary is
+ * accumulated over the watering session, as the drift.
+ *
  * void housesprinkler_zone_refresh (void);
  *
  *    This function must be called each time the configuration changes.
  *
- * void housesprinkler_zone_activate (const char *name,
- *                                    int pulse, const char *context);
+ * void housesprinkler_zone_resolve (void);
+ *
+ *    Resolve the references to the feeds and to the controls. This
+ *    function must be called after the controls have been pruned, i.e.
+ *    once the new configuration has been fully applied.
+ *
+ * int housesprinkler_zone_find (const char *name);
+ *
+ *    Return the ID of the specified zone, or -1 if not known. The ID
+ *    remains valid until the next refresh.
+ *
+ * void housesprinkler_zone_activate (int zone, int pulse,
+ *                                    const char *context, int index);
  *
  *    Activate one zone for the duration set by pulse. If the zone is already
  *    present in the watering queue, this pulse's amount is added to the
  *    remaining runtime. The context is typically the name of the schedule,
- *    or 0 for manual activation.
+ *    or 0 for manual activation. The index is the watering index that was
+ *    applied to the pulse (100 if none), as recorded in the history.
  *
  * void housesprinkler_zone_stop (void);
  *
@@ -66,13 +101,24 @@
  *
  * void housesprinkler_zone_periodic (time_t now);
  *
- *    The periodic function that runs the zones, one by one.
+ *    The periodic function that runs the zones.
  *
  * int  housesprinkler_zone_idle (void);
  *
  *    Return true if at least one zone is active, false otherwise.
  *
- * int housesprinkler_zone_status (char *buffer, int size);
+ * int housesprinkler_zone_active (int i, time_t *start, time_t *end);
+ *
+ *    Return the ID of the i-th active zone, and when its current pulse
+ *    started and ends, or -1 if fewer zones are active. This is used to
+ *    attribute the flow measurements.
+ *
+ * long housesprinkler_zone_drift (void);
+ *
+ *    Return the cumulative drift of the program zones started during the
+ *    current (or latest) watering session, in milliseconds.
+ *
+ * void housesprinkler_zone_status (SprinklerBuffer *buffer);
  *
  *    A function that populates a complete status in JSON.
  *
@@ -88,80 +134,326 @@
 #include "housediscover.h"
 
 #include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+#include "housesprinkler_buffer.h"
 #include "housesprinkler_time.h"
 #include "housesprinkler_zone.h"
 #include "housesprinkler_feed.h"
+#include "housesprinkler_status.h"
+#include "housesprinkler_timer.h"
+#include "housesprinkler_history.h"
 #include "housesprinkler_config.h"
 #include "housesprinkler_control.h"
+#include "housesprinkler_partition.h"
 
 #define DEBUG if (sprinkler_isdebug()) printf
 
 typedef struct {
     const char *name;
     const char *feed;
+    int feedid;         // -1 if no feed.
+    int control;
     int hydrate;
     int pulse;
     int pause;
+    int flow;
+    int feedlimit;      // Max active zones on the same feed, 0: no limit.
+    int partition;      // Only the partition's owner controls the zone.
+    time_t busy;        // Active until then, 0 if not active.
+    time_t pulsestart;
+    time_t pulseend;
     char manual;
     char status;
 } SprinklerZone;
 
 static SprinklerZone *Zones = 0;
 static int            ZonesCount = 0;
+static SprinklerHash  ZonesByName;
 
-static time_t ZonesBusy = 0; // Do not schedule while a zone is running.
-static time_t PulseEnd = 0;
-static SprinklerZone *ZoneActive = 0; // One zone active at a time.
+static int   *ZonesActive = 0; // The zones currently running.
+static int    ZonesActiveCount = 0;
+static int    ZonesConcurrent = 1;
+static int    ZonesFlow = 0;     // Total flow allowed, 0: no limit.
 
 typedef struct {
     int zone;
     int hydrate;
     int runtime;
+    int requested;  // The total runtime queued, to validate requeued pulses.
     time_t nexton;
+    int heap;   // Position in the waiting heap, -1 if not waiting.
+    int order;  // Activation order, to break ties.
+    int index;  // The watering index applied, for the history.
+    time_t planned; // Planned start of the next pulse, never before nexton.
+    int failures;   // Pulses returned after a control failure.
     char context[32];
 } SprinklerQueue;
 
 static SprinklerQueue *Queue = 0;
 static int             QueueNext = 0;
+static int            *QueueByZone = 0; // Zone index to queue entry, or -1.
+static int             QueueOrder = 0;
+static int            *QueueDeferred = 0; // Ready, but over the limits.
+
+// The queue entries that still have some runtime left wait in one of two
+// heaps, ordered by start time (and the longest elapsed time first).
+// Entries that are part of a program start only at the beginning of
+// a minute, while manual entries can start at any time: keeping them
+// in separate heaps lets each heap top be the next candidate of its kind.
+//
+typedef struct {
+    int *items;
+    int  count;
+} SprinklerQueueHeap;
+
+static SprinklerQueueHeap QueueManual;
+static SprinklerQueueHeap QueueProgram;
+
+static int    QueueTimer = -1;  // Nothing to schedule before its deadline.
+static time_t QueueExpiry = 0;  // No entry to prune before (0: none).
 
 static int ZoneIndexValvePause = 1; // An optional pause for indexing valves.
 
+// Never send a command more than this many seconds early.
+#define ZONE_LEAD_MAX 5
+
+// Give up on a zone whose control failed this many times.
+#define ZONE_REQUEUE_MAX 3
+
+// Wait this long before trying again a zone whose control has no route.
+#define ZONE_ROUTE_DELAY 60
+
+static long ZonesDrift = 0; // Milliseconds, current watering session.
+
+// The plan is a simulation of the queue, to predict when the watering ends.
+// In planner mode, the program zones start in the order of the plan.
+//
+#define ZONE_PLAN_STEPS 10000 // Limit the simulation, just in case.
+
+typedef struct {
+    int runtime;
+    int hydrate;
+    time_t nexton;
+} SprinklerPlan;
+
+static SprinklerPlan *Plan = 0;        // One per queue entry.
+static int           *PlanActive = 0;  // The zones active in the simulation.
+static time_t        *PlanBusy = 0;
+static int            ZonesPlanner = 0;   // Order the program by the plan.
+static time_t         ZonesPredicted = 0; // End of the watering, 0: none.
+static long           ZonesPlanned = 0;   // Status generation of the plan.
+
+int housesprinkler_zone_find (const char *name) {
+    if (!name) return -1;
+    return housesprinkler_hash_find (&ZonesByName, name);
+}
+
+// Return how long it takes to water the zone for runtime seconds,
+// including the soak pauses between the pulses.
+//
+static int housesprinkler_zone_cycle (int zone, int runtime) {
+    if (Zones[zone].pulse <= 0) return runtime; // No soak.
+    int soaks = runtime / Zones[zone].pulse;
+    if (runtime % Zones[zone].pulse == 0) soaks -= 1;
+    return runtime + (Zones[zone].pause * soaks);
+}
+
+static int housesprinkler_zone_elapsed (int queued) {
+    return housesprinkler_zone_cycle (Queue[queued].zone, Queue[queued].runtime);
+}
+
+static SprinklerQueueHeap *housesprinkler_zone_heap (int queued) {
+    return Queue[queued].context[0] ? &QueueProgram : &QueueManual;
+}
+
+// Return true if queue entry a should start before queue entry b.
+// In planner mode, the program entries follow the plan instead.
+//
+static int housesprinkler_zone_before (int a, int b) {
+    if (ZonesPlanner && Queue[a].context[0] && Queue[b].context[0] &&
+        Queue[a].planned != Queue[b].planned)
+        return Queue[a].planned < Queue[b].planned;
+    if (Queue[a].nexton != Queue[b].nexton)
+        return Queue[a].nexton < Queue[b].nexton;
+    int elapsed_a = housesprinkler_zone_elapsed (a);
+    int elapsed_b = housesprinkler_zone_elapsed (b);
+    if (elapsed_a != elapsed_b) return elapsed_a > elapsed_b;
+    return Queue[a].order < Queue[b].order;
+}
+
+static void housesprinkler_zone_heap_set (SprinklerQueueHeap *heap,
+                                          int position, int queued) {
+    heap->items[position] = queued;
+    Queue[queued].heap = position;
+}
+
+static void housesprinkler_zone_heap_up (SprinklerQueueHeap *heap,
+                                         int position) {
+    int queued = heap->items[position];
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (!housesprinkler_zone_before (queued, heap->items[parent])) break;
+        housesprinkler_zone_heap_set (heap, position, heap->items[parent]);
+        position = parent;
+    }
+    housesprinkler_zone_heap_set (heap, position, queued);
+}
+
+static void housesprinkler_zone_heap_down (SprinklerQueueHeap *heap,
+                                           int position) {
+    int queued = heap->items[position];
+    for (;;) {
+        int child = 2 * position + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count &&
+            housesprinkler_zone_before (heap->items[child+1],
+                                        heap->items[child])) child += 1;
+        if (!housesprinkler_zone_before (heap->items[child], queued)) break;
+        housesprinkler_zone_heap_set (heap, position, heap->items[child]);
+        position = child;
+    }
+    housesprinkler_zone_heap_set (heap, position, queued);
+}
+
+// Insert the queue entry in its heap, or move it to its new place
+// if its start time or runtime changed.
+//
+static void housesprinkler_zone_wait (int queued) {
+
+    SprinklerQueueHeap *heap = housesprinkler_zone_heap (queued);
+    int position = Queue[queued].heap;
+
+    if (Queue[queued].planned < Queue[queued].nexton)
+        Queue[queued].planned = Queue[queued].nexton; // Until the next plan.
+
+    if (position < 0) {
+        position = heap->count++;
+        housesprinkler_zone_heap_set (heap, position, queued);
+    }
+    housesprinkler_zone_heap_up (heap, position);
+    housesprinkler_zone_heap_down (heap, Queue[queued].heap);
+    housesprinkler_timer_wakeup (QueueTimer);
+}
+
+static int housesprinkler_zone_pop (SprinklerQueueHeap *heap) {
+
+    int queued = heap->items[0];
+    Queue[queued].heap = -1;
+    heap->count -= 1;
+    if (heap->count > 0) {
+        housesprinkler_zone_heap_set (heap, 0, heap->items[heap->count]);
+        housesprinkler_zone_heap_down (heap, 0);
+    }
+    return queued;
+}
+
+// Record when a queue entry with no runtime left will have to be pruned.
+//
+static void housesprinkler_zone_expire (int queued) {
+    time_t expiry = Queue[queued].nexton + 1;
+    if (!QueueExpiry || expiry < QueueExpiry) QueueExpiry = expiry;
+}
+
+// Rebuild the zone map and the heaps from the queue entries.
+//
+static void housesprinkler_zone_reindex (void) {
+
+    int i;
+
+    QueueManual.count = QueueProgram.count = 0;
+    QueueExpiry = 0;
+    housesprinkler_timer_wakeup (QueueTimer);
+    for (i = 0; i < ZonesCount; ++i) QueueByZone[i] = -1;
+    for (i = 0; i < QueueNext; ++i) {
+        QueueByZone[Queue[i].zone] = i;
+        Queue[i].heap = -1;
+        if (Queue[i].runtime > 0)
+            housesprinkler_zone_wait (i);
+        else
+            housesprinkler_zone_expire (i);
+    }
+}
+
+// The tables are allocated with the configuration, and are released
+// with it: there is nothing to free here.
+//
+static void housesprinkler_zone_clear (void) {
+    Queue = 0;
+    QueueNext = 0;
+    QueueByZone = 0;
+    QueueDeferred = 0;
+    QueueManual.items = QueueProgram.items = 0;
+    Plan = 0;
+    PlanActive = 0;
+    PlanBusy = 0;
+    ZonesPredicted = 0;
+    ZonesPlanned = 0;
+    QueueManual.count = QueueProgram.count = 0;
+}
+
+static void housesprinkler_zone_retire (int active) {
+    SprinklerZone *zone = Zones + ZonesActive[active];
+    if (zone->status == 'a') zone->status = 'i';
+    zone->busy = 0;
+    zone->pulsestart = 0;
+    zone->pulseend = 0;
+    ZonesActive[active] = ZonesActive[--ZonesActiveCount];
+}
+
 void housesprinkler_zone_refresh (void) {
 
     int i;
-    int count;
-    int content;
-    char path[128];
-    int list[256];
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
+
+    QueueTimer = housesprinkler_timer_declare ("zone", SPRINKLER_TIMER_SCHEDULED);
+    housesprinkler_timer_wakeup (QueueTimer);
+
+    // Keep the old zones and queue on the side, to recover the live state
+    // of the zones that are still present in the new configuration.
+    //
+    SprinklerZone  *oldzones = Zones;
+    int             oldzonescount = ZonesCount;
+    SprinklerQueue *oldqueue = Queue;
+    int             oldqueuenext = QueueNext;
+    int            *oldactive = ZonesActive;
+    int             oldactivecount = ZonesActiveCount;
+
+    Queue = 0; // Kept as oldqueue until the new queue is built.
+    housesprinkler_zone_clear ();
+
+    ZonesConcurrent = (config->concurrent > 0) ? config->concurrent : 1;
+    ZonesFlow = (config->flow > 0) ? config->flow : 0;
+    ZonesPlanner =
+        config->planner && (!strcmp (config->planner, "optimized"));
 
     // Reload all zones.
     //
-    if (Zones) free (Zones);
     Zones = 0;
-    ZoneActive = 0;
-    ZonesBusy = 0;
-    PulseEnd = 0;
-    ZonesCount = 0;
-    content = housesprinkler_config_array (0, ".zones");
-    if (content > 0) {
-        ZonesCount = housesprinkler_config_array_length (content);
-        if (ZonesCount > 0) {
-            Zones = calloc (ZonesCount, sizeof(SprinklerZone));
-            DEBUG ("Loading %d zones\n", ZonesCount);
-        }
+    ZonesActive = 0;
+    ZonesActiveCount = 0;
+    ZonesCount = config->zonescount;
+    if (ZonesCount > 0) {
+        Zones = housesprinkler_config_allocate (ZonesCount, sizeof(SprinklerZone));
+        DEBUG ("Loading %d zones\n", ZonesCount);
     }
+    housesprinkler_hash_reset (&ZonesByName, ZonesCount);
 
     for (i = 0; i < ZonesCount; ++i) {
-        snprintf (path, sizeof(path), "[%d]", i);
-        int zone = housesprinkler_config_object (content, path);
-        if (zone > 0) {
-            Zones[i].name = housesprinkler_config_string (zone, ".name");
-            Zones[i].feed = housesprinkler_config_string (zone, ".feed");
-            Zones[i].hydrate = housesprinkler_config_integer (zone, ".hydrate");
-            Zones[i].pulse = housesprinkler_config_integer (zone, ".pulse");
-            Zones[i].pause = housesprinkler_config_integer (zone, ".pause");
-            Zones[i].manual = housesprinkler_config_boolean (zone, ".manual");
+        const SprinklerConfigZone *zone = config->zones + i;
+        if (zone->name) {
+            Zones[i].name = zone->name;
+            Zones[i].feed = zone->feed;
+            Zones[i].feedid = -1;
+            Zones[i].feedlimit = 0;
+            Zones[i].control = -1;
+            Zones[i].hydrate = zone->hydrate;
+            Zones[i].pulse = zone->pulse;
+            Zones[i].pause = zone->pause;
+            Zones[i].flow = zone->flow;
+            Zones[i].manual = zone->manual;
+            Zones[i].partition = housesprinkler_partition_find (zone->partition);
             Zones[i].status = 'i';
+            housesprinkler_hash_add (&ZonesByName, Zones[i].name, i);
             housesprinkler_control_declare (Zones[i].name, "ZONE");
             DEBUG ("\tZone %s (hydrate=%d, pulse=%d, pause=%d, manual=%s)\n",
                    Zones[i].name, Zones[i].hydrate, Zones[i].pulse, Zones[i].pause,
@@ -173,58 +465,141 @@ void housesprinkler_zone_refresh (void) {
     // (If the same zone is activated more than once, the runtimes simply
     // accumulate.)
     //
-    if (Queue) free (Queue);
-    Queue = 0;
-    QueueNext = 0;
-    if (ZonesCount)
-         Queue = calloc (ZonesCount, sizeof(SprinklerQueue));
+    if (ZonesCount) {
+        Queue = housesprinkler_config_allocate (ZonesCount, sizeof(SprinklerQueue));
+        QueueByZone = housesprinkler_config_allocate (ZonesCount, sizeof(int));
+        QueueDeferred = housesprinkler_config_allocate (ZonesCount, sizeof(int));
+        QueueManual.items = housesprinkler_config_allocate (ZonesCount, sizeof(int));
+        QueueProgram.items = housesprinkler_config_allocate (ZonesCount, sizeof(int));
+        ZonesActive = housesprinkler_config_allocate (ZonesCount, sizeof(int));
+        Plan = housesprinkler_config_allocate (ZonesCount, sizeof(SprinklerPlan));
+        PlanActive = housesprinkler_config_allocate (ZonesCount, sizeof(int));
+        PlanBusy = housesprinkler_config_allocate (ZonesCount, sizeof(time_t));
+        if (!Queue || !QueueByZone || !QueueDeferred ||
+            !QueueManual.items || !QueueProgram.items || !ZonesActive ||
+            !Plan || !PlanActive || !PlanBusy) {
+            houselog_trace (HOUSE_FAILURE, "ZONE", "no more memory");
+            housesprinkler_zone_clear ();
+        }
+    }
+
+    if (oldzones) {
+        // This is a configuration change, not a program start: the zones
+        // that still exist keep their state, queue entry and activation.
+        //
+        for (i = 0; i < oldzonescount; ++i) {
+            int zone = housesprinkler_zone_find (oldzones[i].name);
+            if (zone >= 0) Zones[zone].status = oldzones[i].status;
+        }
+        for (i = 0; i < oldqueuenext; ++i) {
+            const char *name = oldzones[oldqueue[i].zone].name;
+            int zone = housesprinkler_zone_find (name);
+            if (zone < 0 || !Queue || QueueNext >= ZonesCount) {
+                DEBUG ("Drop queue entry for removed zone %s\n", name);
+                continue;
+            }
+            Queue[QueueNext] = oldqueue[i];
+            Queue[QueueNext].zone = zone;
+            QueueNext += 1;
+        }
+        for (i = 0; i < oldactivecount; ++i) {
+            SprinklerZone *old = oldzones + oldactive[i];
+            int zone = housesprinkler_zone_find (old->name);
+            if (zone >= 0 && ZonesActive) {
+                Zones[zone].busy = old->busy;
+                Zones[zone].pulsestart = old->pulsestart;
+                Zones[zone].pulseend = old->pulseend;
+                ZonesActive[ZonesActiveCount++] = zone;
+            } else {
+                // The active zone was removed: do not let it run.
+                housesprinkler_control_cancel
+                    (housesprinkler_control_find (old->name));
+            }
+        }
+    }
+    if (Queue) housesprinkler_zone_reindex ();
+
+    housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
 }
 
-static int housesprinkler_zone_search (const char *name) {
+void housesprinkler_zone_resolve (void) {
+
     int i;
+    ZonesPlanned = 0; // The feed limits may have changed.
     for (i = 0; i < ZonesCount; ++i) {
-        if (!strcmp (name, Zones[i].name)) return i;
+        if (!Zones[i].name) continue;
+        Zones[i].control = housesprinkler_control_find (Zones[i].name);
+        if (Zones[i].feed && Zones[i].feed[0]) {
+            Zones[i].feedid = housesprinkler_feed_find (Zones[i].feed);
+            Zones[i].feedlimit = housesprinkler_feed_concurrent (Zones[i].feedid);
+            if (Zones[i].feedid < 0)
+                houselog_event ("ZONE", Zones[i].name,
+                                "INVALID", "UNKNOWN FEED %s", Zones[i].feed);
+        }
     }
-    return -1;
 }
 
-void housesprinkler_zone_activate (const char *name,
-                                   int pulse, const char *context) {
+void housesprinkler_zone_activate (int zone, int pulse,
+                                   const char *context, int index) {
 
-    int zone = housesprinkler_zone_search (name);
-    if (zone >= 0) {
-        int i;
+    if (zone >= 0 && zone < ZonesCount && Queue) {
+        const char *name = Zones[zone].name;
         time_t now = sprinkler_schedulingtime(time(0));
         if (Zones[zone].manual && context) {
             houselog_event ("ZONE", Zones[zone].name, "IGNORE", "MANUAL MODE ONLY");
             return;
         }
+        if (!housesprinkler_partition_local (Zones[zone].partition)) {
+            // A program runs on every instance, but each instance only
+            // waters its own zones.
+            DEBUG ("Zone %s is controlled by another instance\n", name);
+            if (!context)
+                houselog_event ("ZONE", name, "IGNORE", "CONTROLLED BY ANOTHER INSTANCE");
+            return;
+        }
         houselog_trace (HOUSE_INFO, name,
                         "queued (%s) for a %d seconds pulse",
                         context?"scheduled":"manually", pulse);
-        for (i = 0; i < QueueNext; ++i) {
-            if (Queue[i].zone == zone) {
-                // This zone was already queued. Add this pulse
-                // to the total remaining runtime.
-                Queue[i].runtime += pulse;
-                if (Queue[i].nexton == 0) Queue[i].nexton = now;
-                return;
-            }
+        if (housesprinkler_zone_idle()) ZonesDrift = 0; // A new session.
+
+        int queued = QueueByZone[zone];
+        if (queued >= 0) {
+            // This zone was already queued. Add this pulse
+            // to the total remaining runtime.
+            Queue[queued].runtime += pulse;
+            Queue[queued].requested += pulse;
+            Queue[queued].index = index;
+            if (Queue[queued].nexton == 0) Queue[queued].nexton = now;
+            if (Queue[queued].runtime > 0) housesprinkler_zone_wait (queued);
+            housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
+            return;
         }
         if (QueueNext < ZonesCount) {
             // This zone was not queued yet: create a new entry.
-            Queue[QueueNext].zone = zone;
-            Queue[QueueNext].hydrate = Zones[zone].hydrate;
-            Queue[QueueNext].runtime = pulse;
+            queued = QueueNext++;
+            Queue[queued].zone = zone;
+            Queue[queued].hydrate = Zones[zone].hydrate;
+            Queue[queued].runtime = pulse;
+            Queue[queued].requested = pulse;
+            Queue[queued].index = index;
             if (context)
-                snprintf (Queue[QueueNext].context, sizeof(Queue[0].context),
+                snprintf (Queue[queued].context, sizeof(Queue[0].context),
                           "%s", context);
             else
-                Queue[QueueNext].context[0] = 0;
-            Queue[QueueNext].nexton = now;
+                Queue[queued].context[0] = 0;
+            Queue[queued].nexton = now;
+            Queue[queued].planned = now;
+            Queue[queued].failures = 0;
+            Queue[queued].heap = -1;
+            Queue[queued].order = ++QueueOrder;
+            QueueByZone[zone] = queued;
+            if (pulse > 0)
+                housesprinkler_zone_wait (queued);
+            else
+                housesprinkler_zone_expire (queued);
             DEBUG ("Activated zone %s for %d seconds (%s, queue entry %d)\n",
-                   name, pulse, context?context:"manual", QueueNext);
-            QueueNext += 1;
+                   name, pulse, context?context:"manual", queued);
+            housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
         }
     }
 }
@@ -240,94 +615,418 @@ void housesprinkler_zone_stop (void) {
         Queue[i].hydrate = 0;
         Queue[i].runtime = 0;
         Queue[i].nexton = 0;
+        Queue[i].heap = -1;
+        QueueByZone[Queue[i].zone] = -1;
     }
     QueueNext = 0;
-    ZonesBusy = 0;
-    PulseEnd = 0;
+    QueueManual.count = QueueProgram.count = 0;
+    QueueExpiry = 0;
+    housesprinkler_timer_wakeup (QueueTimer);
+    for (i = 0; i < ZonesActiveCount; ++i) {
+        Zones[ZonesActive[i]].busy = 0; // Cancel on the next schedule.
+    }
+    housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
 }
 
-static int housesprinkler_zone_elapsed (int queued) {
-    int zone = Queue[queued].zone;
-    int soaks = Queue[queued].runtime / Zones[zone].pulse;
-    if (Queue[queued].runtime % Zones[zone].pulse == 0) soaks -= 1;
-    return Queue[queued].runtime + (Zones[zone].pause * soaks);
+// Remove the entries that have no time left, once the zone has completed
+// its pulse (including the pause period). These entries are not waiting
+// in any heap, which makes it possible to move the last entry in their
+// place.
+//
+static void housesprinkler_zone_prune (time_t now) {
+
+    int i;
+
+    if (!QueueExpiry || now < QueueExpiry) return;
+
+    QueueExpiry = 0;
+    for (i = QueueNext - 1; i >= 0; --i) {
+        if (Queue[i].runtime > 0) continue;
+        if (Queue[i].nexton >= now) {
+            housesprinkler_zone_expire (i);
+            continue;
+        }
+        DEBUG ("%ld: Prune queue entry %d\n", now, i);
+        QueueByZone[Queue[i].zone] = -1;
+        QueueNext -= 1;
+        if (i < QueueNext) {
+            Queue[i] = Queue[QueueNext];
+            QueueByZone[Queue[i].zone] = i;
+            if (Queue[i].heap >= 0) {
+                housesprinkler_zone_heap (i)->items[Queue[i].heap] = i;
+            }
+        }
+        Queue[QueueNext].nexton = 0;
+    }
 }
 
-static void housesprinkler_zone_schedule (time_t now) {
+// Return the typical response time of the zone's controls, including
+// its feed, in milliseconds.
+//
+static int housesprinkler_zone_latency (int zone) {
+
+    int latency = housesprinkler_control_latency (Zones[zone].control);
+    if (Zones[zone].feedid >= 0) {
+        int feed = housesprinkler_feed_latency (Zones[zone].feedid);
+        if (feed > latency) latency = feed;
+    }
+    return latency;
+}
+
+// Return how many seconds early the zone's command should be sent.
+//
+static int housesprinkler_zone_lead (int zone) {
+    int lead = (housesprinkler_zone_latency (zone) + 500) / 1000;
+    return (lead > ZONE_LEAD_MAX) ? ZONE_LEAD_MAX : lead;
+}
+
+// Return the earliest time an entry at the top of the heap could start.
+// The entries that start on the minute are sent early (see above).
+//
+static time_t housesprinkler_zone_ready (const SprinklerQueueHeap *heap,
+                                         int minute, time_t now) {
+
+    if (heap->count <= 0) return 0;
+
+    int lead = minute ? housesprinkler_zone_lead (Queue[heap->items[0]].zone) : 0;
+    time_t ready = Queue[heap->items[0]].nexton - 1;
+    if (ready <= now + lead) ready = now + lead + 1;
+    if (minute && (ready % 60 > 1)) ready += 60 - (ready % 60);
+    return ready - lead;
+}
+
+// Calculate the next time something may need to be scheduled, so that
+// the periodic function does not need to look at the queue until then.
+//
+static void housesprinkler_zone_sleep (time_t now) {
 
     int i;
+    time_t wakeup = 0;
 
-    // Prune the queue once there is no time left and the zone has completed
-    // its pulse (including the pause period).
-    //
-    while (QueueNext > 0 &&
-           Queue[QueueNext-1].runtime == 0 &&
-           Queue[QueueNext-1].nexton < now) {
+    // An active zone frees its slot when it is no longer busy.
+    for (i = 0; i < ZonesActiveCount; ++i) {
+        time_t busy = Zones[ZonesActive[i]].busy;
+        if (!wakeup || busy < wakeup) wakeup = busy;
+    }
+    if (ZonesActiveCount < ZonesConcurrent) {
+        time_t manual = housesprinkler_zone_ready (&QueueManual, 0, now);
+        time_t program = housesprinkler_zone_ready (&QueueProgram, 1, now);
+        if (manual && (!wakeup || manual < wakeup)) wakeup = manual;
+        if (program && (!wakeup || program < wakeup)) wakeup = program;
+    }
+    if (!wakeup) wakeup = now + 60;
+    if (QueueExpiry && QueueExpiry < wakeup) wakeup = QueueExpiry;
+    if (wakeup > now + 60) wakeup = now + 60; // Robust to clock changes.
+    housesprinkler_timer_set (QueueTimer, wakeup);
+}
 
-        Queue[QueueNext-1].nexton = 0;
-        QueueNext -= 1;
-        DEBUG ("%ld: Prune queue entry %d\n", now, QueueNext);
+// Return true if the zone can be started alongside the active zones
+// without exceeding the limits set on the feed and the total water flow.
+//
+static int housesprinkler_zone_fits_with (int zone,
+                                          const int *actives, int count) {
+
+    int i;
+    int onfeed = 0;
+    int flow = Zones[zone].flow;
+
+    for (i = 0; i < count; ++i) {
+        const SprinklerZone *active = Zones + actives[i];
+        if (actives[i] == zone) return 0; // Still running its previous pulse.
+        flow += active->flow;
+        if (Zones[zone].feedid >= 0 &&
+            Zones[zone].feedid == active->feedid) onfeed += 1;
+    }
+    if (Zones[zone].feedlimit > 0 && onfeed >= Zones[zone].feedlimit)
+        return 0;
+    if (ZonesFlow > 0 && count > 0 && flow > ZonesFlow)
+        return 0;
+    return 1;
+}
+
+static int housesprinkler_zone_fits (int zone) {
+    if (Zones[zone].busy) return 0; // Still running its previous pulse.
+    return housesprinkler_zone_fits_with (zone, ZonesActive, ZonesActiveCount);
+}
+
+// Return the heap which top entry should be started next, if any.
+//
+static SprinklerQueueHeap *housesprinkler_zone_next (time_t now) {
+
+    SprinklerQueueHeap *heap = 0;
+    if (QueueManual.count > 0 &&
+        Queue[QueueManual.items[0]].nexton <= now + 1) {
+        heap = &QueueManual;
+    }
+    if (QueueProgram.count > 0) {
+        int top = QueueProgram.items[0];
+        time_t start = now + housesprinkler_zone_lead (Queue[top].zone);
+        if ((start % 60 > 1) || (Queue[top].nexton > start + 1))
+            return heap;
+        if (!heap ||
+            ((!ZonesPlanner) &&
+             housesprinkler_zone_before (QueueProgram.items[0],
+                                         QueueManual.items[0])))
+            heap = &QueueProgram;
+    }
+    return heap;
+}
+
+// Return the earliest time, not before t, when the queue entry could
+// start its next pulse in the plan.
+//
+static time_t housesprinkler_zone_plan_ready (int queued, time_t t) {
+    time_t ready = Plan[queued].nexton - 1;
+    if (ready < t) ready = t;
+    if (Queue[queued].context[0] && (ready % 60 > 1))
+        ready += 60 - (ready % 60);
+    return ready;
+}
+
+// The rules available to order the zones in the plan. The queue rule
+// is the scheduler's own. The critical path rule starts the entries
+// with the longest remaining cycle first: these define when the program
+// ends, and starting them early fills the soak pauses of the other zones.
+//
+#define ZONE_PLAN_QUEUE    0
+#define ZONE_PLAN_CRITICAL 1
+
+// Return true if queue entry a should start before queue entry b in
+// the plan. In planner mode, the manual entries come first, since
+// someone is waiting for them.
+//
+static int housesprinkler_zone_plan_before (int a, int b, int rule) {
+
+    int elapsed_a = housesprinkler_zone_cycle (Queue[a].zone, Plan[a].runtime);
+    int elapsed_b = housesprinkler_zone_cycle (Queue[b].zone, Plan[b].runtime);
+
+    if (ZonesPlanner) {
+        int manual_a = (Queue[a].context[0] == 0);
+        int manual_b = (Queue[b].context[0] == 0);
+        if (manual_a != manual_b) return manual_a;
+    }
+    if (rule == ZONE_PLAN_CRITICAL && elapsed_a != elapsed_b)
+        return elapsed_a > elapsed_b;
+    if (Plan[a].nexton != Plan[b].nexton)
+        return Plan[a].nexton < Plan[b].nexton;
+    if (elapsed_a != elapsed_b) return elapsed_a > elapsed_b;
+    return Queue[a].order < Queue[b].order;
+}
+
+// Simulate the rest of the watering using the same pulse, soak and
+// concurrency rules as the scheduler (this is list scheduling: a zone
+// starts as soon as it is ready and fits), ordering the zones using
+// the specified rule. Record when each queue entry would start its next
+// pulse, and return when the watering would end (0: nothing to water).
+//
+static time_t housesprinkler_zone_plan_run (time_t now, int rule) {
+
+    int i;
+    int waiting = 0;
+    int count = 0;
+    time_t end = 0;
+
+    for (i = 0; i < ZonesActiveCount; ++i) {
+        int zone = ZonesActive[i];
+        if (!Zones[zone].busy) continue;
+        PlanActive[count] = zone;
+        PlanBusy[count++] = Zones[zone].busy;
+        if (Zones[zone].pulseend > end) end = Zones[zone].pulseend;
+    }
+    for (i = 0; i < QueueNext; ++i) {
+        Plan[i].runtime = Queue[i].runtime;
+        Plan[i].hydrate = Queue[i].hydrate;
+        Plan[i].nexton = Queue[i].nexton;
+        Queue[i].planned = 0;
+        if (Queue[i].runtime > 0) waiting += 1;
     }
 
-    if (now <= ZonesBusy) return;
+    time_t t = now;
+    int steps;
+    for (steps = 0; waiting > 0 && steps < ZONE_PLAN_STEPS; ++steps) {
+
+        for (i = count - 1; i >= 0; --i) {
+            if (PlanBusy[i] > t) continue;
+            count -= 1;
+            PlanActive[i] = PlanActive[count];
+            PlanBusy[i] = PlanBusy[count];
+        }
+
+        while (count < ZonesConcurrent) {
+            int best = -1;
+            for (i = 0; i < QueueNext; ++i) {
+                if (Plan[i].runtime <= 0) continue;
+                if (housesprinkler_zone_plan_ready (i, t) > t) continue;
+                if (!housesprinkler_zone_fits_with
+                         (Queue[i].zone, PlanActive, count)) continue;
+                if (best < 0 || housesprinkler_zone_plan_before (i, best, rule))
+                    best = i;
+            }
+            if (best < 0) break;
+
+            int zone = Queue[best].zone;
+            int pulse = Plan[best].runtime;
+            time_t nexton = t + pulse;
+            if (Queue[best].context[0]) {
+                if (Plan[best].hydrate > 0)
+                    pulse = Plan[best].hydrate;
+                else if (Zones[zone].pulse > 0)
+                    pulse = Zones[zone].pulse;
+                if (pulse > Plan[best].runtime) pulse = Plan[best].runtime;
+                nexton = t + pulse + Zones[zone].pause;
+            }
+            Plan[best].hydrate = 0;
+            Plan[best].runtime -= pulse;
+            Plan[best].nexton = nexton;
+            if (Plan[best].runtime <= 0) waiting -= 1;
+            if (!Queue[best].planned) Queue[best].planned = t;
+
+            PlanActive[count] = zone;
+            PlanBusy[count++] = t + pulse + ZoneIndexValvePause;
+            if (t + pulse > end) end = t + pulse;
+        }
+
+        // Move to the next time when a zone could start.
+        time_t next = 0;
+        for (i = 0; i < count; ++i) {
+            if (!next || PlanBusy[i] < next) next = PlanBusy[i];
+        }
+        if (count < ZonesConcurrent) {
+            for (i = 0; i < QueueNext; ++i) {
+                if (Plan[i].runtime <= 0) continue;
+                time_t ready = housesprinkler_zone_plan_ready (i, t);
+                if (ready > t && (!next || ready < next)) next = ready;
+            }
+        }
+        if (!next) break; // Nothing will ever start.
+        t = next;
+    }
+    if (waiting > 0) {
+        DEBUG ("Incomplete plan after %d steps\n", steps);
+    }
+    return end;
+}
+
+// Predict when the watering ends and, in planner mode, reorder the
+// program heap to follow the plan that ends the earliest. The plan is
+// recalculated only when the zone status changed, i.e. the queue or the
+// active zones changed, e.g. when a zone is started manually. Without
+// the planner, this only maintains the prediction reported in the status.
+//
+static void housesprinkler_zone_plan (time_t now) {
+
+    int i;
+
+    if (!Plan) return;
+
+    long generation = housesprinkler_status_generation (SPRINKLER_STATUS_ZONE);
+    if (generation == ZonesPlanned) return; // Still valid.
+    ZonesPlanned = generation;
+
+    ZonesPredicted = housesprinkler_zone_plan_run (now, ZONE_PLAN_QUEUE);
+    if (ZonesPlanner) {
+        time_t critical = housesprinkler_zone_plan_run (now, ZONE_PLAN_CRITICAL);
+        if (critical > ZonesPredicted)
+            housesprinkler_zone_plan_run (now, ZONE_PLAN_QUEUE);
+        else
+            ZonesPredicted = critical;
+    }
+
+    for (i = 0; i < QueueNext; ++i) {
+        if (Queue[i].planned < Queue[i].nexton)
+            Queue[i].planned = Queue[i].nexton;
+    }
+    if (ZonesPlanner) {
+        for (i = QueueProgram.count / 2 - 1; i >= 0; --i)
+            housesprinkler_zone_heap_down (&QueueProgram, i);
+    }
+}
+
+// A zone which control cannot be started is not watered now: nothing
+// is taken from its runtime. It tries again later, in case the route
+// is discovered by then, but not forever.
+//
+static void housesprinkler_zone_unreachable (int queued, time_t now) {
+
+    SprinklerZone *zone = Zones + Queue[queued].zone;
+
+    if (++Queue[queued].failures > ZONE_REQUEUE_MAX) {
+        houselog_event ("ZONE", zone->name, "ABANDON",
+                        "AFTER %d CONTROL FAILURES", Queue[queued].failures);
+        Queue[queued].hydrate = 0;
+        Queue[queued].runtime = 0;
+        housesprinkler_zone_expire (queued);
+    } else {
+        houselog_trace (HOUSE_WARNING, zone->name,
+                        "no route, retry in %d seconds", ZONE_ROUTE_DELAY);
+        Queue[queued].nexton = now + ZONE_ROUTE_DELAY;
+        housesprinkler_zone_wait (queued);
+    }
+    housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
+}
+
+static void housesprinkler_zone_schedule (time_t now) {
 
-    if (ZoneActive) {
-        if (ZonesBusy == 0) {
+    int i;
+    int deferred = 0;
+
+    housesprinkler_zone_prune (now);
+
+    for (i = ZonesActiveCount - 1; i >= 0; --i) {
+        SprinklerZone *zone = Zones + ZonesActive[i];
+        if (zone->busy && now < zone->busy) continue;
+        if (zone->busy == 0) {
             // Clear sign that a stop was requested: cancel the zone.
-            housesprinkler_control_cancel (ZoneActive->name);
+            housesprinkler_control_cancel (zone->control);
         }
-        if (ZoneActive->status == 'a') ZoneActive->status = 'i';
-        ZoneActive = 0;
-        PulseEnd = 0;
+        housesprinkler_zone_retire (i);
+        housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
     }
+    housesprinkler_zone_plan (now);
 
-    // Search for the next zone to be started.
-    // Because nexttime is initialized to current time, only zones that
-    // have exhausted their pulse and pause period are considered here.
-    // So this loop searches for a zone that meet two conditions: ready
+    // Select the next zones to be started, as long as the limits allow.
+    // Because the start time is initialized to current time, only zones
+    // that have exhausted their pulse and pause period are considered.
+    // So this searches for a zone that meet two conditions: ready
     // to start, and the "oldest" to be so. This is done to maximize
     // the soak time, beyond the minimum as configured.
     // If there are multiple zones of the same "age", then the one with
     // the longest elapsed runtime is selected: this is done to prioritize
     // the longest running zones, especially when the program starts,
     // because these long running zones are on the critical path and
-    // define when the program will end.
+    // define when the program will end. This is the order of both heaps.
     //
-    int    remaining = 0;
-    int    nextzone = -1;
-    time_t nexttime = now + 1;
-    for (i = 0; i < QueueNext; ++i) {
-        if (Queue[i].runtime == 0) continue;
-        if (Queue[i].context[0]) {
-            // Activate a zone that is part of a program only at the start of
-            // the minute.
-            // The reason for doing so it to make it easier to calculate
-            // water usage: we can sample water flow sensor on a minute basis.
-            // We don't do this synchronization for manual controls.
-            // We accept to be late by one second, as this is the time
-            // precision used by the periodic mechanism anyway.
-            //
-            if (now % 60 > 1) continue;
-        }
-        time_t nexton = Queue[i].nexton;
-        if (nexton > 0) {
-            if (nexton > nexttime) continue;
-            int elapsed = housesprinkler_zone_elapsed(i);
-            DEBUG ("queue %s has elapse time %d\n", Zones[Queue[i].zone].name, elapsed);
-            if (nexton < nexttime) {
-                nextzone = i;
-                nexttime = nexton;
-                remaining = elapsed;
-            } else if (elapsed > remaining) {
-                nextzone = i;
-                remaining = elapsed;
-            }
-        }
-    }
+    // Activate a zone that is part of a program only at the start of
+    // the minute.
+    // The reason for doing so it to make it easier to calculate
+    // water usage: we can sample water flow sensor on a minute basis.
+    // We don't do this synchronization for manual controls.
+    // We accept to be late by one second, as this is the time
+    // precision used by the periodic mechanism anyway.
+    //
+    // A ready zone that does not fit within the feed or flow limits
+    // is set aside, so that the next candidates may still be started.
+    //
+    // In planner mode, the program zones are ordered by the plan instead,
+    // see housesprinkler_zone_plan(), and the manual zones come first.
+    //
+    while (ZonesActiveCount < ZonesConcurrent) {
 
-    if (nextzone >= 0) {
+        SprinklerQueueHeap *heap = housesprinkler_zone_next (now);
+        if (!heap) break;
+
+        int nextzone = housesprinkler_zone_pop (heap);
         int zone = Queue[nextzone].zone;
+        if (!housesprinkler_zone_fits (zone)) {
+            QueueDeferred[deferred++] = nextzone;
+            continue;
+        }
+        if (!housesprinkler_control_ready (Zones[zone].control)) {
+            housesprinkler_zone_unreachable (nextzone, now);
+            continue;
+        }
         int pulse = 0;
+        time_t start = now; // When the valve is expected to open.
         if (Queue[nextzone].context[0] == 0) {
             // This is a manual zone control: just use the runtime as provided
             // by the user without any adjustment or cycle.
@@ -338,8 +1037,13 @@ static void housesprinkler_zone_schedule (time_t now) {
             Queue[nextzone].nexton = now + pulse;
         } else {
             // This zone control is part of a program: apply adjustments
-            // and follow the configured cycle.
+            // and follow the configured cycle. The command is sent ahead
+            // of the minute boundary, see housesprinkler_zone_next().
             //
+            int latency = housesprinkler_zone_latency (zone);
+            start = now + housesprinkler_zone_lead (zone);
+            ZonesDrift += ((now - (start - (start % 60))) * 1000) + latency;
+
             pulse = Zones[zone].pulse;
             if (Queue[nextzone].hydrate > 0) {
                 // The first pulse is meant to hydrate the soil (clay).
@@ -356,28 +1060,141 @@ static void housesprinkler_zone_schedule (time_t now) {
             // last pulse: if the same zone is activated again, we don't want
             // to ever skip the pause.
             //
-            Queue[nextzone].nexton = now + pulse + Zones[zone].pause;
+            Queue[nextzone].nexton = start + pulse + Zones[zone].pause;
         }
-        if (Zones[zone].feed) {
+        if (Queue[nextzone].runtime > 0)
+            housesprinkler_zone_wait (nextzone);
+        else
+            housesprinkler_zone_expire (nextzone);
+        if (Zones[zone].feedid >= 0) {
             housesprinkler_feed_activate
-                (Zones[zone].feed, pulse, Queue[nextzone].context);
+                (Zones[zone].feedid, pulse, Queue[nextzone].context);
+        }
+        housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
+        housesprinkler_control_start
+            (Zones[zone].control, pulse, Queue[nextzone].context);
+        housesprinkler_history_record (Zones[zone].name, start, pulse,
+                                       Queue[nextzone].context,
+                                       Queue[nextzone].index);
+
+        // This zone's slot is released after the pulse and the optional
+        // index valve pause have been exhausted.
+        Zones[zone].busy = start + pulse + ZoneIndexValvePause;
+        Zones[zone].pulsestart = start;
+        Zones[zone].pulseend = start + pulse;
+        Zones[zone].status = 'a';
+        ZonesActive[ZonesActiveCount++] = zone;
+    }
+    housesprinkler_zone_sleep (now);
+
+    // The zones set aside wait again, but cannot start before another
+    // zone completes, or is activated: this does not change the wakeup.
+    //
+    if (deferred > 0) {
+        time_t wakeup = housesprinkler_timer_deadline (QueueTimer);
+        for (i = 0; i < deferred; ++i)
+            housesprinkler_zone_wait (QueueDeferred[i]);
+        housesprinkler_timer_set (QueueTimer, wakeup);
+    }
+}
+
+// Stop the zones that belong to a partition this instance just released:
+// the new owner is now in control. (The new owner does not resume the
+// watering that was in progress.)
+//
+static void housesprinkler_zone_release (void) {
+
+    int i;
+    int released = 0;
+
+    for (i = 0; i < QueueNext; ++i) {
+        if (housesprinkler_partition_local (Zones[Queue[i].zone].partition))
+            continue;
+        Queue[i].hydrate = 0;
+        Queue[i].runtime = 0;
+        released += 1;
+    }
+    for (i = 0; i < ZonesActiveCount; ++i) {
+        SprinklerZone *zone = Zones + ZonesActive[i];
+        if (housesprinkler_partition_local (zone->partition)) continue;
+        zone->busy = 0; // Cancel on the next schedule.
+        released += 1;
+    }
+    if (released > 0) {
+        DEBUG ("Released %d zone activations to another instance\n", released);
+        housesprinkler_zone_reindex ();
+        housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
+    }
+}
+
+// Return the pulses of the active zones which control failed to start
+// to the queue. Nothing was watered, so the whole pulse is returned.
+//
+static void housesprinkler_zone_failed (time_t now) {
+
+    int i;
+
+    for (i = ZonesActiveCount - 1; i >= 0; --i) {
+        SprinklerZone *zone = Zones + ZonesActive[i];
+        if (housesprinkler_control_state (zone->control) != 'e') continue;
+
+        int queued = QueueByZone[ZonesActive[i]];
+        int pulse = (int)(zone->pulseend - zone->pulsestart);
+        if (queued >= 0) {
+            // Never return more than what was taken from this entry.
+            int taken = Queue[queued].requested - Queue[queued].runtime;
+            if (pulse > taken) pulse = taken;
         }
-        if (housesprinkler_control_start
-                (Zones[zone].name, pulse, Queue[nextzone].context)) {
-            // Schedule the next zone after the pulse and the optional index
-            // valve pause have been exhausted.
-            ZonesBusy = now + pulse + ZoneIndexValvePause;
-            ZoneActive = Zones + zone;
-            PulseEnd = now + pulse;
-            ZoneActive->status = 'a';
+        housesprinkler_history_failed (zone->name, zone->pulsestart);
+        if (queued >= 0 && pulse > 0) {
+            if (++Queue[queued].failures > ZONE_REQUEUE_MAX) {
+                houselog_event ("ZONE", zone->name, "ABANDON",
+                                "AFTER %d CONTROL FAILURES",
+                                Queue[queued].failures);
+            } else {
+                // The next pulse still waits for the end of the pause (or
+                // of the pulse, if manual), which gives the control server
+                // some time to recover.
+                houselog_event ("ZONE", zone->name, "REQUEUE",
+                                "%s AFTER CONTROL FAILURE",
+                                housesprinkler_time_period_printable(pulse));
+                Queue[queued].runtime += pulse;
+                if (Queue[queued].nexton < now) Queue[queued].nexton = now;
+                housesprinkler_zone_wait (queued);
+            }
         }
+        housesprinkler_zone_retire (i);
+        housesprinkler_status_changed (SPRINKLER_STATUS_ZONE);
     }
 }
 
 void housesprinkler_zone_periodic (time_t now) {
 
     if (!ZonesCount) return;
-    if (now) housesprinkler_zone_schedule  (now);
+    if (!now) return;
+
+    static long partitions = 0;
+    long generation = housesprinkler_partition_generation ();
+    if (generation != partitions) {
+        partitions = generation;
+        housesprinkler_zone_release ();
+    }
+
+    static long failures = 0;
+    long failed = housesprinkler_control_failures ();
+    if (failed != failures) {
+        failures = failed;
+        housesprinkler_zone_failed (now);
+    }
+
+    // Time went backward: the wakeup time cannot be trusted.
+    static time_t latest = 0;
+    if (now < latest) housesprinkler_timer_wakeup (QueueTimer);
+    latest = now;
+
+    // Nothing to do until then.
+    if (!housesprinkler_timer_due (QueueTimer, now)) return;
+    housesprinkler_zone_schedule (now);
 }
 
 int housesprinkler_zone_idle (void) {
@@ -391,65 +1208,73 @@ int housesprinkler_zone_idle (void) {
     // This avoids declaring a program as "complete" only 30 minutes
     // or so after the last watering.
     //
-    int i;
     time_t now = sprinkler_schedulingtime(time(0));
 
-    if (PulseEnd >= now) return 0; // One zone is active.
-    for (i = 0; i < QueueNext; ++i) {
-        if (Queue[i].runtime > 0) return 0; // One zone will be active.
+    int i;
+    for (i = 0; i < ZonesActiveCount; ++i) {
+        if (Zones[ZonesActive[i]].pulseend >= now) return 0; // Zone active.
     }
-    return 1;
+
+    // The entries with some runtime left are exactly those waiting.
+    return (QueueManual.count + QueueProgram.count) == 0;
+}
+
+int housesprinkler_zone_active (int i, time_t *start, time_t *end) {
+    if (i < 0 || i >= ZonesActiveCount) return -1;
+    const SprinklerZone *zone = Zones + ZonesActive[i];
+    *start = zone->pulsestart;
+    *end = zone->pulseend;
+    return ZonesActive[i];
 }
 
-int housesprinkler_zone_status (char *buffer, int size) {
+long housesprinkler_zone_drift (void) {
+    return ZonesDrift;
+}
+
+void housesprinkler_zone_status (SprinklerBuffer *buffer) {
 
     int i;
-    int cursor;
     const char *prefix = "";
 
-    cursor = snprintf (buffer+cursor, size-cursor, "\"zones\":[");
-    if (cursor >= size) goto overflow;
-    prefix = "";
+    housesprinkler_buffer_printf (buffer, "\"zones\":[");
 
     for (i = 0; i < ZonesCount; ++i) {
-        int state = housesprinkler_control_state (Zones[i].name);
+        int state = housesprinkler_control_state (Zones[i].control);
         if ((state != 'e') && (state != 'u')) state = Zones[i].status;
-        cursor += snprintf (buffer+cursor, size-cursor, "%s[\"%s\",\"%c\"]",
-                            prefix, Zones[i].name, state);
-        if (cursor >= size) goto overflow;
+        housesprinkler_buffer_printf (buffer, "%s[\"%s\",\"%c\"]",
+                                      prefix, Zones[i].name, state);
         prefix = ",";
     }
 
-    cursor += snprintf (buffer+cursor, size-cursor, "],\"queue\":[");
-    if (cursor >= size) goto overflow;
+    housesprinkler_buffer_printf (buffer, "],\"queue\":[");
     prefix = "";
 
     for (i = 0; i < QueueNext; ++i) {
         if (Queue[i].runtime > 0) {
-            cursor += snprintf (buffer+cursor, size-cursor,
-                                "%s[\"%s\",%d]",
-                                prefix,
-                                Zones[Queue[i].zone].name,
-                                Queue[i].runtime);
-            if (cursor >= size) goto overflow;
+            housesprinkler_buffer_printf (buffer, "%s[\"%s\",%d]",
+                                          prefix,
+                                          Zones[Queue[i].zone].name,
+                                          Queue[i].runtime);
             prefix = ",";
         }
     }
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
-
-    if (ZoneActive) {
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            ",\"active\":\"%s\"", ZoneActive->name);
-        if (cursor >= size) goto overflow;
-    }
+    housesprinkler_buffer_printf (buffer, "]");
 
-    return cursor;
+    if (ZonesPredicted > 0 && !housesprinkler_zone_idle ())
+        housesprinkler_buffer_printf (buffer, ",\"predicted\":%ld",
+                                      (long)ZonesPredicted);
 
-overflow:
-    houselog_trace (HOUSE_FAILURE, "STATUS",
-                    "BUFFER TOO SMALL (NEED %d bytes)", cursor);
-    buffer[0] = 0;
-    return 0;
+    if (ZonesActiveCount > 0) {
+        housesprinkler_buffer_printf (buffer, ",\"active\":\"%s\"",
+                                      Zones[ZonesActive[0]].name);
+        housesprinkler_buffer_printf (buffer, ",\"actives\":[");
+        prefix = "";
+        for (i = 0; i < ZonesActiveCount; ++i) {
+            housesprinkler_buffer_printf (buffer, "%s\"%s\"",
+                                          prefix, Zones[ZonesActive[i]].name);
+            prefix = ",";
+        }
+        housesprinkler_buffer_printf (buffer, "]");
+    }
 }
 
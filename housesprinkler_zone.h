@@ -19,11 +19,17 @@
  *
  */
 
+#include "housesprinkler_buffer.h"
+
 void housesprinkler_zone_refresh (void);
-void housesprinkler_zone_activate (const char *name,
-                                   int pulse, const char *context);
+void housesprinkler_zone_resolve (void);
+int  housesprinkler_zone_find (const char *name);
+void housesprinkler_zone_activate (int zone, int pulse,
+                                   const char *context, int index);
 void housesprinkler_zone_stop (void);
 void housesprinkler_zone_periodic (time_t now);
 int  housesprinkler_zone_idle (void);
-int  housesprinkler_zone_status (char *buffer, int size);
+int  housesprinkler_zone_active (int i, time_t *start, time_t *end);
+long housesprinkler_zone_drift (void);
+void housesprinkler_zone_status (SprinklerBuffer *buffer);
 
@@ -0,0 +1,384 @@
+/* housesprinkler - A simple home web server for sprinkler control
+ *
+ * Copyright 2023, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesprinklersim.c - Offline simulation of the sprinkler schedules.
+ *
+ * SYNOPSYS:
+ *
+ * This program runs the actual schedule, program, season, zone and feed
+ * modules against a virtual clock, as fast as the CPU allows. The controls
+ * are simulated: no HTTP request is ever sent.
+ *
+ * housesprinklersim [-config=FILE] [-backup=FILE] [-start=YYYY-MM-DD]
+ *                   [-days=N] [-index=N] [-latency=MS] [-quiet] [-debug]
+ *
+ *    -config=FILE      The sprinkler configuration to simulate.
+ *    -backup=FILE      The sprinkler state to start from. This file is only
+ *                      read, never written. The sprinkler system is always
+ *                      turned on, even if the state says otherwise.
+ *    -start=DATE       The first simulated day (default: today).
+ *    -days=N           The number of simulated days (default: 7).
+ *    -index=N          Use a fixed watering index, as if received from
+ *                      an index provider (default: no index provider).
+ *    -latency=MS       The response time of the control servers, used to
+ *                      send the zone commands early (default: 0).
+ *    -quiet            Do not print the timeline, only the summaries.
+ *
+ * The output is made of three parts:
+ * - The timeline of all zone and feed activations (unless -quiet).
+ * - One line per watering session (typically one per night): start,
+ *   elapsed time and total zone watering time. A session starts with
+ *   the first zone activation and ends when the zones are idle.
+ * - The total watering time per zone, and the simulation speed.
+ *
+ * The simulation speed is reported both in simulated seconds and in
+ * events (control activations) per second of CPU time, so that changes
+ * to the scheduling logic can be benchmarked.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+
+#include "housesprinkler.h"
+#include "housesprinkler_hash.h"
+#include "housesprinkler_time.h"
+#include "housesprinkler_state.h"
+#include "housesprinkler_config.h"
+#include "housesprinkler_control.h"
+#include "housesprinkler_index.h"
+#include "housesprinkler_feed.h"
+#include "housesprinkler_zone.h"
+#include "housesprinkler_partition.h"
+#include "housesprinkler_season.h"
+#include "housesprinkler_program.h"
+#include "housesprinkler_schedule.h"
+
+static int SimDebug = 0;
+static int SimQuiet = 0;
+static int SimIndex = -1; // No index provider.
+static int SimLatency = 0; // Milliseconds.
+
+static time_t SimNow = 0;
+
+// A simulated control point.
+//
+typedef struct {
+    const char *name;
+    const char *type;
+    time_t deadline;
+    long   watered;
+    int    pulses;
+} SimControl;
+
+static SimControl  *SimControls = 0;
+static int          SimControlsCount = 0;
+static int          SimControlsSize = 0;
+static SprinklerHash SimControlsByName;
+
+static long SimEvents = 0;
+
+// The current watering session.
+static time_t SessionStart = 0;
+static time_t SessionEnd = 0;
+static long   SessionWatered = 0;
+static int    SessionCount = 0;
+
+time_t sprinkler_schedulingtime (time_t now) {
+    return SimNow; // The real time does not matter here.
+}
+
+int sprinkler_isdebug (void) {
+    return SimDebug;
+}
+
+static char SimHost[128];
+
+const char *sprinkler_host(void) {
+    return SimHost;
+}
+
+static const char *sim_timestamp (time_t t) {
+    static char Printable[32];
+    strftime (Printable, sizeof(Printable), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    return Printable;
+}
+
+static SimControl *sim_control_search (const char *name) {
+    int i = housesprinkler_hash_find (&SimControlsByName, name);
+    return (i >= 0) ? SimControls+i : 0;
+}
+
+static SimControl *sim_control_get (int control) {
+    if (control < 0 || control >= SimControlsCount) return 0;
+    return SimControls + control;
+}
+
+// The simulated controls: these replace housesprinkler_control.c.
+//
+void housesprinkler_control_reset (void) {
+    SimControlsCount = 0;
+    housesprinkler_hash_reset (&SimControlsByName, SimControlsSize);
+}
+
+void housesprinkler_control_declare (const char *name, const char *type) {
+
+    if (sim_control_search (name)) return;
+    if (SimControlsCount >= SimControlsSize) return;
+
+    SimControl *control = SimControls + SimControlsCount;
+    control->name = name;
+    control->type = type;
+    control->deadline = 0;
+    control->watered = 0;
+    control->pulses = 0;
+    housesprinkler_hash_add (&SimControlsByName, name, SimControlsCount++);
+}
+
+int housesprinkler_control_prune (void) {
+    return 0;
+}
+
+int housesprinkler_control_find (const char *name) {
+    if (!name) return -1;
+    return housesprinkler_hash_find (&SimControlsByName, name);
+}
+
+void housesprinkler_control_event (int control, int enable, int once) { }
+
+int housesprinkler_control_start (int id, int pulse, const char *context) {
+
+    SimControl *control = sim_control_get (id);
+    if (!control) {
+        printf ("%s CONTROL %d UNKNOWN\n", sim_timestamp(SimNow), id);
+        return 0;
+    }
+    const char *name = control->name;
+    if (control->deadline > SimNow + pulse) {
+        pulse = (int)(control->deadline - SimNow); // Never shortened.
+    }
+    if (!context || context[0] == 0) context = "MANUAL";
+    if (!SimQuiet)
+        printf ("%s %s %s ON FOR %d SECONDS (%s)\n",
+                sim_timestamp(SimNow), control->type, name, pulse, context);
+
+    SimEvents += 1;
+    if (strcmp (control->type, "ZONE") == 0) {
+        if (!SessionStart) SessionStart = SimNow;
+        if (SimNow + pulse > SessionEnd) SessionEnd = SimNow + pulse;
+        SessionWatered += pulse;
+        control->watered += pulse;
+        control->pulses += 1;
+    }
+    control->deadline = SimNow + pulse;
+    return 1;
+}
+
+static void sim_control_cancel (SimControl *control) {
+    if (control->deadline <= SimNow) return;
+    if (!SimQuiet)
+        printf ("%s %s %s CANCEL\n",
+                sim_timestamp(SimNow), control->type, control->name);
+    control->deadline = 0;
+    SimEvents += 1;
+}
+
+void housesprinkler_control_cancel (int id) {
+    SimControl *control = sim_control_get (id);
+    if (control) sim_control_cancel (control);
+}
+
+void housesprinkler_control_cancel_all (void) {
+    int i;
+    for (i = 0; i < SimControlsCount; ++i) sim_control_cancel (SimControls + i);
+}
+
+char housesprinkler_control_state (int id) {
+    SimControl *control = sim_control_get (id);
+    if (!control) return 'u';
+    return (control->deadline > SimNow) ? 'a' : 'i';
+}
+
+int housesprinkler_control_ready (int id) {
+    return sim_control_get (id) != 0;
+}
+
+int housesprinkler_control_latency (int id) {
+    return SimLatency;
+}
+
+long housesprinkler_control_failures (void) {
+    return 0; // The simulated controls never fail.
+}
+
+void housesprinkler_control_flush (void) { }
+
+// The simulated index provider: none, or a fixed value.
+//
+const char *housesprinkler_index_origin (void) {
+    return (SimIndex >= 0) ? "simulation" : "default";
+}
+
+int housesprinkler_index_priority (void) {
+    return (SimIndex >= 0) ? 1000 : 0;
+}
+
+int housesprinkler_index_get (void) {
+    return (SimIndex >= 0) ? SimIndex : 100;
+}
+
+void sprinkler_refresh (void) {
+
+    const SprinklerConfig *config = housesprinkler_config_compiled ();
+    int size = config->zonescount + config->feedscount;
+
+    if (size > SimControlsSize) {
+        SimControls = realloc (SimControls, size * sizeof(SimControl));
+        SimControlsSize = size;
+    }
+    housesprinkler_control_reset ();
+    housesprinkler_partition_refresh ();
+    housesprinkler_zone_refresh ();
+    housesprinkler_feed_refresh ();
+    housesprinkler_season_refresh ();
+    housesprinkler_program_refresh ();
+    housesprinkler_schedule_refresh ();
+    housesprinkler_feed_resolve ();
+    housesprinkler_zone_resolve ();
+}
+
+static void sim_session_end (void) {
+
+    char elapsed[128];
+
+    snprintf (elapsed, sizeof(elapsed), "%s",
+              housesprinkler_time_delta_printable (SessionStart, SimNow));
+    SessionCount += 1;
+    printf ("SESSION %s, ELAPSED %s, WATERING %s, DRIFT %ld MS\n",
+            sim_timestamp(SessionStart), elapsed,
+            housesprinkler_time_period_printable ((int)SessionWatered),
+            housesprinkler_zone_drift());
+    SessionStart = SessionEnd = 0;
+    SessionWatered = 0;
+}
+
+static time_t sim_start (const char *date) {
+
+    time_t now = time(0);
+    struct tm local = *localtime(&now);
+
+    if (date) {
+        int year, month, day;
+        if (sscanf (date, "%d-%d-%d", &year, &month, &day) != 3) {
+            fprintf (stderr, "invalid date %s\n", date);
+            exit (1);
+        }
+        local.tm_year = year - 1900;
+        local.tm_mon = month - 1;
+        local.tm_mday = day;
+    }
+    local.tm_hour = local.tm_min = local.tm_sec = 0;
+    local.tm_isdst = -1;
+    return mktime (&local);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    int days = 7;
+    const char *value = 0;
+    const char *date = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-debug", argv[i])) {
+            SimDebug = 1;
+        } else if (echttp_option_present ("-quiet", argv[i])) {
+            SimQuiet = 1;
+        } else if (echttp_option_match ("-days=", argv[i], &value)) {
+            days = atoi (value);
+        } else if (echttp_option_match ("-index=", argv[i], &value)) {
+            SimIndex = atoi (value);
+        } else if (echttp_option_match ("-latency=", argv[i], &value)) {
+            SimLatency = atoi (value);
+        } else if (echttp_option_match ("-start=", argv[i], &value)) {
+            date = value;
+        }
+    }
+
+    // The state backup is loaded, but never saved since the state
+    // periodic function is not called: the simulation can safely use
+    // the backup of a live sprinkler controller.
+    //
+    gethostname (SimHost, sizeof(SimHost));
+    housesprinkler_state_load (argc, argv);
+
+    const char *error = housesprinkler_config_load (argc, argv);
+    if (error) {
+        fprintf (stderr, "%s: %s\n", housesprinkler_config_name(), error);
+        return 1;
+    }
+    SimNow = sim_start (date);
+    housesprinkler_schedule_initialize (argc, argv);
+    sprinkler_refresh ();
+    if (!housesprinkler_schedule_on()) housesprinkler_schedule_switch ();
+
+    time_t end = SimNow + (days * 86400);
+    struct timespec started;
+    clock_gettime (CLOCK_MONOTONIC, &started);
+
+    for (; SimNow < end; ++SimNow) {
+        // Same sequence as the background function of the real program.
+        housesprinkler_zone_periodic (SimNow);
+        housesprinkler_program_periodic (SimNow);
+        housesprinkler_schedule_periodic (SimNow);
+
+        if (SessionStart && SimNow >= SessionEnd && housesprinkler_zone_idle())
+            sim_session_end ();
+    }
+    if (SessionStart) sim_session_end ();
+
+    struct timespec ended;
+    clock_gettime (CLOCK_MONOTONIC, &ended);
+    double cpu = (ended.tv_sec - started.tv_sec)
+                     + ((ended.tv_nsec - started.tv_nsec) / 1000000000.0);
+
+    for (i = 0; i < SimControlsCount; ++i) {
+        SimControl *control = SimControls + i;
+        if (strcmp (control->type, "ZONE")) continue;
+        printf ("ZONE %s: %d PULSES, WATERING %s\n",
+                control->name, control->pulses,
+                control->watered > 0 ?
+                    housesprinkler_time_period_printable ((int)control->watered)
+                    : "0 SECONDS");
+    }
+    printf ("SIMULATED %d DAYS, %d SESSIONS, %ld EVENTS IN %.3f SECONDS\n",
+            days, SessionCount, SimEvents, cpu);
+    if (cpu > 0) {
+        printf ("SPEED: %.0f SIMULATED SECONDS/S, %.0f EVENTS/S\n",
+                (days * 86400.0) / cpu, SimEvents / cpu);
+    }
+    return 0;
+}
+
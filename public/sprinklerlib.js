@@ -48,7 +48,15 @@
 //
 //   sprinklerStatus(callback);
 //
-//      This function retrieves the current status.
+//      This function retrieves the current status. If the status stream
+//      is open, the latest status received is used instead.
+//
+//   sprinklerStream(callback);
+//
+//      This function opens the status stream (if not already open) and
+//      calls the callback with the complete status each time the status
+//      changes. It returns false if the browser cannot use a stream: the
+//      caller must then poll the status instead.
 //
 //   sprinklerHardwareInfo(callback);
 //
@@ -90,6 +98,10 @@
 
 var SprinklerUseIndex = false;
 
+var SprinklerLatest = null;
+var SprinklerStream = null;
+var SprinklerStreamListeners = new Array();
+
 function sprinklerShowDuration (seconds) {
    var minutes = Math.floor(seconds / 60);
    seconds = Math.floor(seconds % 60);
@@ -112,9 +124,12 @@ function sprinklerSetContent (classname, content) {
 }
 
 function sprinklerApplyUpdate (text) {
-
    // var type = command.getResponseHeader("Content-Type");
-   var response = JSON.parse(text);
+   sprinklerApplyStatus (JSON.parse(text));
+}
+
+function sprinklerApplyStatus (response) {
+
    var content;
    var program;
 
@@ -129,7 +144,10 @@ function sprinklerApplyUpdate (text) {
    } else {
       program = null;
    }
-   if (response.sprinkler.zone.active) {
+   if (response.sprinkler.zone.actives) {
+      content = response.sprinkler.zone.actives.join(', ')+' ACTIVE';
+      if (! program) program = 'MANUAL';
+   } else if (response.sprinkler.zone.active) {
       content = response.sprinkler.zone.active+' ACTIVE';
       if (! program) program = 'MANUAL';
    } else {
@@ -209,10 +227,50 @@ function sprinklerUpdate () {
 }
 
 function sprinklerInfo () {
+   if (sprinklerStream (sprinklerApplyStatus)) {
+      // The rain delay countdown still needs to be updated every second.
+      setInterval (function () {
+         if (SprinklerLatest) sprinklerApplyStatus (SprinklerLatest);
+      }, 1000);
+      return;
+   }
    sprinklerUpdate();
    setInterval (sprinklerUpdate, 1000);
 }
 
+// Each stream event contains only the status sections that have changed.
+//
+function sprinklerStreamMerge (update) {
+   if (! SprinklerLatest) {
+      SprinklerLatest = update;
+      return;
+   }
+   SprinklerLatest.host = update.host;
+   SprinklerLatest.proxy = update.proxy;
+   SprinklerLatest.timestamp = update.timestamp;
+   SprinklerLatest.generation = update.generation;
+   for (var section in update.sprinkler) {
+      SprinklerLatest.sprinkler[section] = update.sprinkler[section];
+   }
+}
+
+function sprinklerStream (callback) {
+   if (typeof(EventSource) === 'undefined') return false;
+   SprinklerStreamListeners.push (callback);
+   if (! SprinklerStream) {
+      SprinklerStream = new EventSource ('/sprinkler/stream');
+      SprinklerStream.addEventListener ('status', function (event) {
+         sprinklerStreamMerge (JSON.parse(event.data));
+         for (var i = 0; i < SprinklerStreamListeners.length; ++i) {
+            SprinklerStreamListeners[i] (SprinklerLatest);
+         }
+      });
+   } else if (SprinklerLatest) {
+      callback (SprinklerLatest);
+   }
+   return true;
+}
+
 function sprinklerConfig (callback) {
    var command = new XMLHttpRequest();
    command.open("GET", "/sprinkler/config");
@@ -254,6 +312,10 @@ function sprinklerSaveConfig (config) {
 }
 
 function sprinklerStatus (callback) {
+   if (SprinklerStream && SprinklerLatest) {
+      callback (SprinklerLatest);
+      return;
+   }
    var command = new XMLHttpRequest();
    command.open("GET", "/sprinkler/status");
    command.onreadystatechange = function () {